@@ -2,9 +2,16 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 
-#define PASSTHROUGH_RIGHT_VARIABLE_COUNT 13
+// 0-12 are channel 0's settings, then the channel count and per channel phase, division, wave slope and skew
+#define PASSTHROUGH_CHANNELS 13
+#define PASSTHROUGH_PHASE 14
+#define PASSTHROUGH_DIVISION (PASSTHROUGH_PHASE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_WAVESLOPE (PASSTHROUGH_DIVISION + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_SKEW (PASSTHROUGH_WAVESLOPE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_RIGHT_VARIABLE_COUNT (PASSTHROUGH_SKEW + PORT_MAX_CHANNELS)
 
 struct BPMLFO : Module {
 	enum ParamIds {
@@ -45,89 +52,16 @@ struct BPMLFO : Module {
 
 	
 
-	struct LowFrequencyOscillator {
-		float basePhase = 0.0;
-		double phase = 0.0;
-		float pw = 0.5;
-		double freq = 1.0;
-		bool offset = false;
-
-		void setPitch(float pitch) {
-			pitch = fminf(pitch, 8.0);
-			freq = powf(2.0, pitch);
-		}
-		void setFrequency(double frequency) {
-			freq = frequency;
-		}
-		void setPulseWidth(float pw_) {
-			const float pwMin = 0.01;
-			pw = clamp(pw_, pwMin, 1.0f - pwMin);
-		}
-
-		void setBasePhase(float initialPhase) {
-			//Apply change, then remember
-			phase += initialPhase - basePhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-			else if (phase < 0)
-				phase += 1.0;	
-			basePhase = initialPhase;
-		}	
-
-		void hardReset()
-		{
-			phase = basePhase;
-		}
-
-		void step(double dt) {
-			double deltaPhase = fmin(freq * dt, 0.5);
-			phase += deltaPhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-		}
-		float sin() {
-			double phaseToUse = phase - 0.25; //Sin is out of ohase of other waveforms
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			if (offset)
-				return 1.0 - cosf(2*M_PI * phaseToUse);
-			else
-				return sinf(2*M_PI * phaseToUse);
-		}
-		float tri(float x) {
-			return 4.0 * fabsf(x - roundf(x));
-		}
-		float tri() {
-			if (offset)
-				return tri(phase);
-			else
-				return -1.0 + tri(phase - 0.75);
-		}
-		float saw(float x) {
-			return 2.0 * (x - roundf(x));
-		}
-		float saw() {
-			if (offset)
-				return 2.0 * phase;
-			else
-				return saw(phase);
-		}
-		float sqr() {
-			float sqr = (phase < pw) ? 1.0 : -1.0;
-			return offset ? sqr + 1.0 : sqr;
-		}
-		float progress() {
-			return phase;
-		}
-	};
-
 	// Expander
 	float consumerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// this module must read from here
 	float producerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// mother will write into here
 
 
-	LowFrequencyOscillator oscillator;
+	// Four channels per oscillator, all synced to the one clock
+	LowFrequencyOscillator<simd::float_4> oscillator[PORT_MAX_CHANNELS / 4];
+	// Cycles of the undivided clock since the last reset, for putting a channel that comes into use in step
+	double clockCycles = 0.0;
+	int activeChannels = 0; // channels in use last sample
 	dsp::SchmittTrigger clockTrigger,resetTrigger,holdTrigger,quantizePhaseTrigger;
 	
 	float multiplier = 1;
@@ -139,11 +73,15 @@ struct BPMLFO : Module {
 	bool firstClockReceived = false;
 	bool secondClockReceived = false;
 	bool phaseQuantized = false;
+	int channels = 1;
+
+	simd::float_4 channelDivision[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 channelPhase[PORT_MAX_CHANNELS / 4] = {};
 	
-	float sinOutputValue = 0.0;
-	float triOutputValue = 0.0;
-	float sawOutputValue = 0.0;
-	float sqrOutputValue = 0.0;
+	simd::float_4 sinOutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 triOutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 sawOutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 sqrOutputValue[PORT_MAX_CHANNELS / 4] = {};
 
 	//percentages
 	float multiplierPercentage = 0;
@@ -172,8 +110,8 @@ struct BPMLFO : Module {
 
 		configInput(CLOCK_INPUT, "Clock");
 		configInput(MULTIPLIER_INPUT, "Multiplier CV");
-		configInput(DIVISION_INPUT, "Division CV");
-		configInput(PHASE_INPUT, "Phase");
+		configInput(DIVISION_INPUT, "Division CV (polyphonic)");
+		configInput(PHASE_INPUT, "Phase (polyphonic)");
 		configInput(RESET_INPUT, "Reset");
 		configInput(HOLD_INPUT, "Hold");
 
@@ -238,45 +176,55 @@ struct BPMLFO : Module {
 		multiplier = clamp(multiplier,1.0f,128.0f);
 		multiplierPercentage = multiplier / 128.0;
 
-		division = params[DIVISION_PARAM].getValue();
-		if(inputs[DIVISION_INPUT].isConnected()) {
-			division +=(inputs[DIVISION_INPUT].getVoltage() * params[DIVISION_CV_ATTENUVERTER_PARAM].getValue() * 12.8);
-		}
-		division = clamp(division,1.0f,128.0f);
-		divisionPercentage = division / 128.0;
-
-		if(duration != 0) {
-			oscillator.setFrequency(1.0 / (duration / multiplier * division));
-		}
-		else {
-			oscillator.setFrequency(0);
-		}
+		// Division and phase CV set the channel count, everything else is shared
+		channels = std::max({1, inputs[DIVISION_INPUT].getChannels(), inputs[PHASE_INPUT].getChannels()});
+		int groups = (channels + 3) / 4;
 
 		if (quantizePhaseTrigger.process(params[QUANTIZE_PHASE_PARAM].getValue())) {
 			phaseQuantized = !phaseQuantized;
 		}
 		lights[QUANTIZE_PHASE_LIGHT].value = phaseQuantized;
 
+		// Only the groups in use are updated and stepped
+		bool offset = params[OFFSET_PARAM].getValue() > 0.0;
+		for(int g=0;g<groups;g++) {
+			simd::float_4 groupDivision = params[DIVISION_PARAM].getValue();
+			if(inputs[DIVISION_INPUT].isConnected()) {
+				groupDivision += inputs[DIVISION_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) * params[DIVISION_CV_ATTENUVERTER_PARAM].getValue() * 12.8f;
+			}
+			groupDivision = simd::clamp(groupDivision,1.0f,128.0f);
+			channelDivision[g] = groupDivision;
 
-		initialPhase = params[PHASE_PARAM].getValue();
-		if(inputs[PHASE_INPUT].isConnected()) {
-			initialPhase += (inputs[PHASE_INPUT].getVoltage() / 10 * params[PHASE_CV_ATTENUVERTER_PARAM].getValue());
+			simd::float_4 groupPhase = params[PHASE_PARAM].getValue();
+			if(inputs[PHASE_INPUT].isConnected()) {
+				groupPhase += inputs[PHASE_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) / 10.f * params[PHASE_CV_ATTENUVERTER_PARAM].getValue();
+			}
+			groupPhase -= simd::floor(groupPhase);
+			if(g == 0)
+				phasePercentage = groupPhase[0];
+			if(phaseQuantized) // Limit to 90 degree increments
+				groupPhase = simd::floor(groupPhase * 4.0f + 0.5f) / 4.0f;
+			channelPhase[g] = groupPhase;
+
+			if(duration != 0) {
+				oscillator[g].setFrequency(simd::float_4(multiplier / duration) / groupDivision);
+			}
+			else {
+				oscillator[g].setFrequency(0.f);
+			}
+			oscillator[g].offset = offset;
+			oscillator[g].setBasePhase(groupPhase);
 		}
-		if (initialPhase >= 1.0)
-			initialPhase -= 1.0;
-		else if (initialPhase < 0)
-			initialPhase += 1.0;	
-		phasePercentage = initialPhase;
-		if(phaseQuantized) // Limit to 90 degree increments
-			initialPhase = std::round(initialPhase * 4.0f) / 4.0f;
-		
-		oscillator.offset = (params[OFFSET_PARAM].getValue() > 0.0);
-		oscillator.setBasePhase(initialPhase);
+		division = channelDivision[0][0];
+		divisionPercentage = division / 128.0;
+		initialPhase = channelPhase[0][0];
 
-			
 		if(inputs[RESET_INPUT].isConnected()) {
 			if(resetTrigger.process(inputs[RESET_INPUT].getVoltage())) {
-				oscillator.hardReset();
+				for(int g=0;g<PORT_MAX_CHANNELS / 4;g++) {
+					oscillator[g].hardReset();
+				}
+				clockCycles = 0.0;
 			}		
 		} 
 
@@ -291,22 +239,46 @@ struct BPMLFO : Module {
 			lights[HOLD_LIGHT].value = holding;
 		} 
 
-		if(!holding || (holding && params[HOLD_CLOCK_BEHAVIOR_PARAM].getValue() == 0.0)) {
-			oscillator.step(args.sampleTime);
+		// Channels coming into use pick up where the clock has got to, as though they had run all along. Until then a
+		// lane may have been running on another channel's CV, so lanes are put in step rather than whole groups
+		if(channels > activeChannels) {
+			for(int g=activeChannels/4;g<groups;g++) {
+				simd::float_4 cycles;
+				for(int l=0;l<4;l++) {
+					cycles[l] = (float) std::fmod(clockCycles / channelDivision[g][l], 1.0);
+				}
+				simd::float_4 comingIn = simd::float_4(g*4, g*4+1, g*4+2, g*4+3) >= simd::float_4(activeChannels);
+				oscillator[g].phase = simd::ifelse(comingIn, cycles, oscillator[g].phase);
+				oscillator[g].phaseRemainder = simd::ifelse(comingIn, 0.f, oscillator[g].phaseRemainder);
+			}
 		}
+		activeChannels = channels;
 
-		if(!holding) {
-			sinOutputValue = 5.0 * oscillator.sin();
-			triOutputValue = 5.0 * oscillator.tri();
-			sawOutputValue = 5.0 * oscillator.saw();
-			sqrOutputValue = 5.0 * oscillator.sqr();
+		if(!holding || (holding && params[HOLD_CLOCK_BEHAVIOR_PARAM].getValue() == 0.0)) {
+			if(duration != 0) {
+				clockCycles += multiplier / duration * args.sampleTime;
+			}
+			for(int g=0;g<groups;g++) {
+				oscillator[g].step(args.sampleTime);
+			}
 		}
 
-
-		outputs[SIN_OUTPUT].setVoltage(sinOutputValue);
-		outputs[TRI_OUTPUT].setVoltage(triOutputValue);
-		outputs[SAW_OUTPUT].setVoltage(sawOutputValue);
-		outputs[SQR_OUTPUT].setVoltage( sqrOutputValue);
+		for(int c=0;c<channels;c+=4) {
+			if(!holding) {
+				sinOutputValue[c/4] = 5.f * oscillator[c/4].sin(simd::float_4(-0.25f)); //Sin is out of phase of other waveforms
+				triOutputValue[c/4] = 5.f * oscillator[c/4].tri();
+				sawOutputValue[c/4] = 5.f * oscillator[c/4].saw();
+				sqrOutputValue[c/4] = 5.f * oscillator[c/4].sqr();
+			}
+			outputs[SIN_OUTPUT].setVoltageSimd(sinOutputValue[c/4], c);
+			outputs[TRI_OUTPUT].setVoltageSimd(triOutputValue[c/4], c);
+			outputs[SAW_OUTPUT].setVoltageSimd(sawOutputValue[c/4], c);
+			outputs[SQR_OUTPUT].setVoltageSimd(sqrOutputValue[c/4], c);
+		}
+		outputs[SIN_OUTPUT].setChannels(channels);
+		outputs[TRI_OUTPUT].setChannels(channels);
+		outputs[SAW_OUTPUT].setChannels(channels);
+		outputs[SQR_OUTPUT].setChannels(channels);
 
 		bool rightExpanderPresent = (rightExpander.module && (rightExpander.module->model == modelBPMLFOPhaseExpander));
 		if(rightExpanderPresent) {
@@ -324,6 +296,13 @@ struct BPMLFO : Module {
 			messageToSlave[10] = 0.0f	;
 			messageToSlave[11] = 1.0f;
 			messageToSlave[12] = 0.5f;
+			messageToSlave[PASSTHROUGH_CHANNELS] = channels;
+			for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+				messageToSlave[PASSTHROUGH_PHASE + c] = channelPhase[c/4][c%4];
+				messageToSlave[PASSTHROUGH_DIVISION + c] = channelDivision[c/4][c%4];
+				messageToSlave[PASSTHROUGH_WAVESLOPE + c] = 1.0f;
+				messageToSlave[PASSTHROUGH_SKEW + c] = 0.5f;
+			}
 		}
 			
 	}
@@ -407,7 +386,7 @@ struct BPMLFOProgressDisplay : TransparentWidget {
 		if (!module)
 			return;
 
-		drawProgress(args,module->oscillator.progress());
+		drawProgress(args,module->oscillator[0].progress()[0]);
 		drawMultiplier(args, Vec(38, 47), module->multiplier);
 		drawDivision(args, Vec(104, 47), module->division);
 	}
@@ -4,9 +4,16 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 #define DISPLAY_SIZE 50
-#define PASSTHROUGH_RIGHT_VARIABLE_COUNT 13
+// 0-12 are channel 0's settings, then the channel count and per channel phase, division, wave slope and skew
+#define PASSTHROUGH_CHANNELS 13
+#define PASSTHROUGH_PHASE 14
+#define PASSTHROUGH_DIVISION (PASSTHROUGH_PHASE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_WAVESLOPE (PASSTHROUGH_DIVISION + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_SKEW (PASSTHROUGH_WAVESLOPE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_RIGHT_VARIABLE_COUNT (PASSTHROUGH_SKEW + PORT_MAX_CHANNELS)
 
 struct BPMLFO2 : Module {
 	enum ParamIds {
@@ -59,117 +66,18 @@ struct BPMLFO2 : Module {
 
 	
 
-	struct LowFrequencyOscillator {
-		float basePhase = 0.0;
-		double phase = 0.0;
-		double freq = 1.0;
-		float pw = 0.5;
-		float skew = 0.5; // Triangle
-		float waveSlope = 0.0; //Original (1 is sin)
-		bool offset = false;
-
-		float lerp(float v0, float v1, float t) {
-			return (1 - t) * v0 + t * v1;
-		}
-
-		void setPitch(float pitch) {
-			pitch = fminf(pitch, 8.0);
-			freq = powf(2.0, pitch);
-		}
-		void setFrequency(double frequency) {
-			freq = frequency;
-		}
-		void setPulseWidth(float pw_) {
-			const float pwMin = 0.01;
-			pw = clamp(pw_, pwMin, 1.0f - pwMin);
-		}
-		
-		void setBasePhase(float initialPhase) {
-			//Apply change, then remember
-			phase += initialPhase - basePhase;
-
-			//Regular Bounds Checking
-			if (phase >= 1.0)
-				phase -= 1.0;
-			else if (phase < 0)
-				phase += 1.0;	
-			basePhase = initialPhase;
-		}
-
-		void hardReset()
-		{
-			phase = basePhase;
-		}
-
-		void step(double dt) {
-			double deltaPhase = fmin(freq * dt, 0.5);
-			phase += deltaPhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-		}
-
-		float skewsawInternal(float x) {
-			//x = dsp::eucmod(x,1.0);
-			x = std::fabs(std::fmod(x ,1.0f));
-
-			float inverseSkew = 1 - skew;
-			float originalWave;
-			if (skew == 0 && x == 0) //Avoid /0 error
-				originalWave = 2;
-			if (x <= skew)
-				originalWave = 2.0 * (1- (-1 / skew * x + 1));
-			else
-				originalWave = 2.0 * (1-(1 / inverseSkew * (x - skew)));
-			return originalWave;
-		}
-		
-		float skewsaw(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset;
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			if (offset)
-				return lerp(skewsawInternal(phaseToUse),sin(phaseOffset),waveSlope);
-			
-			return lerp(skewsawInternal(phaseToUse) - 1 ,sin(phaseOffset),waveSlope); //Going to keep same phase for now				
-		}
-
-
-		float sin(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset - 0.25; //Sin is out of ohase of other waveforms
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			if (offset)
-				return 1.0 - cosf(2*M_PI * (phaseToUse-skew*0));
-			
-			return sinf(2*M_PI * (phaseToUse-skew*0));
-		}
-
-		float sqr(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset;
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			float sqr = (phaseToUse < pw) ? 1.0 : -1.0;
-			sqr = offset ? sqr + 1.0 : sqr;
-
-			float result = lerp(sqr,sin(phaseOffset),waveSlope);
-			return result;
-		}
-		
-		float progress() {
-			return phase;
-		}
-	};
-
 	// Expander
 	float consumerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// this module must read from here
 	float producerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// mother will write into here
 
 
 
-	LowFrequencyOscillator oscillator,displayOscillator;
+	// Four channels per oscillator, all synced to the one clock
+	LowFrequencyOscillator<simd::float_4> oscillator[PORT_MAX_CHANNELS / 4];
+	// Cycles of the undivided clock since the last reset, for putting a channel that comes into use in step
+	double clockCycles = 0.0;
+	int activeChannels = 0; // channels in use last sample
+	LowFrequencyOscillator<double> displayOscillator;
 	dsp::SchmittTrigger clockTrigger,resetTrigger,holdTrigger;
 	float multiplier = 1;
 	float division = 1;
@@ -184,11 +92,17 @@ struct BPMLFO2 : Module {
 	bool secondClockReceived = false;
 	bool phaseQuantized = false;
 	bool clockMode = false;
+	int channels = 1;
 
-	float lfoOutputValue = 0.0;
-	float lfo45OutputValue = 0.0;
-	float lfo90OutputValue = 0.0;
-	float lfo180OutputValue = 0.0;
+	simd::float_4 channelDivision[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 channelPhase[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 channelWaveSlope[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 channelSkew[PORT_MAX_CHANNELS / 4] = {};
+
+	simd::float_4 lfoOutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 lfo45OutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 lfo90OutputValue[PORT_MAX_CHANNELS / 4] = {};
+	simd::float_4 lfo180OutputValue[PORT_MAX_CHANNELS / 4] = {};
 
 	float lastWaveShape = -1;
 	float lastWaveSlope = -1;
@@ -231,8 +145,10 @@ struct BPMLFO2 : Module {
 
 		configInput(CLOCK_INPUT, "Clock");
 		configInput(MULTIPLIER_INPUT, "Multiplier CV");
-		configInput(DIVISION_INPUT, "Division CV");
-		configInput(PHASE_INPUT, "Phase");
+		configInput(DIVISION_INPUT, "Division CV (polyphonic)");
+		configInput(WAVESLOPE_INPUT, "Wave Slope (polyphonic)");
+		configInput(SKEW_INPUT, "Skew (polyphonic)");
+		configInput(PHASE_INPUT, "Phase (polyphonic)");
 		configInput(RESET_INPUT, "Reset");
 		configInput(HOLD_INPUT, "Hold");
 
@@ -314,30 +230,13 @@ void BPMLFO2::process(const ProcessArgs &args) {
 	multiplier = clamp(multiplier,1.0f,128.0f);
 	multiplierPercentage = multiplier / 128.0;
 
-	division = params[DIVISION_PARAM].getValue();
-	if(inputs[DIVISION_INPUT].isConnected()) {
-		division +=(inputs[DIVISION_INPUT].getVoltage() * params[DIVISION_CV_ATTENUVERTER_PARAM].getValue() * 12.8);
-	}
-	division = clamp(division,1.0f,128.0f);
-	divisionPercentage = division / 128.0;
+	// Division, phase, wave slope and skew CV set the channel count, everything else is shared
+	channels = std::max({1, inputs[DIVISION_INPUT].getChannels(), inputs[PHASE_INPUT].getChannels(), inputs[WAVESLOPE_INPUT].getChannels(), inputs[SKEW_INPUT].getChannels()});
+	int groups = (channels + 3) / 4;
 
-	if(slowParamCount % paramLimiter == 0) {
+	bool updateSlowParams = slowParamCount % paramLimiter == 0;
+	if(updateSlowParams) {
 		waveshape = params[WAVESHAPE_PARAM].getValue();
-
-		waveSlope = params[WAVESLOPE_PARAM].getValue();
-		if(inputs[WAVESLOPE_INPUT].isConnected()) {
-			waveSlope +=inputs[WAVESLOPE_INPUT].getVoltage() / 10 * params[WAVESLOPE_CV_ATTENUVERTER_PARAM].getValue();
-		}
-		waveSlope = clamp(waveSlope,0.0f,1.0f);
-		waveSlopePercentage = waveSlope;
-
-		skew = params[SKEW_PARAM].getValue();
-		if(inputs[SKEW_INPUT].isConnected()) {
-			skew +=inputs[SKEW_INPUT].getVoltage() / 10 * params[SKEW_CV_ATTENUVERTER_PARAM].getValue();
-		}
-		skew = clamp(skew,0.0f,1.0f);
-		waveSkewPercentage = skew;
-
 		slowParamCount = 0;
 	}
 	slowParamCount++;
@@ -352,24 +251,60 @@ void BPMLFO2::process(const ProcessArgs &args) {
 	}
 	lights[QUANTIZE_PHASE_LIGHT].value = phaseQuantized;
 
-	initialPhase = params[PHASE_PARAM].getValue();
-	if(inputs[PHASE_INPUT].isConnected()) {
-		initialPhase += (inputs[PHASE_INPUT].getVoltage() / 10 * params[PHASE_CV_ATTENUVERTER_PARAM].getValue());
+	// Only the groups in use are updated and stepped
+	bool offset = params[OFFSET_PARAM].getValue() > 0.0;
+	for(int g=0;g<groups;g++) {
+		simd::float_4 groupDivision = params[DIVISION_PARAM].getValue();
+		if(inputs[DIVISION_INPUT].isConnected()) {
+			groupDivision += inputs[DIVISION_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) * params[DIVISION_CV_ATTENUVERTER_PARAM].getValue() * 12.8f;
+		}
+		groupDivision = simd::clamp(groupDivision,1.0f,128.0f);
+		channelDivision[g] = groupDivision;
+
+		if(updateSlowParams || channels > activeChannels) {
+			simd::float_4 groupWaveSlope = params[WAVESLOPE_PARAM].getValue();
+			if(inputs[WAVESLOPE_INPUT].isConnected()) {
+				groupWaveSlope += inputs[WAVESLOPE_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) / 10.f * params[WAVESLOPE_CV_ATTENUVERTER_PARAM].getValue();
+			}
+			channelWaveSlope[g] = simd::clamp(groupWaveSlope,0.0f,1.0f);
+
+			simd::float_4 groupSkew = params[SKEW_PARAM].getValue();
+			if(inputs[SKEW_INPUT].isConnected()) {
+				groupSkew += inputs[SKEW_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) / 10.f * params[SKEW_CV_ATTENUVERTER_PARAM].getValue();
+			}
+			channelSkew[g] = simd::clamp(groupSkew,0.0f,1.0f);
+		}
+
+		simd::float_4 groupPhase = params[PHASE_PARAM].getValue();
+		if(inputs[PHASE_INPUT].isConnected()) {
+			groupPhase += inputs[PHASE_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) / 10.f * params[PHASE_CV_ATTENUVERTER_PARAM].getValue();
+		}
+		groupPhase -= simd::floor(groupPhase);
+		if(g == 0)
+			phasePercentage = groupPhase[0];
+		if(phaseQuantized) // Limit to 90 degree increments
+			groupPhase = simd::floor(groupPhase * 4.0f + 0.5f) / 4.0f;
+		channelPhase[g] = groupPhase;
+
+		if(duration != 0) {
+			oscillator[g].setFrequency(simd::float_4(multiplier / duration) / groupDivision);
+		}
+		else {
+			oscillator[g].setFrequency(0.f);
+		}
+		oscillator[g].offset = offset;
+		oscillator[g].setBasePhase(groupPhase);
+		oscillator[g].waveSlope = channelWaveSlope[g];
+		oscillator[g].skew = channelSkew[g];
+		oscillator[g].setPulseWidth(channelSkew[g]);
 	}
-	if (initialPhase >= 1.0)
-		initialPhase -= 1.0;
-	else if (initialPhase < 0)
-		initialPhase += 1.0;	
-	phasePercentage = initialPhase;
-	if(phaseQuantized) // Limit to 90 degree increments
-		initialPhase = std::round(initialPhase * 4.0f) / 4.0f;
-	
-	
-	oscillator.offset = (params[OFFSET_PARAM].getValue() > 0.0);
-	oscillator.setBasePhase(initialPhase);
-	oscillator.waveSlope = waveSlope;
-	oscillator.skew = skew;
-	oscillator.setPulseWidth(skew);
+	division = channelDivision[0][0];
+	divisionPercentage = division / 128.0;
+	initialPhase = channelPhase[0][0];
+	waveSlope = channelWaveSlope[0][0];
+	waveSlopePercentage = waveSlope;
+	skew = channelSkew[0][0];
+	waveSkewPercentage = skew;
 
 	//Recalcluate display waveform if something changed
 	if(lastWaveShape != waveshape || lastWaveSlope != waveSlope || lastSkew != skew) {
@@ -377,9 +312,9 @@ void BPMLFO2::process(const ProcessArgs &args) {
 		displayOscillator.skew = skew;
 		displayOscillator.setPulseWidth(skew);
 		displayOscillator.setFrequency(1.0);
-		displayOscillator.phase = 0;
+		displayOscillator.hardReset();
 		for(int i=0;i<DISPLAY_SIZE;i++) {
-			waveValues[i] = (waveshape == SKEWSAW_WAV ? displayOscillator.skewsaw(0.0) : displayOscillator.sqr(0.0)) * DISPLAY_SIZE / 2;
+			waveValues[i] = (waveshape == SKEWSAW_WAV ? displayOscillator.shapedSkewsaw(0.f) : displayOscillator.shapedSqr(0.f)) * DISPLAY_SIZE / 2;
 			displayOscillator.step(1.0 / DISPLAY_SIZE);			
 		}
 		lastWaveShape = waveshape;
@@ -387,16 +322,12 @@ void BPMLFO2::process(const ProcessArgs &args) {
 		lastSkew = skew;
 	}
 
-	if(duration != 0) {
-		oscillator.setFrequency(1.0 / (duration / multiplier * division));
-	}
-	else {
-		oscillator.setFrequency(0);
-	}
-
 	if(inputs[RESET_INPUT].isConnected()) {
 		if(resetTrigger.process(inputs[RESET_INPUT].getVoltage())) {
-			oscillator.hardReset();
+			for(int g=0;g<PORT_MAX_CHANNELS / 4;g++) {
+				oscillator[g].hardReset();
+			}
+			clockCycles = 0.0;
 		}		
 	} 
 
@@ -411,30 +342,56 @@ void BPMLFO2::process(const ProcessArgs &args) {
 		lights[HOLD_LIGHT].value = holding;
 	} 
 
+	// Channels coming into use pick up where the clock has got to, as though they had run all along. Until then a
+	// lane may have been running on another channel's CV, so lanes are put in step rather than whole groups
+	if(channels > activeChannels) {
+		for(int g=activeChannels/4;g<groups;g++) {
+			simd::float_4 cycles;
+			for(int l=0;l<4;l++) {
+				cycles[l] = (float) std::fmod(clockCycles / channelDivision[g][l], 1.0);
+			}
+			simd::float_4 comingIn = simd::float_4(g*4, g*4+1, g*4+2, g*4+3) >= simd::float_4(activeChannels);
+			oscillator[g].phase = simd::ifelse(comingIn, cycles, oscillator[g].phase);
+			oscillator[g].phaseRemainder = simd::ifelse(comingIn, 0.f, oscillator[g].phaseRemainder);
+		}
+	}
+	activeChannels = channels;
+
     if(!holding || (holding && params[HOLD_CLOCK_BEHAVIOR_PARAM].getValue() == 0.0)) {
-    	oscillator.step(args.sampleTime);
+		if(duration != 0) {
+			clockCycles += multiplier / duration * args.sampleTime;
+		}
+		for(int g=0;g<groups;g++) {
+			oscillator[g].step(args.sampleTime);
+		}
     }
 
-	if(!holding) {
-		if(waveshape == SKEWSAW_WAV) {
-			lfoOutputValue = 5.0 * oscillator.skewsaw(0.0);
-			lfo45OutputValue = 5.0 * oscillator.skewsaw(0.125);
-			lfo90OutputValue = 5.0 * oscillator.skewsaw(0.25);
-			lfo180OutputValue = 5.0 * oscillator.skewsaw(0.5);
+	// One pass per output for every four channels
+	for(int c=0;c<channels;c+=4) {
+		if(!holding) {
+			LowFrequencyOscillator<simd::float_4> &lfo = oscillator[c/4];
+			if(waveshape == SKEWSAW_WAV) {
+				lfoOutputValue[c/4] = 5.f * lfo.shapedSkewsaw();
+				lfo45OutputValue[c/4] = 5.f * lfo.shapedSkewsaw(simd::float_4(0.125f));
+				lfo90OutputValue[c/4] = 5.f * lfo.shapedSkewsaw(simd::float_4(0.25f));
+				lfo180OutputValue[c/4] = 5.f * lfo.shapedSkewsaw(simd::float_4(0.5f));
+			}
+			else {
+				lfoOutputValue[c/4] = 5.f * lfo.shapedSqr();
+				lfo45OutputValue[c/4] = 5.f * lfo.shapedSqr(simd::float_4(0.125f));
+				lfo90OutputValue[c/4] = 5.f * lfo.shapedSqr(simd::float_4(0.25f));
+				lfo180OutputValue[c/4] = 5.f * lfo.shapedSqr(simd::float_4(0.5f));
+			}
 		}
-		else {
-			lfoOutputValue = 5.0 * oscillator.sqr(0.0);
-			lfo45OutputValue = 5.0 * oscillator.sqr(0.125);
-			lfo90OutputValue = 5.0 * oscillator.sqr(0.25);
-			lfo180OutputValue = 5.0 * oscillator.sqr(0.5);
-		}		
+		outputs[LFO_OUTPUT].setVoltageSimd(lfoOutputValue[c/4], c);
+		outputs[LFO_45_OUTPUT].setVoltageSimd(lfo45OutputValue[c/4], c);
+		outputs[LFO_90_OUTPUT].setVoltageSimd(lfo90OutputValue[c/4], c);
+		outputs[LFO_180_OUTPUT].setVoltageSimd(lfo180OutputValue[c/4], c);
 	}
-	
-
-	outputs[LFO_OUTPUT].setVoltage(lfoOutputValue);
-	outputs[LFO_45_OUTPUT].setVoltage(lfo45OutputValue);
-	outputs[LFO_90_OUTPUT].setVoltage(lfo90OutputValue);
-	outputs[LFO_180_OUTPUT].setVoltage(lfo180OutputValue);
+	outputs[LFO_OUTPUT].setChannels(channels);
+	outputs[LFO_45_OUTPUT].setChannels(channels);
+	outputs[LFO_90_OUTPUT].setChannels(channels);
+	outputs[LFO_180_OUTPUT].setChannels(channels);
 
 	bool rightExpanderPresent = (rightExpander.module && (rightExpander.module->model == modelBPMLFOPhaseExpander));
 	if(rightExpanderPresent) {
@@ -452,6 +409,13 @@ void BPMLFO2::process(const ProcessArgs &args) {
 		messageToSlave[10] = waveshape;
 		messageToSlave[11] = waveSlope;
 		messageToSlave[12] = skew;
+		messageToSlave[PASSTHROUGH_CHANNELS] = channels;
+		for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+			messageToSlave[PASSTHROUGH_PHASE + c] = channelPhase[c/4][c%4];
+			messageToSlave[PASSTHROUGH_DIVISION + c] = channelDivision[c/4][c%4];
+			messageToSlave[PASSTHROUGH_WAVESLOPE + c] = channelWaveSlope[c/4][c%4];
+			messageToSlave[PASSTHROUGH_SKEW + c] = channelSkew[c/4][c%4];
+		}
 	}
 
 }
@@ -536,7 +500,7 @@ struct BPMLFO2ProgressDisplay : TransparentWidget {
 		if (!module)
 			return;	
 		drawWaveShape(args,module->waveshape, module->skew, module->waveSlope);
-		drawProgress(args,module->waveshape, module->skew, module->waveSlope, module->oscillator.progress());
+		drawProgress(args,module->waveshape, module->skew, module->waveSlope, module->oscillator[0].progress()[0]);
 		drawMultiplier(args, Vec(38, 47), module->multiplier);
 		drawDivision(args, Vec(104, 47), module->division);
 	}
@@ -4,10 +4,17 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 #define MAX_OUTPUTS 12
 
-#define PASSTHROUGH_RIGHT_VARIABLE_COUNT 13
+// 0-12 are channel 0's settings, then the channel count and per channel phase, division, wave slope and skew
+#define PASSTHROUGH_CHANNELS 13
+#define PASSTHROUGH_PHASE 14
+#define PASSTHROUGH_DIVISION (PASSTHROUGH_PHASE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_WAVESLOPE (PASSTHROUGH_DIVISION + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_SKEW (PASSTHROUGH_WAVESLOPE + PORT_MAX_CHANNELS)
+#define PASSTHROUGH_RIGHT_VARIABLE_COUNT (PASSTHROUGH_SKEW + PORT_MAX_CHANNELS)
 
 
 struct BPMLFOPhaseExpander : Module {
@@ -37,116 +44,16 @@ struct BPMLFOPhaseExpander : Module {
 
 	
 
-	struct LowFrequencyOscillator {
-		float basePhase = 0.0;
-		double phase = 0.0;
-		double freq = 1.0;
-		float pw = 0.5;
-		float skew = 0.5; // Triangle
-		float waveSlope = 0.0; //Original (1 is sin)
-		bool offset = false;
-
-		float lerp(float v0, float v1, float t) {
-			return (1 - t) * v0 + t * v1;
-		}
-
-		void setPitch(float pitch) {
-			pitch = fminf(pitch, 8.0);
-			freq = powf(2.0, pitch);
-		}
-		void setFrequency(double frequency) {
-			freq = frequency;
-		}
-		void setPulseWidth(float pw_) {
-			const float pwMin = 0.01;
-			pw = clamp(pw_, pwMin, 1.0f - pwMin);
-		}
-		
-		void setBasePhase(float initialPhase) {
-			//Apply change, then remember
-			phase += initialPhase - basePhase;
-
-			//Regular Bounds Checking
-			if (phase >= 1.0)
-				phase -= 1.0;
-			else if (phase < 0)
-				phase += 1.0;	
-			basePhase = initialPhase;
-		}
-
-		void hardReset()
-		{
-			phase = basePhase;
-		}
-
-		void step(double dt) {
-			double deltaPhase = fmin(freq * dt, 0.5);
-			phase += deltaPhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-		}
-
-		float skewsawInternal(float x) {
-			//x = dsp::eucmod(x,1.0);
-			x = std::fabs(std::fmod(x ,1.0f));
-
-			float inverseSkew = 1 - skew;
-			float originalWave;
-			if (skew == 0 && x == 0) //Avoid /0 error
-				originalWave = 2;
-			if (x <= skew)
-				originalWave = 2.0 * (1- (-1 / skew * x + 1));
-			else
-				originalWave = 2.0 * (1-(1 / inverseSkew * (x - skew)));
-			return originalWave;
-		}
-		
-		float skewsaw(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset;
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			if (offset)
-				return lerp(skewsawInternal(phaseToUse),sin(phaseOffset),waveSlope);
-			
-			return lerp(skewsawInternal(phaseToUse) - 1 ,sin(phaseOffset),waveSlope); //Going to keep same phase for now				
-		}
-
-
-		float sin(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset - 0.25; //Sin is out of ohase of other waveforms
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			if (offset)
-				return 1.0 - cosf(2*M_PI * (phaseToUse-skew*0));
-			
-			return sinf(2*M_PI * (phaseToUse-skew*0));
-		}
-
-		float sqr(double phaseOffset) {
-			double phaseToUse = phase + phaseOffset;
-			if (phaseToUse >= 1.0)
-				phaseToUse -= 1.0;
-
-			float sqr = (phaseToUse < pw) ? 1.0 : -1.0;
-			sqr = offset ? sqr + 1.0 : sqr;
-
-			float result = lerp(sqr,sin(phaseOffset),waveSlope);
-			return result;
-		}
-		
-		float progress() {
-			return phase;
-		}
-	};
-
 	// Expander
 	float consumerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// this module must read from here
 	float producerMessage[PASSTHROUGH_RIGHT_VARIABLE_COUNT] = {};// mother will write into here
 
 
-	LowFrequencyOscillator oscillator;
+	// Same layout as the mother's, four channels per oscillator
+	LowFrequencyOscillator<simd::float_4> oscillator[PORT_MAX_CHANNELS / 4];
+	// Cycles of the undivided clock since the last reset, for putting a channel that comes into use in step
+	double clockCycles = 0.0;
+	int activeChannels = 0; // channels in use last sample
 	dsp::SchmittTrigger clockTrigger,resetTrigger,holdTrigger,forceIntegerTrigger;
 	float multiplier = 1;
 	float division = 1;
@@ -162,8 +69,9 @@ struct BPMLFOPhaseExpander : Module {
 	bool firstClockReceived = false;
 	bool secondClockReceived = false;
 	bool phase_quantized = false;
+	int channels = 1;
 
-	float lfoOutputValue[MAX_OUTPUTS] = {0.0};
+	simd::float_4 lfoOutputValue[MAX_OUTPUTS][PORT_MAX_CHANNELS / 4] = {};
 
 	float lastWaveShape = -1;
 	float lastWaveSlope = -1;
@@ -229,6 +137,8 @@ void BPMLFOPhaseExpander::process(const ProcessArgs &args) {
 	waveshape = messagesFromMother[10];
 	waveSlope = messagesFromMother[11];
 	skew = messagesFromMother[12]; 
+	channels = clamp((int)messagesFromMother[PASSTHROUGH_CHANNELS], 1, PORT_MAX_CHANNELS);
+	int groups = (channels + 3) / 4;
 
 	
 
@@ -277,11 +187,19 @@ void BPMLFOPhaseExpander::process(const ProcessArgs &args) {
 	}
 	phaseDivision = clamp(phaseDivision,3.0,12.0f);	
 	
-	oscillator.offset = (offset > 0.0);
-	oscillator.setBasePhase(initialPhase);
-	oscillator.waveSlope = waveSlope;
-	oscillator.skew = skew;
-	oscillator.setPulseWidth(skew);
+	for(int g=0;g<groups;g++) {
+		oscillator[g].offset = (offset > 0.0);
+		oscillator[g].setBasePhase(simd::float_4::load(&messagesFromMother[PASSTHROUGH_PHASE + g*4]));
+		oscillator[g].waveSlope = simd::float_4::load(&messagesFromMother[PASSTHROUGH_WAVESLOPE + g*4]);
+		oscillator[g].skew = simd::float_4::load(&messagesFromMother[PASSTHROUGH_SKEW + g*4]);
+		oscillator[g].setPulseWidth(oscillator[g].skew);
+		if(duration != 0) {
+			oscillator[g].setFrequency(simd::float_4(multiplier / duration) / simd::float_4::load(&messagesFromMother[PASSTHROUGH_DIVISION + g*4]));
+		}
+		else {
+			oscillator[g].setFrequency(0.f);
+		}
+	}
 
 	//Recalcluate display waveform if something changed
 	if(lastWaveShape != waveshape || lastWaveSlope != waveSlope || lastSkew != skew) {
@@ -290,15 +208,11 @@ void BPMLFOPhaseExpander::process(const ProcessArgs &args) {
 		lastSkew = skew;
 	}
 
-	if(duration != 0) {
-		oscillator.setFrequency(1.0 / (duration / multiplier * division));
-	}
-	else {
-		oscillator.setFrequency(0);
-	}
-
 	if(resetTrigger.process(resetInput)) {
-		oscillator.hardReset();
+		for(int g=0;g<PORT_MAX_CHANNELS / 4;g++) {
+			oscillator[g].hardReset();
+		}
+		clockCycles = 0.0;
 	}		
 
 	if(holdMode == 1.0) { //Latched is default		
@@ -310,24 +224,45 @@ void BPMLFOPhaseExpander::process(const ProcessArgs &args) {
 	}
 		
 
+	// Channels coming into use pick up where the clock has got to, as though they had run all along. Until then a
+	// lane may have been running on another channel's CV, so lanes are put in step rather than whole groups
+	if(channels > activeChannels) {
+		for(int g=activeChannels/4;g<groups;g++) {
+			simd::float_4 cycles;
+			for(int l=0;l<4;l++) {
+				cycles[l] = (float) std::fmod(clockCycles / std::max(messagesFromMother[PASSTHROUGH_DIVISION + g*4 + l], 1.0f), 1.0);
+			}
+			simd::float_4 comingIn = simd::float_4(g*4, g*4+1, g*4+2, g*4+3) >= simd::float_4(activeChannels);
+			oscillator[g].phase = simd::ifelse(comingIn, cycles, oscillator[g].phase);
+			oscillator[g].phaseRemainder = simd::ifelse(comingIn, 0.f, oscillator[g].phaseRemainder);
+		}
+	}
+	activeChannels = channels;
+
     if(!holding || (holding && holdClockMode == 0.0)) {
-    	oscillator.step(1.0 / args.sampleRate);
+		if(duration != 0) {
+			clockCycles += multiplier / duration * (1.0 / args.sampleRate);
+		}
+		for(int g=0;g<groups;g++) {
+			oscillator[g].step(1.0 / args.sampleRate);
+		}
     }
 
 	if(!holding) {
+		// Four channels per pass
 		for(int i = 0; i<phaseDivision; i++) {
-			float phase = (float)i/phaseDivision;
-			if(waveshape == SKEWSAW_WAV) {
-				lfoOutputValue[i] = 5.0 * oscillator.skewsaw(phase);
+			simd::float_4 phase = i / phaseDivision;
+			for(int c=0;c<channels;c+=4) {
+				lfoOutputValue[i][c/4] = 5.f * (waveshape == SKEWSAW_WAV ? oscillator[c/4].shapedSkewsaw(phase) : oscillator[c/4].shapedSqr(phase));
 			}
-			else {
-				lfoOutputValue[i] = 5.0 * oscillator.sqr(phase);
-			}		
 		}
 	}
 	
 	for(int i=0;i<MAX_OUTPUTS;i++) {
-		outputs[LFO_1_OUTPUT+i].setVoltage(lfoOutputValue[i]);
+		for(int c=0;c<channels;c+=4) {
+			outputs[LFO_1_OUTPUT+i].setVoltageSimd(lfoOutputValue[i][c/4], c);
+		}
+		outputs[LFO_1_OUTPUT+i].setChannels(channels);
 	}
 }
 
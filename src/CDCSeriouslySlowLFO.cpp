@@ -1,4 +1,8 @@
 #include "FrozenWasteland.hpp"
+#include "ui/menu.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
+#include "dsp-lfo/controlRate.hpp"
+#include "ui/controlRateMenu.hpp"
 
 
 
@@ -32,76 +36,10 @@ struct CDCSeriouslySlowLFO : Module {
 		NUM_LIGHTS
 	};
 
-struct LowFrequencyOscillator {
-	float phase = 0.0;
-	float pw = 0.5;
-	float freq = 1.0;
-	bool offset = false;
-	bool invert = false;
-	dsp::SchmittTrigger resetTrigger;
-	LowFrequencyOscillator() {}
-	void setPitch(float pitch) {
-		pitch = fminf(pitch, 8.0);
-		freq = powf(2.0, pitch);
-	}
-	void setFrequency(float frequency) {
-		freq = frequency;
-	}
-	void setPulseWidth(float pw_) {
-		const float pwMin = 0.01;
-		pw = clamp(pw_, pwMin, 1.0f - pwMin);
-	}
-	void setReset(float reset) {
-		if (resetTrigger.process(reset)) {
-			phase = 0.0;
-		}
-	}
-	void hardReset()
-	{
-		phase = 0.0;
-	}
-
-	void step(float dt) {
-		float deltaPhase = fminf(freq * dt, 0.5);
-		phase += deltaPhase;
-		if (phase >= 1.0)
-			phase -= 1.0;
-	}
-	float sin() {
-		if (offset)
-			return 1.0 - cosf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-		else
-			return sinf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-	}
-	float tri(float x) {
-		return 4.0 * fabsf(x - roundf(x));
-	}
-	float tri() {
-		if (offset)
-			return tri(invert ? phase - 0.5 : phase);
-		else
-			return -1.0 + tri(invert ? phase - 0.25 : phase - 0.75);
-	}
-	float saw(float x) {
-		return 2.0 * (x - roundf(x));
-	}
-	float saw() {
-		if (offset)
-			return invert ? 2.0 * (1.0 - phase) : 2.0 * phase;
-		else
-			return saw(phase) * (invert ? -1.0 : 1.0);
-	}
-	float sqr() {
-		float sqr = (phase < pw) ^ invert ? 1.0 : -1.0;
-		return offset ? sqr + 1.0 : sqr;
-	}
-	float progress() {
-		return phase;
-	}
-};
-
-	LowFrequencyOscillator oscillator;
-	dsp::SchmittTrigger sumTrigger;
+	LowFrequencyOscillator<double> oscillator;
+	// Sine, triangle, saw and square in one lane each
+	ControlRateRamp<simd::float_4> controlRate;
+	dsp::SchmittTrigger sumTrigger, resetTrigger;
 	float duration = 0.0;
 	int timeBase = 0;
 
@@ -124,9 +62,22 @@ struct LowFrequencyOscillator {
 	}
 	void process(const ProcessArgs &args) override;
 
+	// Sine, triangle, saw and square at the oscillator's current phase
+	simd::float_4 waveValues() {
+		return simd::float_4(5.0 * oscillator.sin(), 5.0 * oscillator.tri(), 5.0 * oscillator.saw(), 5.0 * oscillator.sqr());
+	}
+
+	void setOutputs(simd::float_4 waves) {
+		outputs[SIN_OUTPUT].setVoltage(waves[0]);
+		outputs[TRI_OUTPUT].setVoltage(waves[1]);
+		outputs[SAW_OUTPUT].setVoltage(waves[2]);
+		outputs[SQR_OUTPUT].setVoltage(waves[3]);
+	}
+
 	json_t *dataToJson() override {
 		json_t *rootJ = json_object();
 		json_object_set_new(rootJ, "timeBase", json_integer((int) timeBase));
+		json_object_set_new(rootJ, "controlRate", json_integer(controlRate.interval));
 		return rootJ;
 	}
 
@@ -134,6 +85,9 @@ struct LowFrequencyOscillator {
 		json_t *sumJ = json_object_get(rootJ, "timeBase");
 		if (sumJ)
 			timeBase = json_integer_value(sumJ);
+		// Patches saved before there was a choice ran every sample
+		json_t *crJ = json_object_get(rootJ, "controlRate");
+		controlRate.interval = crJ ? clamp((int) json_integer_value(crJ), 1, 256) : 1;
 	}
 
 	// void reset() override {
@@ -149,8 +103,21 @@ struct LowFrequencyOscillator {
 
 void CDCSeriouslySlowLFO::process(const ProcessArgs &args) {
 
+	// Reset is checked every sample and brings the next update forward so the outputs jump on the edge
+	bool reset = false;
+	if(inputs[RESET_INPUT].isConnected()) {
+		reset = resetTrigger.process(inputs[RESET_INPUT].getVoltage());
+	}
+	if (!controlRate.process(reset)) {
+		setOutputs(controlRate.next());
+		return;
+	}
+
 	if (sumTrigger.process(params[TIME_BASE_PARAM].getValue())) {
 		timeBase = (timeBase + 1) % 7;
+		reset = true;
+	}
+	if (reset) {
 		oscillator.hardReset();
 	}
 
@@ -187,16 +154,13 @@ void CDCSeriouslySlowLFO::process(const ProcessArgs &args) {
 	duration = clamp(duration,1.0f,100.0f);
 
 	oscillator.setFrequency(1.0 / (duration * numberOfSeconds));
-	oscillator.step(1.0 / args.sampleRate);
-	if(inputs[RESET_INPUT].isConnected()) {
-		oscillator.setReset(inputs[RESET_INPUT].getVoltage());
+	if (reset || controlRate.jumpPending) {
+		controlRate.jump(waveValues());
 	}
+	oscillator.step(controlRate.counter / args.sampleRate);
+	controlRate.rampTo(waveValues());
 
-
-	outputs[SIN_OUTPUT].setVoltage(5.0 * oscillator.sin());
-	outputs[TRI_OUTPUT].setVoltage(5.0 * oscillator.tri());
-	outputs[SAW_OUTPUT].setVoltage(5.0 * oscillator.saw());
-	outputs[SQR_OUTPUT].setVoltage( 5.0 * oscillator.sqr());
+	setOutputs(controlRate.next());
 
 	for(int lightIndex = 0;lightIndex < 7;lightIndex++)
 	{
@@ -297,6 +261,14 @@ struct CDCSeriouslySlowLFOWidget : ModuleWidget {
 		addChild(createLight<MediumLight<BlueLight>>(Vec(10, 243), module, CDCSeriouslySlowLFO::UNIVERSE_LIGHT));
 		addChild(createLight<MediumLight<BlueLight>>(Vec(10, 258), module, CDCSeriouslySlowLFO::HEAT_DEATH_LIGHT));
 	}
+
+	void appendContextMenu(Menu *menu) override {
+		CDCSeriouslySlowLFO *module = dynamic_cast<CDCSeriouslySlowLFO*>(this->module);
+		assert(module);
+
+		menu->addChild(new MenuLabel());
+		menu->addChild(createControlRateMenuItem(&module->controlRate));
+	}
 };
 
 
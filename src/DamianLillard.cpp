@@ -6,7 +6,6 @@ using namespace std;
 
 #define BANDS 4
 #define FREQUENCIES 3
-#define numFilters 8
 
 struct DamianLillard : Module {
 	typedef float T;
@@ -48,8 +47,11 @@ struct DamianLillard : Module {
 	float lastFreq[FREQUENCIES] = {0};
 	float output[BANDS] = {0};
 
-    StateVariableFilterState<T> filterStates[numFilters];
-    StateVariableFilterParams<T> filterParams[numFilters];
+	// Band i is lane i of both stages, stage 0 runs filters 0,2,4,6 and stage 1 runs 1,3,5,7
+	StateVariableFilterState<simd::float_4> filterStates[2];
+	StateVariableFilterParams<simd::float_4> filterParams[2];
+	simd::float_4 filterFreq[2];
+	simd::float_4 hiPassLanes[2];
 
 	int bandOffset = 0;
 
@@ -82,18 +84,14 @@ struct DamianLillard : Module {
 		configOutput(MIX_OUTPUT, "Mix");
 
 
-		filterParams[0].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-		filterParams[1].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-		filterParams[2].setMode(StateVariableFilterParams<T>::Mode::HiPass);
-		filterParams[3].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-		filterParams[4].setMode(StateVariableFilterParams<T>::Mode::HiPass);
-		filterParams[5].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-		filterParams[6].setMode(StateVariableFilterParams<T>::Mode::HiPass);
-		filterParams[7].setMode(StateVariableFilterParams<T>::Mode::HiPass);
+		//LP,HP,HP,HP then LP,LP,LP,HP
+		hiPassLanes[0] = simd::float_4(0.0,1.0,1.0,1.0) > 0.0f;
+		hiPassLanes[1] = simd::float_4(0.0,0.0,0.0,1.0) > 0.0f;
 
-		for (int i = 0; i < numFilters; ++i) {
+		for (int i = 0; i < 2; ++i) {
+			filterFreq[i] = T(.1);
 	        filterParams[i].setQ(0.5); 	
-	        filterParams[i].setFreq(T(.1));
+	        filterParams[i].setFreq(filterFreq[i]);
 	    }
 	}
 
@@ -135,20 +133,25 @@ struct DamianLillard : Module {
 
 			if(freq[i] != lastFreq[i]) {
 				float Fc = freq[i] / args.sampleRate;
+				//Filter n is lane n/2 of stage n%2
 				if(i==0) 
-					filterParams[0].setFreq(T(Fc));
+					filterFreq[0][0] = Fc;
 				if(i==2) 
-					filterParams[7].setFreq(T(Fc));
-				filterParams[i*2 + 1].setFreq(T(Fc));
-				filterParams[i*2 + 2].setFreq(T(Fc));
+					filterFreq[1][3] = Fc;
+				filterFreq[1][i] = Fc;
+				filterFreq[0][i + 1] = Fc;
+				filterParams[0].setFreq(filterFreq[0]);
+				filterParams[1].setFreq(filterFreq[1]);
 				lastFreq[i] = freq[i];
 			}
 		}
 
-		output[0] = StateVariableFilter<T>::run(StateVariableFilter<T>::run(signalIn, filterStates[0], filterParams[0]), filterStates[1], filterParams[1]);
-		output[1] = StateVariableFilter<T>::run(StateVariableFilter<T>::run(signalIn, filterStates[2], filterParams[2]), filterStates[3], filterParams[3]);
-		output[2] = StateVariableFilter<T>::run(StateVariableFilter<T>::run(signalIn, filterStates[4], filterParams[4]), filterStates[5], filterParams[5]);
-		output[3] = StateVariableFilter<T>::run(StateVariableFilter<T>::run(signalIn, filterStates[6], filterParams[6]), filterStates[7], filterParams[7]);
+		simd::float_4 bandOut = signalIn;
+		for(int i=0; i<2; i++) {
+			StateVariableFilterOutputs<simd::float_4> d = StateVariableFilter<simd::float_4>::runAll(bandOut, filterStates[i], filterParams[i]);
+			bandOut = simd::ifelse(hiPassLanes[i], d.hiPass, d.lowPass);
+		}
+		bandOut.store(output);
 
 		for(int i=0; i<BANDS; i++) {		
 			outputs[BAND_1_OUTPUT+i].setVoltage(output[i]);
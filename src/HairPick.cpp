@@ -11,6 +11,89 @@
 #define DIVISIONS 21
 #define NUM_PATTERNS 16
 #define NUM_FEEDBACK_TYPES 4
+#define MAX_DELAY_TIME 10.0f // seconds
+#define PITCH_HEADROOM 2.0f // room for a V/Oct of -1, lower notes are held at the end of the line
+#define MAX_VOICES 16
+
+
+// The comb read as a sparse FIR over the history buffer. Only the active taps are kept, packed four to a float_4
+// with their gains, so the cost follows the tap count and nothing is recalculated while the knobs are still
+struct HPCombEngine {
+	int activeTaps = 0;
+	int tapIndex[NUM_TAPS] = {0}; // comb tap in each packed slot
+	float gain[NUM_TAPS] = {0}; // packed to match tapIndex, padding slots are 0
+
+	int delay[NUM_TAPS] = {0}; // per comb tap, in frames
+	int targetDelay[NUM_TAPS] = {0};
+	float balance[NUM_TAPS] = {0};
+	bool active[NUM_TAPS] = {false};
+
+	// tapGains is indexed by comb tap, 0 for muted taps
+	void setTapGains(const float *tapGains) {
+		activeTaps = 0;
+		for(int tap = 0; tap < NUM_TAPS; tap++) {
+			active[tap] = tapGains[tap] != 0.0f;
+			if(active[tap]) {
+				tapIndex[activeTaps] = tap;
+				gain[activeTaps] = tapGains[tap];
+				activeTaps++;
+			} else {
+				//Nothing has been reading it, so don't crossfade from a stale position when it comes back
+				delay[tap] = targetDelay[tap];
+			}
+		}
+		for(int slot = activeTaps; slot < NUM_TAPS; slot++) {
+			tapIndex[slot] = 0;
+			gain[slot] = 0.0f;
+		}
+	}
+
+	void setDelay(int tap, int delaySize) {
+		if(!active[tap]) {
+			delay[tap] = delaySize;
+		}
+		targetDelay[tap] = delaySize;
+		balance[tap] = 0;
+	}
+
+	template <int N>
+	FloatFrame process(MultiTapDelayLine<FloatFrame, N> &delayLine) {
+		simd::float_4 wetL = 0.0f, wetR = 0.0f;
+		for(int slot = 0; slot < activeTaps; slot += 4) {
+			simd::float_4 l, r;
+			for(int lane = 0; lane < 4; lane++) {
+				int tap = tapIndex[slot + lane];
+				FloatFrame out = delayLine.readDelayed(delay[tap]);
+				if(delay[tap] != targetDelay[tap]) {
+					FloatFrame desiredOut = delayLine.readDelayed(targetDelay[tap]);
+					out.l += (desiredOut.l - out.l) * balance[tap];
+					out.r += (desiredOut.r - out.r) * balance[tap];
+				}
+				l[lane] = out.l;
+				r[lane] = out.r;
+			}
+			simd::float_4 g = simd::float_4::load(&gain[slot]);
+			wetL += l * g;
+			wetR += r * g;
+		}
+
+		// Same crossfade as MultiTapDelayLine taps when a delay time moves
+		for(int slot = 0; slot < activeTaps; slot++) {
+			int tap = tapIndex[slot];
+			if(delay[tap] != targetDelay[tap]) {
+				balance[tap] += .001;
+				if(balance[tap] >= 1) {
+					delay[tap] = targetDelay[tap];
+				}
+			}
+		}
+
+		FloatFrame wet;
+		wet.l = wetL[0] + wetL[1] + wetL[2] + wetL[3];
+		wet.r = wetR[0] + wetR[1] + wetR[2] + wetR[3];
+		return wet;
+	}
+};
 
 
 struct HairPick : Module {
@@ -101,15 +184,28 @@ struct HairPick : Module {
 
 
 	bool combActive[NUM_TAPS];
-	float combLevel[NUM_TAPS];
-	float lastDelayTime[NUM_TAPS+1];
+	float combLevel[NUM_TAPS]; // envelope gain per tap, 0 when muted
+	float lastFeedbackDelayTime[MAX_VOICES];
+	float lastVoiceDelay[MAX_VOICES];
+	float lastVoltOctave[MAX_VOICES];
+	float pitchShift[MAX_VOICES];
+	float unpitchedDelay = -1.0f;
+	int lastCombPattern = -1;
+	int voiceCount = 1;
+	float voiceFeedbackScale = 1.0f;
+	float lastEdgeLevel = -1.0f;
+	float lastTentLevel = -1.0f;
+	int lastTentTap = -1;
+	bool tapGainsDirty = true;
 
 	float lastTapCount = -1;
 	float tapCountSqrt = 0;
 
 
-	MultiTapDelayLine<FloatFrame, NUM_TAPS+1> delayLine;
-	FloatFrame lastFeedback = {0.0f,0.0f};
+	// One history shared by every voice. Its taps are the voices' feedback, the combs are read by combEngine
+	MultiTapDelayLine<FloatFrame, MAX_VOICES> delayLine;
+	HPCombEngine combEngine[MAX_VOICES];
+	FloatFrame lastFeedback[MAX_VOICES] = {};
 
 	//percentages
 	float clockDivPercentage = 0;
@@ -146,6 +242,15 @@ struct HairPick : Module {
         }
     }
 
+	void allocateDelayLine(float sampleRate) {
+		//Sitar feedback stretches the delay tap by up to 10% on top of the octave below V/Oct 0
+		delayLine.setMaxDelay(sampleRate, MAX_DELAY_TIME * PITCH_HEADROOM * 1.1f);
+		for(int c = 0; c < MAX_VOICES; c++) {
+			lastFeedbackDelayTime[c] = -1.0f;
+			lastVoiceDelay[c] = -1.0f;
+		}
+	}
+
 	float cubicSoftClip(float x, float drive) {
 		float cx = std::max(std::min(drive * x, 1.0f), -1.0f);
 		float y = std::max(std::min(cx - cx*cx*cx /  3.0f, 2.0f/3.0f), -2.0f/3.0f) / drive;
@@ -189,9 +294,19 @@ struct HairPick : Module {
 		configOutput(OUT_R_OUTPUT, "Right");
 		configOutput(DELAY_LENGTH_OUTPUT, "Delay Length");
 
+		allocateDelayLine(APP->engine->getSampleRate());
+		for(int c = 0; c < MAX_VOICES; c++) {
+			lastVoltOctave[c] = 0.0f;
+			pitchShift[c] = 1.0f;
+		}
+
 		srand(time(NULL));
 	}
 
+	void onSampleRateChange() override {
+		allocateDelayLine(APP->engine->getSampleRate());
+	}
+
 	
 
 
@@ -218,6 +333,7 @@ struct HairPick : Module {
 				int tapNumber = muteTap(tapIndex);
 				combActive[tapNumber] = false;
 			}
+			tapGainsDirty = true;
 		}
 
 
@@ -230,6 +346,19 @@ struct HairPick : Module {
 		tentLevelPercentage = tentLevel;
 		tentTapPercentage = tentTap / 63.0;
 
+		if(tapGainsDirty || edgeLevel != lastEdgeLevel || tentLevel != lastTentLevel || tentTap != lastTentTap) {
+			for(int tap = 0; tap < NUM_TAPS; tap++) {
+				combLevel[tap] = combActive[tap] ? envelope(tap,edgeLevel,tentLevel,tentTap) : 0.0f;
+			}
+			for(int c = 0; c < MAX_VOICES; c++) {
+				combEngine[c].setTapGains(combLevel);
+			}
+			lastEdgeLevel = edgeLevel;
+			lastTentLevel = tentLevel;
+			lastTentTap = tentTap;
+			tapGainsDirty = false;
+		}
+
 		float divisionf = params[CLOCK_DIV_PARAM].getValue();
 		if(inputs[CLOCK_DIVISION_CV_INPUT].isConnected()) {
 			divisionf +=(inputs[CLOCK_DIVISION_CV_INPUT].getVoltage() * (DIVISIONS / 10.0));
@@ -250,31 +379,55 @@ struct HairPick : Module {
 			} else if(secondClockReceived && timeElapsed > duration) {  //allow absense of second clock to affect duration
 				duration = timeElapsed;				
 			}	
-			baseDelay = clamp(duration / divisions[division],0.001f,10.0f);		
+			baseDelay = clamp(duration / divisions[division],0.001f,MAX_DELAY_TIME);		
 			sizePercentage = 0;
 		} else {
-			baseDelay = clamp(params[SIZE_PARAM].getValue() + inputs[SIZE_CV_INPUT].getVoltage(), 0.001f, 10.0f);
+			baseDelay = clamp(params[SIZE_PARAM].getValue() + inputs[SIZE_CV_INPUT].getVoltage(), 0.001f, MAX_DELAY_TIME);
 			sizePercentage = baseDelay / 10.0;
 			duration = 0.0f;
 			firstClockReceived = false;		
 			secondClockReceived = false;	
 		}
 
-		float pitchShift = powf(2.0f,inputs[VOLT_OCTAVE_INPUT].getVoltage());
-		baseDelay = baseDelay / pitchShift;
-		outputs[DELAY_LENGTH_OUTPUT].setVoltage(baseDelay);  
-		
+		// Each V/Oct channel is a voice with its own comb over the shared history
+		int channels = std::max(inputs[VOLT_OCTAVE_INPUT].getChannels(), 1);
+		for(int c = voiceCount; c < channels; c++) {
+			// The voice's feedback tap stood still while it was off, so make it seek to its real delay below
+			lastFeedback[c] = {0.0f, 0.0f};
+			lastFeedbackDelayTime[c] = -1.0f;
+		}
+		if(channels != voiceCount) {
+			voiceFeedbackScale = 1.0f / std::sqrt((float) channels);
+		}
+		voiceCount = channels;
+
+		bool delaysChanged = baseDelay != unpitchedDelay || combPattern != lastCombPattern;
+		unpitchedDelay = baseDelay;
+		lastCombPattern = combPattern;
+
 		FloatFrame dryFrame;
 		float feedbackAmount = clamp(params[FEEDBACK_AMOUNT_PARAM].getValue() + (inputs[FEEDBACK_CV_INPUT].getVoltage() / 10.0f), 0.0f, 1.0f);
 		feedbackAmountPercentage = feedbackAmount;
+		// Voices share one write head. Dividing their feedback by the voice count would cut each voice's own loop gain
+		// to 1/N and choke its decay, so scale by 1/sqrt(N), which keeps the power of unrelated voices, and soft limit
+		// the sum in case they line up
+		FloatFrame feedbackSum = {0.0f, 0.0f};
+		for(int c = 0; c < voiceCount; c++) {
+			feedbackSum.l += lastFeedback[c].l;
+			feedbackSum.r += lastFeedback[c].r;
+		}
+		if(voiceCount > 1) {
+			feedbackSum.l = cubicSoftClip(feedbackSum.l * voiceFeedbackScale / 15.0f, 1.0f) * 15.0f;
+			feedbackSum.r = cubicSoftClip(feedbackSum.r * voiceFeedbackScale / 15.0f, 1.0f) * 15.0f;
+		}
 		float in = 0.0f;				
 		for(int channel = 0;channel < CHANNELS;channel++) {	
 			if(channel == 0) {
 				in = inputs[IN_L_INPUT].getVoltage();	
-				dryFrame.l = in + lastFeedback.l * feedbackAmount;
+				dryFrame.l = in + feedbackSum.l * feedbackAmount;
 			} else {
 				in = inputs[IN_R_INPUT].isConnected() ? inputs[IN_R_INPUT].getVoltage() : inputs[IN_L_INPUT].getVoltage();	
-				dryFrame.r = in + lastFeedback.r * feedbackAmount;
+				dryFrame.r = in + feedbackSum.r * feedbackAmount;
 			}	
 		}
 
@@ -289,79 +442,83 @@ struct HairPick : Module {
 			delayNonlinearity = 1 + ((rectIn/10.0f) * (percentChange/100.0f)); //Test sitar will change length by up tp 10%
 		}
 
-
-		FloatFrame wet = {0.0f, 0.0f}; // This is the mix of delays and input that is outputed
-		FloatFrame feedbackValue = {0.0f,0.0f}; // This is the output of a tap that gets sent back to input
-		for(int tap = 0; tap <= NUM_TAPS;tap++) { 
-			
-			float delay	= 0.0f;
-			// Compute delay time in seconds
-			if(tap <NUM_TAPS) {
-				delay = baseDelay * combPatterns[combPattern][tap] / NUM_TAPS; 
-			} else { // delay tap
-				delay = baseDelay * delayNonlinearity;
+		for(int c = 0; c < voiceCount; c++) {
+			float voltOctave = inputs[VOLT_OCTAVE_INPUT].getVoltage(c);
+			if(voltOctave != lastVoltOctave[c]) {
+				pitchShift[c] = powf(2.0f,voltOctave);
+				lastVoltOctave[c] = voltOctave;
 			}
-			// Number of delay samples
-			float index = delay * args.sampleRate;
-			if(lastDelayTime[tap] != index) {
-				delayLine.setDelayTime(tap,index);
-				lastDelayTime[tap] = index;
+			float voiceDelay = unpitchedDelay / pitchShift[c];
+			outputs[DELAY_LENGTH_OUTPUT].setVoltage(voiceDelay, c);
+			if(c == 0) {
+				baseDelay = voiceDelay;
 			}
 
-		
-			FloatFrame wetTap = {0.0f,0.0f};
-			if(tap == NUM_TAPS) {
-				feedbackValue = delayLine.getTap(tap);
-			} else {
-				if(combActive[tap]) {
-					wetTap = delayLine.getTap(tap);
-					wetTap.l = wetTap.l * envelope(tap,edgeLevel,tentLevel,tentTap);
-					wetTap.r = wetTap.r * envelope(tap,edgeLevel,tentLevel,tentTap);
+			// Comb tap delays only move with the size, clock, V/Oct or pattern
+			if(delaysChanged || voiceDelay != lastVoiceDelay[c]) {
+				for(int tap = 0; tap < NUM_TAPS;tap++) { 
+					// Number of delay samples
+					float index = voiceDelay * combPatterns[combPattern][tap] / NUM_TAPS * args.sampleRate;
+					combEngine[c].setDelay(tap, std::min(int(index), delayLine.getMaxDelaySize()));
 				}
+				lastVoiceDelay[c] = voiceDelay;
 			}
 
-			wet.l += wetTap.l;
-			wet.r += wetTap.r;
-		}
+			FloatFrame wet = combEngine[c].process(delayLine); // This is the mix of delays and input that is outputed
 
-		// wet.l = wet.l / ((float)tapCount) * tapCountSqrt;
-		// wet.r = wet.r / ((float)tapCount) * tapCountSqrt;
-		// wet.l = wet.l / tapCountSqrt;
-		// wet.r = wet.r / tapCountSqrt;
-
-		float feedbackWeight = 0.5;
-		switch(feedbackType) {
-			case FEEDBACK_GUITAR :
-				feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback.l);
-				feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback.r);
-				break;
-			case FEEDBACK_SITAR :
-				feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback.l);
-				feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback.r);
-
-				// T cx = std::max(std::min(drive * x, (T) 1.0), (T) -1.0);
-				// T y = std::max(std::min(cx - cx*cx*cx / (T) 3, (T) 2.0/3.0), (T) -2.0/3.0) / drive;
-
-				break;
-			case FEEDBACK_CLARINET :
-				feedbackValue.l = cubicSoftClip(feedbackValue.l / 10.0,1.0) * 13;
-				feedbackValue.r = cubicSoftClip(feedbackValue.r / 10.0,1.0) * 13;
-				feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback.l);
-				feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback.r);
-				break;
-			case FEEDBACK_RAW :
-				break;
-		}
-		
-		//feedbackValue = clamp(feedbackValue,-10.0f,10.0f);
+			// Feedback tap
+			float index = voiceDelay * delayNonlinearity * args.sampleRate;
+			if(lastFeedbackDelayTime[c] != index) {
+				delayLine.setDelayTime(c,index);
+				if(lastFeedbackDelayTime[c] < 0) {
+					delayLine.snapTap(c);
+				}
+				lastFeedbackDelayTime[c] = index;
+			}
+			FloatFrame feedbackValue = delayLine.getTap(c); // This is the output of a tap that gets sent back to input
+
+			// wet.l = wet.l / ((float)tapCount) * tapCountSqrt;
+			// wet.r = wet.r / ((float)tapCount) * tapCountSqrt;
+			// wet.l = wet.l / tapCountSqrt;
+			// wet.r = wet.r / tapCountSqrt;
+
+			float feedbackWeight = 0.5;
+			switch(feedbackType) {
+				case FEEDBACK_GUITAR :
+					feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback[c].l);
+					feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback[c].r);
+					break;
+				case FEEDBACK_SITAR :
+					feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback[c].l);
+					feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback[c].r);
+
+					// T cx = std::max(std::min(drive * x, (T) 1.0), (T) -1.0);
+					// T y = std::max(std::min(cx - cx*cx*cx / (T) 3, (T) 2.0/3.0), (T) -2.0/3.0) / drive;
+
+					break;
+				case FEEDBACK_CLARINET :
+					feedbackValue.l = cubicSoftClip(feedbackValue.l / 10.0,1.0) * 13;
+					feedbackValue.r = cubicSoftClip(feedbackValue.r / 10.0,1.0) * 13;
+					feedbackValue.l = (feedbackWeight * feedbackValue.l) + ((1-feedbackWeight) * lastFeedback[c].l);
+					feedbackValue.r = (feedbackWeight * feedbackValue.r) + ((1-feedbackWeight) * lastFeedback[c].r);
+					break;
+				case FEEDBACK_RAW :
+					break;
+			}
+			
+			//feedbackValue = clamp(feedbackValue,-10.0f,10.0f);
 
 
-		lastFeedback = feedbackValue;
+			lastFeedback[c] = feedbackValue;
 
-		FloatFrame out = wet; 
-		
-		outputs[OUT_L_OUTPUT].setVoltage(out.l);
-		outputs[OUT_R_OUTPUT].setVoltage(out.r);
+			FloatFrame out = wet; 
+			
+			outputs[OUT_L_OUTPUT].setVoltage(out.l, c);
+			outputs[OUT_R_OUTPUT].setVoltage(out.r, c);
+		}
+		outputs[OUT_L_OUTPUT].setChannels(voiceCount);
+		outputs[OUT_R_OUTPUT].setChannels(voiceCount);
+		outputs[DELAY_LENGTH_OUTPUT].setChannels(voiceCount);
 
 	}
 };
@@ -1,52 +1,12 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
-#include "filters/biquad.h"
+#include "ui/menu.hpp"
+#include "filters/biquadBank.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 using namespace std;
 
-struct LowFrequencyOscillator {
-	float phase = 0.0;
-	float pw = 0.5;
-	float freq = 1.0;
-	
-
-	LowFrequencyOscillator() {}
-	void setPitch(float pitch) {
-		pitch = fminf(pitch, 8.0);
-		freq = powf(2.0, pitch);
-	}
-	void setPulseWidth(float pw_) {
-		const float pwMin = 0.01;
-		pw = clamp(pw_, pwMin, 1.0f - pwMin);
-	}
-	void step(float dt) {
-		float deltaPhase = fminf(freq * dt, 0.5);
-		phase += deltaPhase;
-		if (phase >= 1.0)
-			phase -= 1.0;
-	}
-	float sin(float phaseOffset) {
-		float newPhase = fabsf(phase + phaseOffset);
-		return sinf(2*M_PI * newPhase);
-	}
-	float tri(float phaseOffset) {
-		float newPhase = 4.0 * fabsf(phase + phaseOffset -0.75 - roundf(phase + phaseOffset - 0.75));
-		return -1.0 + newPhase;
-	}
-	float saw(float phaseOffset) {
-		return 2.0 * (phase + phaseOffset - roundf(phase + phaseOffset));
-	}
-	float sqr(float phaseOffset) {
-		float newPhase = fabsf(phase + phaseOffset);
-		float sqr = (newPhase < pw);
-		return sqr;
-	}
-	float light() {
-		return sinf(2*M_PI * phase);
-	}
-};
-
 #define NUM_STAGE_SETUPS 3
 #define MAX_STAGES 12
 #define MAX_CHANNELS 2
@@ -153,13 +113,15 @@ struct JustAPhaser : Module {
 													{2.0, -2.0, 2.0, -2.0, 2.0, -2.0, 2.0, -2.0, 2.0, -2.0, 2.0, -2.0}} };
 
 
-	Biquad* pFilter[MAX_STAGES][MAX_CHANNELS];
-	LowFrequencyOscillator lfo;
+	// Stage i of channel c is section i*4 + c, so each group is one stage for both channels and the stages cascade group to group
+	BiquadBank<MAX_STAGES * 4> pFilter;
+	BiquadSweep<MAX_STAGES * 4> pSweep;
+	int sweepUpdateInterval = 8;
+	LowFrequencyOscillator<float> lfo;
 
 	int nunberOfStagesIndex = 0;
 	int numberOfStages = 4;
 	int filterMode = 0;
-	int lastFilterMode = -1;
 
 	int waveShape = 0;
 
@@ -167,10 +129,6 @@ struct JustAPhaser : Module {
 	float feedbackOut[MAX_CHANNELS];
 	float feedbackIn[MAX_CHANNELS] = {0.0,0.0};
 
-	float lastFc[MAX_STAGES][MAX_CHANNELS];
-
-	float lastResonance = 0.0;
-
 	float centerFrequency = 0.0;
 	float modDepth = 0.0;
 	float resonance = 0.0;
@@ -232,7 +190,7 @@ struct JustAPhaser : Module {
 
 		for(int i=0; i<MAX_STAGES; i++) {
 			for(int c=0;c<MAX_CHANNELS;c++) {
-				pFilter[i][c] = new Biquad(bq_type_allpass, 0.5 , 0.707, 0);
+				pFilter.setBiquad(i * 4 + c, bq_type_allpass, 0.5 , 0.707, 0);
 			}
 		};
 	}
@@ -252,6 +210,7 @@ struct JustAPhaser : Module {
 		json_object_set_new(rootJ, "filterMode", json_integer(filterMode));
 		json_object_set_new(rootJ, "waveShape", json_integer(waveShape));
 		json_object_set_new(rootJ, "frequencyModType", json_integer(frequencyModType));
+		json_object_set_new(rootJ, "sweepUpdateInterval", json_integer(sweepUpdateInterval));
 
 
 
@@ -275,6 +234,9 @@ struct JustAPhaser : Module {
 		json_t *ctFmt = json_object_get(rootJ, "frequencyModType");
 		if (ctFmt)
 			frequencyModType = json_integer_value(ctFmt);
+		// Patches saved before there was a choice worked the sweep out every sample
+		json_t *ctSui = json_object_get(rootJ, "sweepUpdateInterval");
+		sweepUpdateInterval = ctSui ? clamp((int) json_integer_value(ctSui), 1, 32) : 1;
 
 	}
 
@@ -335,26 +297,8 @@ struct JustAPhaser : Module {
 		lfo.setPitch(lfoFrequency);
 		lfo.step(1.0/sampleRate);
 
-		if(filterMode != lastFilterMode) {
-			for(int i=0; i<numberOfStages; i++) {
-				for(int c=0;c<MAX_CHANNELS;c++) {
-					pFilter[i][c]->setType(filterMode ? bq_type_allpass : bq_type_notch );
-				}
-			};
-			lastFilterMode = filterMode;
-			lastResonance = -1.0; // force resonance to get reset as well
-		}
-
 		float resonance = clamp(params[RESONANCE_PARAM].getValue() + (inputs[RESONANCE_INPUT].getVoltage() / 2.0),0.5f,5.0f);
-		if(resonance != lastResonance) {
-			resonancePercentage = resonance / 5.0;
-			for(int i=0; i<numberOfStages; i++) {
-				for(int c=0;c<MAX_CHANNELS;c++) {
-					pFilter[i][c]->setQ(resonance);
-				}
-			};
-			lastResonance = resonance;
-		}
+		resonancePercentage = resonance / 5.0;
 
 		float centerFrequency = clamp(params[CENTER_FREQUENCY_PARAM].getValue() + (inputs[CENTER_FREQUENCY_INPUT].getVoltage()),4.0f,14.0f);
 		centerFrequencyPercentage = (centerFrequency - 4.0)/ 10.0;
@@ -366,45 +310,58 @@ struct JustAPhaser : Module {
 
 		float steroPhase = clamp(params[STEREO_PHASE_PARAM].getValue() + (inputs[STEREO_PHASE_INPUT].getVoltage() / 10.0),0.0f,1.0f);
 		stereoPhasePercentage = steroPhase;
-		for(int c=0;c<MAX_CHANNELS;c++) {
-			float lfoValue = 0.0;
-			if (inputs[EXTERNAL_MOD_INPUT_L+c].active) {
-				lfoValue = (inputs[EXTERNAL_MOD_INPUT_L+c].getVoltage() / 5.0) - 1.0;
-			} else {
-				switch(waveShape) {
-					case SIN_LFO :			
-						lfoValue = lfo.sin(c == 0 ? 0.0 : steroPhase);
-						break;
-					case TRI_LFO :			
-						lfoValue = lfo.tri(c == 0 ? 0.0 : steroPhase);
-						break;
-					case SAW_LFO :			
-						lfoValue = lfo.saw(c == 0 ? 0.0 : steroPhase);
-						break;
-					case SQR_LFO :			
-						lfoValue = lfo.sqr(c == 0 ? 0.0 : steroPhase);
-						break;
+
+		// Stage frequencies are only worked out every sweepUpdateInterval samples, the filters ramp to them in between
+		pSweep.updateInterval = sweepUpdateInterval;
+		if(pSweep.needsTargets(numberOfStages)) {
+			// One lane per channel, the spare lanes just shadow the left and right
+			simd::float_4 lfoPhase(0.f, steroPhase, 0.f, steroPhase);
+			simd::float_4 stageLfo = 0.f;
+			switch(waveShape) {
+				case SIN_LFO :
+					stageLfo = lfo.sin(lfoPhase);
+					break;
+				case TRI_LFO :
+					stageLfo = lfo.tri(lfoPhase);
+					break;
+				case SAW_LFO :
+					stageLfo = lfo.saw(lfoPhase);
+					break;
+				case SQR_LFO :
+					stageLfo = (lfo.sqr(lfoPhase) + 1.f) * 0.5f; // 0 to 1
+					break;
+			}
+			for(int c=0;c<MAX_CHANNELS;c++) {
+				if (inputs[EXTERNAL_MOD_INPUT_L+c].active) {
+					stageLfo[c] = stageLfo[c+2] = (inputs[EXTERNAL_MOD_INPUT_L+c].getVoltage() / 5.0) - 1.0;
 				}
 			}
+
 			for(int i=0; i<numberOfStages; i++) {
 
 				//2.0 is temporary
-				float Fc = centerFrequency - 2.0 + (basefreq[nunberOfStagesIndex][i] * frequencySpan) + (modValue * basespan[frequencyModType][nunberOfStagesIndex][i] * lfoValue);
-				if(fabsf(lastFc[i][c] - Fc) > 1E-2) {
-					pFilter[i][c]->setFc(clamp(pow(2,Fc),20.0f,15000.0f)/ sampleRate);
-					lastFc[i][c] = Fc;
+				simd::float_4 Fc = centerFrequency - 2.0f + (basefreq[nunberOfStagesIndex][i] * frequencySpan) + (modValue * basespan[frequencyModType][nunberOfStagesIndex][i] * stageLfo);
+				Fc = simd::clamp(dsp::exp2_taylor5(Fc),20.0f,15000.0f) / sampleRate;
+				if(filterMode) {
+					pSweep.setAllpassTarget(pFilter, i, Fc, resonance);
+				} else {
+					pSweep.setNotchTarget(pFilter, i, Fc, resonance);
 				}
 			};
 		}
+		pSweep.step(pFilter, numberOfStages);
 
 		float mix = clamp(params[MIX_PARAM].getValue() + (inputs[MIX_CV_INPUT].getVoltage() / 10.0),0.0f,1.0f);
 		mixPercentage = mix;
 		
+		simd::float_4 phaseIn = 0.f;
 		for(int c=0; c<MAX_CHANNELS;c++) {
-			float phaseOut = directInput[c]+ (feedbackIn[c] * feedbackAmount);			
-			for(int i=0;i<numberOfStages;i++) {
-				phaseOut = pFilter[i][c]->process(phaseOut);
-			}
+			phaseIn[c] = directInput[c]+ (feedbackIn[c] * feedbackAmount);			
+		}
+		simd::float_4 phaseOutput = pFilter.processCascade(phaseIn, numberOfStages);
+
+		for(int c=0; c<MAX_CHANNELS;c++) {
+			float phaseOut = phaseOutput[c];
 			feedbackOut[c] = phaseOut;
 			outputs[FB_OUT_L_OUTPUT + c].setVoltage(phaseOut * 5);
 			
@@ -525,6 +482,22 @@ struct JustAPhaserWidget : ModuleWidget {
 		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH - 12, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH + 12, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 	}
+
+	void appendContextMenu(Menu *menu) override {
+		JustAPhaser *module = dynamic_cast<JustAPhaser*>(this->module);
+		assert(module);
+
+		menu->addChild(new MenuLabel());
+		{
+			OptionsMenuItem* mi = new OptionsMenuItem("Sweep Update Rate");
+			mi->addItem(OptionMenuItem("Every Sample", [module]() { return module->sweepUpdateInterval == 1; }, [module]() { module->sweepUpdateInterval = 1; }));
+			mi->addItem(OptionMenuItem("4 Samples", [module]() { return module->sweepUpdateInterval == 4; }, [module]() { module->sweepUpdateInterval = 4; }));
+			mi->addItem(OptionMenuItem("8 Samples", [module]() { return module->sweepUpdateInterval == 8; }, [module]() { module->sweepUpdateInterval = 8; }));
+			mi->addItem(OptionMenuItem("16 Samples", [module]() { return module->sweepUpdateInterval == 16; }, [module]() { module->sweepUpdateInterval = 16; }));
+			mi->addItem(OptionMenuItem("32 Samples", [module]() { return module->sweepUpdateInterval == 32; }, [module]() { module->sweepUpdateInterval = 32; }));
+			menu->addChild(mi);
+		}
+	}
 };
 
 Model *modelJustAPhaser = createModel<JustAPhaser, JustAPhaserWidget>("JustAPhaser");
@@ -2,6 +2,8 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "ui/scopeCapture.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 #define BUFFER_SIZE 512
 
@@ -79,84 +81,13 @@ struct LissajousLFO : Module {
 		NUM_LIGHTS
 	};
 
-	struct LowFrequencyOscillator {
-		float basePhase = 0.0;
-		float phase = 0.0;
-		float freq = 1.0;
-		float skew = 0.5; // Triangle
-		float waveSlope = 1.0; //Original (1 is sin)
-		bool offset = false;
-		
-		float lerp(float v0, float v1, float t) {
-			return (1 - t) * v0 + t * v1;
-		}
-		
-		void setPitch(float pitch) {
-			pitch = fminf(pitch, 8.0);
-			freq = powf(2.0, pitch);
-		}
-
-		void setBasePhase(float initialPhase) {
-			//Apply change, then remember
-			phase += initialPhase - basePhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-			else if (phase < 0)
-				phase += 1.0;	
-			basePhase = initialPhase;
-		}
-		
-
-		void step(float dt) {
-			float deltaPhase = fminf(freq * dt, 0.5);
-			phase += deltaPhase;
-			if (phase >= 1.0)
-				phase -= 1.0;
-		}
-
-		float skewsaw(float x) {
-			
-			x = std::fabs(std::fmod(x ,1.0f));
-
-			float inverseSkew = 1 - skew;
-			float originalWave;
-			if (skew == 0 && x == 0) //Avoid /0 error
-				originalWave = 2;
-			if (x <= skew)
-				originalWave = 2.0 * (1- (-1 / skew * x + 1));
-			else
-				originalWave = 2.0 * (1-(1 / inverseSkew * (x - skew)));
-			return originalWave;
-		}
-		
-		float skewsaw() {
-			if (offset)
-				return lerp(skewsaw(phase),sin(),waveSlope);
-			
-			return lerp(skewsaw(phase) - 1 ,sin(),waveSlope);skewsaw(phase) ; //Going to keep same phase for now				
-		}
-
-		float sin() {
-			if (offset) // Sin wave is 90 degrees out of phase with other waves
-				return 1.0 - cosf(2*M_PI * (phase - 0.25)) ;
-			else
-				return sinf(2*M_PI * (phase - 0.25)) ;
-		}
-
-	};
-
-	
-
 	float phase = 0.0;
 
-	LowFrequencyOscillator oscillatorX1,oscillatorY1,oscillatorX2,oscillatorY2;
+	// One lane per oscillator: X1, Y1, X2, Y2
+	LowFrequencyOscillator<simd::float_4> oscillator;
 
-	float bufferX1[BUFFER_SIZE] = {};
-	float bufferY1[BUFFER_SIZE] = {};
-	float bufferX2[BUFFER_SIZE] = {};
-	float bufferY2[BUFFER_SIZE] = {};
-	int bufferIndex = 0;
-	float frameIndex = 0;
+	// X1, Y1, X2, Y2 as for the oscillator
+	ScopeCapture<BUFFER_SIZE> scope;
 	float deltaTime = powf(2.0, -8);
 
 	//SchmittTrigger resetTrigger;
@@ -251,8 +182,14 @@ struct LissajousLFO : Module {
 		configOutput(OUTPUT_6, "X1 * X2");
 		configOutput(OUTPUT_7, "Y1 * Y2");
 		configOutput(OUTPUT_8, "Ave X * Ave Y");
-		
+
+		onSampleRateChange();
+	}
+
+	void onSampleRateChange() override {
+		scope.setDecimation((int)ceilf(deltaTime * APP->engine->getSampleRate()));
 	}
+
 	void process(const ProcessArgs &args) override;
 
 	// For more advanced Module features, read Rack's engine.hpp header file
@@ -271,72 +208,60 @@ void LissajousLFO::process(const ProcessArgs &args) {
 	float amplitude2 = clamp(params[AMPLITUDE2_PARAM].getValue() + (inputs[AMPLITUDE2_INPUT].getVoltage() * params[AMPLITUDE2_CV_ATTENUVERTER_PARAM].getValue() / 2.0f),0.0f,5.0f);
 	amplitude2Percentage = amplitude2 / 5.0;
 
-	// Implement 4 oscillators
+	// Implement 4 oscillators, all stepped in one pass
 	float freqX1 = clamp(params[FREQX1_PARAM].getValue() + (inputs[FREQX1_INPUT].getVoltage() * params[FREQX1_CV_ATTENUVERTER_PARAM].getValue()),-8.0f,3.0f);
 	freqX1Percentage = (freqX1 + 8.0) / 11.0;
-	oscillatorX1.setPitch(freqX1);
 	initialPhase = params[PHASEX1_PARAM].getValue() + (inputs[PHASEX1_INPUT].getVoltage() * params[PHASEX1_CV_ATTENUVERTER_PARAM].getValue() / 10.0);
 	if (initialPhase >= 1.0)
 		initialPhase -= 1.0;
 	else if (initialPhase < 0)
 		initialPhase += 1.0;
 	phaseX1Percentage = initialPhase;
-	oscillatorX1.setBasePhase(initialPhase);
+	float phaseX1 = initialPhase;
 	float waveShapeX1 =clamp(params[WAVESHAPEX1_PARAM].getValue() + (inputs[WAVESHAPEX1_INPUT].getVoltage() * params[WAVESHAPEX1_CV_ATTENUVERTER_PARAM].getValue() / 10.0),0.0f,1.0f);
 	waveShapeX1Percentage = waveShapeX1;
-	oscillatorX1.waveSlope = waveShapeX1;
 	float skewX1 = clamp(params[SKEWX1_PARAM].getValue() + (inputs[SKEWX1_INPUT].getVoltage() * params[SKEWX1_CV_ATTENUVERTER_PARAM].getValue() / 10.0 ),0.0f,1.0f);
 	skewX1Percentage = skewX1;
-	oscillatorX1.skew = skewX1;
 	
 	float freqY1 = clamp(params[FREQY1_PARAM].getValue() + (inputs[FREQY1_INPUT].getVoltage() * params[FREQY1_CV_ATTENUVERTER_PARAM].getValue()),-8.0f,3.0f);
 	freqY1Percentage = (freqY1 + 8.0) / 11.0;
-	oscillatorY1.setPitch(freqY1);
 	float waveShapeY1 =clamp(params[WAVESHAPEY1_PARAM].getValue() + (inputs[WAVESHAPEY1_INPUT].getVoltage() * params[WAVESHAPEY1_CV_ATTENUVERTER_PARAM].getValue() / 10.0),0.0f,1.0f);
 	waveShapeY1Percentage = waveShapeY1;
-	oscillatorY1.waveSlope = waveShapeY1;
 	float skewY1 = clamp(params[SKEWY1_PARAM].getValue() + (inputs[SKEWY1_INPUT].getVoltage() * params[SKEWY1_CV_ATTENUVERTER_PARAM].getValue() / 10.0 ),0.0f,1.0f);
 	skewY1Percentage = skewY1;
-	oscillatorY1.skew = skewY1;
 	
 	float freqX2 = clamp(params[FREQX2_PARAM].getValue() + (inputs[FREQX2_INPUT].getVoltage() * params[FREQX2_CV_ATTENUVERTER_PARAM].getValue()),-8.0f,3.0f);
 	freqX2Percentage = (freqX2 + 8.0) / 11.0;
-	oscillatorX2.setPitch(freqX2);
 	initialPhase = params[PHASEX2_PARAM].getValue() + (inputs[PHASEX2_INPUT].getVoltage() * params[PHASEX2_CV_ATTENUVERTER_PARAM].getValue() / 10.0);
 	if (initialPhase >= 1.0)
 		initialPhase -= 1.0;
 	else if (initialPhase < 0)
 		initialPhase += 1.0;
 	phaseX2Percentage = initialPhase;
-	oscillatorX2.setBasePhase(initialPhase);
+	float phaseX2 = initialPhase;
 	float waveShapeX2 =clamp(params[WAVESHAPEX2_PARAM].getValue() + (inputs[WAVESHAPEX2_INPUT].getVoltage() * params[WAVESHAPEX2_CV_ATTENUVERTER_PARAM].getValue() / 10.0),0.0f,1.0f);
 	waveShapeX2Percentage = waveShapeX2;
-	oscillatorX2.waveSlope = waveShapeX2;
 	float skewX2 = clamp(params[SKEWX2_PARAM].getValue() + (inputs[SKEWX2_INPUT].getVoltage() * params[SKEWX2_CV_ATTENUVERTER_PARAM].getValue() / 10.0 ),0.0f,1.0f);
 	skewX2Percentage = skewX2;
-	oscillatorX2.skew = skewX2;
 	
 	float freqY2 = clamp(params[FREQY2_PARAM].getValue() + (inputs[FREQY2_INPUT].getVoltage() * params[FREQY2_CV_ATTENUVERTER_PARAM].getValue()),-8.0f,3.0f);
 	freqY2Percentage = (freqY2 + 8.0) / 11.0;
-	oscillatorY2.setPitch(freqY2);
 	float waveShapeY2 =clamp(params[WAVESHAPEY2_PARAM].getValue() + (inputs[WAVESHAPEY2_INPUT].getVoltage() * params[WAVESHAPEY2_CV_ATTENUVERTER_PARAM].getValue() / 10.0),0.0f,1.0f);
 	waveShapeY2Percentage = waveShapeY2;
-	oscillatorY2.waveSlope = waveShapeY2;
 	float skewY2 = clamp(params[SKEWY2_PARAM].getValue() + (inputs[SKEWY2_INPUT].getVoltage() * params[SKEWY2_CV_ATTENUVERTER_PARAM].getValue() / 10.0 ),0.0f,1.0f);
 	skewY2Percentage = skewY2;
-	oscillatorY2.skew = skewY2;
 
+	oscillator.setPitch(simd::float_4(freqX1, freqY1, freqX2, freqY2));
+	oscillator.setBasePhase(simd::float_4(phaseX1, 0.f, phaseX2, 0.f));
+	oscillator.waveSlope = simd::float_4(waveShapeX1, waveShapeY1, waveShapeX2, waveShapeY2);
+	oscillator.skew = simd::float_4(skewX1, skewY1, skewX2, skewY2);
+	oscillator.step(1.0 / args.sampleRate);
 
-	oscillatorX1.step(1.0 / args.sampleRate);
-	oscillatorY1.step(1.0 / args.sampleRate);
-	oscillatorX2.step(1.0 / args.sampleRate);
-	oscillatorY2.step(1.0 / args.sampleRate);
-
-	
-	float x1 = amplitude1 * oscillatorX1.skewsaw();
-	float y1 = amplitude1 * oscillatorY1.skewsaw();
-	float x2 = amplitude2 * oscillatorX2.skewsaw();
-	float y2 = amplitude2 * oscillatorY2.skewsaw();
+	simd::float_4 xy = simd::float_4(amplitude1, amplitude1, amplitude2, amplitude2) * oscillator.shapedSkewsaw();
+	float x1 = xy[0];
+	float y1 = xy[1];
+	float x2 = xy[2];
+	float y2 = xy[3];
 
 	outputs[OUTPUT_1].setVoltage((x1 + x2) / 2);
 	outputs[OUTPUT_2].setVoltage((y1 + y2) / 2);
@@ -352,26 +277,7 @@ void LissajousLFO::process(const ProcessArgs &args) {
 	float out8 = (x1*x2*y1*y2);
 	outputs[OUTPUT_8].setVoltage(clamp(out8,-5.0f,5.0f) );
 
-	//Update scope.
-	int frameCount = (int)ceilf(deltaTime * args.sampleRate);
-
-	// Add frame to buffers
-	if (bufferIndex < BUFFER_SIZE) {
-		if (++frameIndex > frameCount) {
-			frameIndex = 0;
-			bufferX1[bufferIndex] = x1;
-			bufferY1[bufferIndex] = y1;
-			bufferX2[bufferIndex] = x2;
-			bufferY2[bufferIndex] = y2;
-			bufferIndex++;
-		}
-	}
-
-	// Are we waiting on the next trigger?
-	if (bufferIndex >= BUFFER_SIZE) {
-		bufferIndex = 0;
-		frameIndex = 0;
-	}
+	scope.process(xy);
 }
 
 
@@ -406,17 +312,16 @@ struct ScopeDisplay : TransparentWidget {
 		fontPath = asset::plugin(pluginInstance, "res/fonts/Sudo.ttf");
 	}
 
-	void drawWaveform(const DrawArgs &args, float *valuesX, float *valuesY) {
-		if (!valuesX)
-			return;
+	// One trace from the snapshot, with X and Y in lanes xLane and xLane + 1
+	void drawWaveform(const DrawArgs &args, const simd::float_4 *points, int xLane, float gain) {
 		nvgSave(args.vg);
 		nvgScissor(args.vg, box.pos.x, box.pos.y, box.size.x, box.size.y);
 		nvgBeginPath(args.vg);
 		// Draw maximum display left to right
 		for (int i = 0; i < BUFFER_SIZE; i++) {
 			Vec v;
-			v.x = valuesX[i] / 2.0 + 0.5;
-			v.y = valuesY[i] / 2.0 + 0.5;
+			v.x = points[i][xLane] * gain / 2.0 + 0.5;
+			v.y = points[i][xLane + 1] * gain / 2.0 + 0.5;
 			Vec p;
 			p.x = rescale(v.x, 0.f, 1.f, 0, box.size.x);
 			p.y = rescale(v.y, 0.f, 1.f, box.size.y, 0);
@@ -442,39 +347,21 @@ struct ScopeDisplay : TransparentWidget {
 		if (!module)
 			return;
 
-		float gainX = powf(2.0, 1);
-		float gainY = powf(2.0, 1);
+		float gain = powf(2.0, 1) / 10.0;
 		//float offsetX = module->x1;
 		//float offsetY = module->y1;
 
-		float valuesX[BUFFER_SIZE];
-		float valuesY[BUFFER_SIZE];
-		for (int i = 0; i < BUFFER_SIZE; i++) {
-			int j = i;
-			// Lock display to buffer if buffer update deltaTime <= 2^-11
-			j = (i + module->bufferIndex) % BUFFER_SIZE;
-			valuesX[i] = (module->bufferX1[j]) * gainX / 10.0;
-			valuesY[i] = (module->bufferY1[j]) * gainY / 10.0;
-		}
+		const simd::float_4 *points = module->scope.snapshot();
 
 		// Draw waveforms for LFO 1
 		// X x Y
 		nvgStrokeColor(args.vg, nvgRGBA(0x9f, 0xe4, 0x36, 0xc0));
-		drawWaveform(args, valuesX, valuesY);
-
-
-		for (int i = 0; i < BUFFER_SIZE; i++) {
-			int j = i;
-			// Lock display to buffer if buffer update deltaTime <= 2^-11
-			j = (i + module->bufferIndex) % BUFFER_SIZE;
-			valuesX[i] = (module->bufferX2[j]) * gainX / 10.0;
-			valuesY[i] = (module->bufferY2[j]) * gainY / 10.0;
-		}
+		drawWaveform(args, points, 0, gain);
 
 		// Draw waveforms for LFO 2
 		// X x Y
 		nvgStrokeColor(args.vg, nvgRGBA(0x3f, 0xe4, 0x96, 0xc0));
-		drawWaveform(args, valuesX, valuesY);
+		drawWaveform(args, points, 2, gain);
 	}
 };
 
@@ -5,6 +5,11 @@
 #include "ui/ports.hpp"
 #include "ui/menu.hpp"
 #include "filters/biquad.h"
+#include "filters/biquadBank.hpp"
+#include "dsp-compressor/compressorBank.hpp"
+
+#define POLY_LINKED 0
+#define POLY_PER_VOICE 1
 
 struct ManicCompression : Module {
 	enum ParamIds {		
@@ -91,7 +96,14 @@ struct ManicCompression : Module {
 	
 	chunkware_simple::SimpleComp compressor;
 	chunkware_simple::SimpleCompRms compressorRms;
-	float gainReduction;
+	chunkware_simple::SimpleCompConfig compressorConfig;
+	// Per Voice mode gives every voice of a polyphonic input its own gain computer, one lane each. Linked keeps the one
+	// detector above and keys it off all the voices together
+	chunkware_simple::CompressorBank<PORT_MAX_CHANNELS> voiceCompressor;
+	int polyMode = POLY_LINKED;
+	// Set from the menu and patch loading, process() switches over at the top of its next call
+	std::atomic<int> pendingPolyMode {POLY_LINKED};
+	float gainReduction; // the most reduced voice, for the meter
 	double threshold, ratio, knee;
 
 	bool bypassed =  false;
@@ -117,6 +129,9 @@ struct ManicCompression : Module {
 
 	Biquad* lpFilterBank[6]; // 3 filters 2 for stereo inputs, one for sidechain x 2 to increase slope
 	Biquad* hpFilterBank[6]; // 3 filters 2 for stereo inputs, one for sidechain x 2 to increase slope
+	// Same layout, one lane per voice, for polyphonic inputs
+	BiquadBank<PORT_MAX_CHANNELS> lpFilterPoly[6];
+	BiquadBank<PORT_MAX_CHANNELS> hpFilterPoly[6];
 
 	//percentages
 	float thresholdPercentage = 0;
@@ -204,13 +219,24 @@ struct ManicCompression : Module {
 		for(int f=0;f<6;f++) {
 			lpFilterBank[f] = new Biquad(bq_type_lowpass, lpCutoff , 0.707, 0);
 			hpFilterBank[f] = new Biquad(bq_type_highpass, hpCutoff , 0.707, 0);
+			for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+				lpFilterPoly[f].setBiquad(c, bq_type_lowpass, lpCutoff , 0.707, 0);
+				hpFilterPoly[f].setBiquad(c, bq_type_highpass, hpCutoff , 0.707, 0);
+			}
 		}
 
+		compressor.setSampleRate(sampleRate);
+		compressorRms.setSampleRate(sampleRate);
+		voiceCompressor.setSampleRate(sampleRate);
 		compressor.initRuntime();
 		compressorRms.initRuntime();
 
 	}
 	void process(const ProcessArgs &args) override;
+	void processPoly(int channels, int sidechainChannels, float inputGain, float makeupGain, float mix);
+	void processLinked(double key);
+	void setPolyMode(int mode);
+	float envelopeVoltage(float gainReduction);
     void dataFromJson(json_t *) override;
 	void onSampleRateChange() override;
     json_t *dataToJson() override;
@@ -245,6 +271,7 @@ json_t *ManicCompression::dataToJson() {
 
 	json_object_set_new(rootJ, "gateMode", json_integer((bool) gateMode));
 	json_object_set_new(rootJ, "envelopeMode", json_integer(envelopeMode));
+	json_object_set_new(rootJ, "polyMode", json_integer(pendingPolyMode));
 
 	return rootJ;
 }
@@ -291,6 +318,21 @@ void ManicCompression::dataFromJson(json_t *rootJ) {
 	if (cdJ)
 		compressDirection = json_integer_value(cdJ);
 
+	json_t *pmJ = json_object_get(rootJ, "polyMode");
+	if (pmJ)
+		pendingPolyMode = json_integer_value(pmJ) == POLY_PER_VOICE ? POLY_PER_VOICE : POLY_LINKED;
+
+}
+
+void ManicCompression::setPolyMode(int mode) {
+	if(mode == polyMode)
+		return;
+	polyMode = mode;
+	// Linked and Per Voice run different gain computers, whichever takes over starts from rest with the current settings
+	compressorConfig.invalidate();
+	compressor.initRuntime();
+	compressorRms.initRuntime();
+	voiceCompressor.initRuntime();
 }
 
 void ManicCompression::onSampleRateChange() {
@@ -301,12 +343,20 @@ void ManicCompression::onSampleRateChange() {
 	for(int f=0;f<6;f++) {
 		lpFilterBank[f]->setFc(lpCutoff);
 		hpFilterBank[f]->setFc(hpCutoff);
+		for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+			lpFilterPoly[f].setFc(c, lpCutoff);
+			hpFilterPoly[f].setFc(c, hpCutoff);
+		}
 	}
+
+	compressor.setSampleRate(sampleRate);
+	compressorRms.setSampleRate(sampleRate);
+	voiceCompressor.setSampleRate(sampleRate);
 }
 
 void ManicCompression::process(const ProcessArgs &args) {
-	compressor.setSampleRate(double(args.sampleRate));
-	compressorRms.setSampleRate(double(args.sampleRate));
+
+	setPolyMode(pendingPolyMode);
 
 	float bypassInput = inputs[BYPASS_INPUT].getVoltage();
 	if(gateMode) {
@@ -501,6 +551,22 @@ void ManicCompression::process(const ProcessArgs &args) {
 	double mix = clamp(params[MIX_PARAM].getValue() + (inputs[MIX_CV_INPUT].getVoltage() * 0.1 * params[MIX_CV_ATTENUVERTER_PARAM].getValue()),0.0f,1.0f);
 	mixPercentage = mix;
 
+	compressorConfig.setRatio(ratio);
+	compressorConfig.setThresh(50.0+threshold);
+	compressorConfig.setKnee(knee);
+	compressorConfig.setAttack(attack);
+	compressorConfig.setRelease(release);
+	compressorConfig.setAttackCurve(attackCurve);
+	compressorConfig.setReleaseCurve(releaseCurve);
+	compressorConfig.setWindow(rmsWindow);
+
+	int channels = std::max(inputs[SOURCE_L_INPUT].getChannels(), 1);
+	int sidechainChannels = inputs[SIDECHAIN_INPUT].getChannels();
+	if(polyMode == POLY_PER_VOICE || channels > 1 || sidechainChannels > 1) {
+		processPoly(channels, sidechainChannels, inputGain, compressDirection ? -makeupGain : makeupGain, mix);
+		return;
+	}
+	compressorConfig.apply(compressor, compressorRms);
 
 	double inputL = inputs[SOURCE_L_INPUT].getVoltage();
 	double inputR = inputL;
@@ -545,15 +611,6 @@ void ManicCompression::process(const ProcessArgs &args) {
 	}
 
 	if(rmsMode) {
-		compressorRms.setRatio(ratio);
-		compressorRms.setThresh(50.0+threshold);
-		compressorRms.setKnee(knee);
-		compressorRms.setAttack(attack);
-		compressorRms.setRelease(release);
-		compressorRms.setAttackCurve(attackCurve);
-		compressorRms.setReleaseCurve(releaseCurve);
-		compressorRms.setWindow(rmsWindow);
-		
 
 		if(usingSidechain) {
 			if(!compressDirection)
@@ -571,14 +628,6 @@ void ManicCompression::process(const ProcessArgs &args) {
 		}
 		gainReduction = compressorRms.getGainReduction();
 	} else {
-		compressor.setRatio(ratio);
-		compressor.setThresh(50.0+threshold);
-		compressor.setKnee(knee);
-		compressor.setAttack(attack);
-		compressor.setRelease(release);
-		compressor.setAttackCurve(attackCurve);
-		compressor.setReleaseCurve(releaseCurve);
-		
 
 		if(usingSidechain) {
 			if(!compressDirection)
@@ -597,17 +646,8 @@ void ManicCompression::process(const ProcessArgs &args) {
 		gainReduction = compressor.getGainReduction();
 	}		
 	
-	switch(envelopeMode) {
-		case 0 : // original gain reduced linear
-			outputs[ENVELOPE_OUT].setVoltage(clamp(chunkware_simple::dB2lin(gainReduction) / 3.0f,-10.0f,10.0f));
-			break;
-		case 1 : // linear
-			outputs[ENVELOPE_OUT].setVoltage(clamp(chunkware_simple::dB2lin(gainReduction),-10.0f,10.0f));
-			break;
-		case 2 : // exponential
-			outputs[ENVELOPE_OUT].setVoltage(clamp(gainReduction,-10.0f,10.0f));
-			break;
-	}
+	outputs[ENVELOPE_OUT].setChannels(1);
+	outputs[ENVELOPE_OUT].setVoltage(envelopeVoltage(gainReduction));
 	if(compressDirection)
 		makeupGain = -makeupGain;
 	double finalGainLin = chunkware_simple::dB2lin(makeupGain-gainReduction);
@@ -640,10 +680,175 @@ void ManicCompression::process(const ProcessArgs &args) {
 
 
 
+	outputs[OUTPUT_L].setChannels(1);
+	outputs[OUTPUT_R].setChannels(1);
 	outputs[OUTPUT_L].setVoltage(outputL);
 	outputs[OUTPUT_R].setVoltage(outputR);
 }
 
+float ManicCompression::envelopeVoltage(float gainReduction) {
+	switch(envelopeMode) {
+		case 0 : // original gain reduced linear
+			return clamp(chunkware_simple::dB2lin(gainReduction) / 3.0f,-10.0f,10.0f);
+		case 1 : // linear
+			return clamp(chunkware_simple::dB2lin(gainReduction),-10.0f,10.0f);
+		case 2 : // exponential
+			return clamp(gainReduction,-10.0f,10.0f);
+	}
+	return 0.f;
+}
+
+void ManicCompression::processLinked(double key) {
+	if(rmsMode) {
+		if(!compressDirection)
+			compressorRms.process(key);
+		else
+			compressorRms.processUpward(key);
+		gainReduction = compressorRms.getGainReduction();
+	} else {
+		if(!compressDirection)
+			compressor.process(key);
+		else
+			compressor.processUpward(key);
+		gainReduction = compressor.getGainReduction();
+	}
+}
+
+// Polyphonic sources, and Per Voice mode on any source. Voices are float_4 lanes through the filters, the detector and
+// the gain. A mono right input or sidechain is shared by every voice. Linked mode keys the one detector off all voices
+// and sidechain channels at once, the loudest in peak mode and the power sum in RMS mode, as the mono path does with
+// left and right. makeupGain comes in already negated for upward compression
+void ManicCompression::processPoly(int channels, int sidechainChannels, float inputGain, float makeupGain, float mix) {
+	bool perVoice = polyMode == POLY_PER_VOICE;
+	bool usingSidechain = sidechainChannels > 0;
+	int groups = (channels + 3) / 4;
+	const simd::float_4 laneIndex = simd::float_4(0.f, 1.f, 2.f, 3.f);
+
+	simd::float_4 inputL[PORT_MAX_CHANNELS / 4];
+	simd::float_4 inputR[PORT_MAX_CHANNELS / 4];
+	simd::float_4 originalInputL[PORT_MAX_CHANNELS / 4];
+	simd::float_4 originalInputR[PORT_MAX_CHANNELS / 4];
+	simd::float_4 key[PORT_MAX_CHANNELS / 4];
+	double linkedKey = 0.0;
+
+	for(int g=0;g<groups;g++) {
+		originalInputL[g] = inputs[SOURCE_L_INPUT].getPolyVoltageSimd<simd::float_4>(g*4);
+		originalInputR[g] = inputs[SOURCE_R_INPUT].isConnected() ? inputs[SOURCE_R_INPUT].getPolyVoltageSimd<simd::float_4>(g*4) : originalInputL[g];
+		//In Mid-Side Mode, L=mid, R=side
+		if(midSideMode) {
+			inputL[g] = originalInputL[g] + originalInputR[g];
+			inputR[g] = originalInputL[g] - originalInputR[g];
+		} else {
+			inputL[g] = originalInputL[g];
+			inputR[g] = originalInputR[g];
+		}
+		if(usingSidechain)
+			continue;
+
+		simd::float_4 processedL = inputL[g];
+		simd::float_4 processedR = inputR[g];
+		if(lpFilterMode) {
+			processedL = lpFilterPoly[1].process(g, lpFilterPoly[0].process(g, processedL));
+			processedR = lpFilterPoly[3].process(g, lpFilterPoly[2].process(g, processedR));
+		}
+		if(hpFilterMode) {
+			processedL = hpFilterPoly[1].process(g, hpFilterPoly[0].process(g, processedL));
+			processedR = hpFilterPoly[3].process(g, hpFilterPoly[2].process(g, processedR));
+		}
+		if(rmsMode) {
+			key[g] = (processedL * processedL + processedR * processedR) * inputGain; // power summing
+		} else {
+			key[g] = simd::fmax(simd::abs(processedL), simd::abs(processedR)) * inputGain; // link channels with greater of 2
+		}
+		if(!perVoice) {
+			simd::float_4 voiceKey = simd::ifelse(laneIndex + (float) (g*4) < (float) channels, key[g], 0.f);
+			for(int i=0;i<4;i++) {
+				linkedKey = rmsMode ? linkedKey + voiceKey[i] : std::max(linkedKey, (double) voiceKey[i]);
+			}
+		}
+	}
+
+	if(usingSidechain) {
+		// Per Voice pairs sidechain channels with voices, Linked takes every sidechain channel
+		int sidechainGroups = perVoice ? groups : (sidechainChannels + 3) / 4;
+		for(int g=0;g<sidechainGroups;g++) {
+			simd::float_4 sidechain = inputs[SIDECHAIN_INPUT].getPolyVoltageSimd<simd::float_4>(g*4);
+			if(lpFilterMode) {
+				sidechain = lpFilterPoly[5].process(g, lpFilterPoly[4].process(g, sidechain));
+			}
+			if(hpFilterMode) {
+				sidechain = hpFilterPoly[5].process(g, hpFilterPoly[4].process(g, sidechain));
+			}
+			key[g] = rmsMode ? sidechain * sidechain : sidechain;
+			if(!perVoice) {
+				simd::float_4 sidechainKey = simd::ifelse(laneIndex + (float) (g*4) < (float) sidechainChannels, simd::abs(key[g]), 0.f);
+				for(int i=0;i<4;i++) {
+					linkedKey = rmsMode ? linkedKey + sidechainKey[i] : std::max(linkedKey, (double) sidechainKey[i]);
+				}
+			}
+		}
+	}
+
+	simd::float_4 finalGainLin[PORT_MAX_CHANNELS / 4];
+	if(perVoice) {
+		compressorConfig.applyAll(voiceCompressor);
+		for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+			voiceCompressor.setActive(c, c < channels);
+			voiceCompressor.setRms(c, rmsMode);
+			voiceCompressor.setUpward(c, compressDirection);
+		}
+		outputs[ENVELOPE_OUT].setChannels(channels);
+		gainReduction = 0.f;
+		for(int g=0;g<groups;g++) {
+			simd::float_4 reduction = voiceCompressor.process(g, key[g]);
+			finalGainLin[g] = chunkware_simple::fastDB2lin(makeupGain - reduction);
+			simd::float_4 envelope = envelopeMode == 2 ? reduction : chunkware_simple::fastDB2lin(reduction);
+			if(envelopeMode == 0)
+				envelope /= 3.f;
+			outputs[ENVELOPE_OUT].setVoltageSimd(simd::clamp(envelope, -10.f, 10.f), g*4);
+			for(int i=0;i<4 && g*4 + i<channels;i++) {
+				// Downward reduction is positive and upward negative, the meter shows whichever voice is furthest out
+				if(std::abs(reduction[i]) > std::abs(gainReduction))
+					gainReduction = reduction[i];
+			}
+		}
+	} else {
+		compressorConfig.apply(compressor, compressorRms);
+		processLinked(linkedKey);
+		outputs[ENVELOPE_OUT].setChannels(1);
+		outputs[ENVELOPE_OUT].setVoltage(envelopeVoltage(gainReduction));
+		float gain = chunkware_simple::dB2lin(makeupGain - gainReduction);
+		for(int g=0;g<groups;g++) {
+			finalGainLin[g] = gain;
+		}
+	}
+
+	for(int g=0;g<groups;g++) {
+		simd::float_4 outputL = originalInputL[g];
+		simd::float_4 outputR = originalInputR[g];
+		if(!bypassed) {
+			simd::float_4 processedOutputL;
+			simd::float_4 processedOutputR;
+			if(!midSideMode) {
+				processedOutputL = inputL[g] * finalGainLin[g];
+				processedOutputR = inputR[g] * finalGainLin[g];
+			} else {
+				simd::float_4 processedMid = compressMid ? inputL[g] * finalGainLin[g] : inputL[g];
+				simd::float_4 processedSide = compressSide ? inputR[g] * finalGainLin[g] : inputR[g];
+				//Decode
+				processedOutputL = processedMid + processedSide;
+				processedOutputR = processedMid - processedSide;
+			}
+			outputL += (simd::clamp(processedOutputL, -10.f, 10.f) - outputL) * mix;
+			outputR += (simd::clamp(processedOutputR, -10.f, 10.f) - outputR) * mix;
+		}
+		outputs[OUTPUT_L].setVoltageSimd(outputL, g*4);
+		outputs[OUTPUT_R].setVoltageSimd(outputR, g*4);
+	}
+	outputs[OUTPUT_L].setChannels(channels);
+	outputs[OUTPUT_R].setChannels(channels);
+}
+
 struct ManicCompressionDisplay : TransparentWidget {
 	ManicCompression *module;
 	int frame = 0;
@@ -972,6 +1177,12 @@ struct ManicCompressionWidget : ModuleWidget {
 			//OptionsMenuItem::addToMenu(mi, menu);
 			menu->addChild(mi);
 		}
+		{
+			OptionsMenuItem* mi = new OptionsMenuItem("Polyphony");
+			mi->addItem(OptionMenuItem("Linked - One Detector", [module]() { return module->pendingPolyMode == POLY_LINKED; }, [module]() { module->pendingPolyMode = POLY_LINKED; }));
+			mi->addItem(OptionMenuItem("Per Voice", [module]() { return module->pendingPolyMode == POLY_PER_VOICE; }, [module]() { module->pendingPolyMode = POLY_PER_VOICE; }));
+			menu->addChild(mi);
+		}
 	}
 
 	void step() override {
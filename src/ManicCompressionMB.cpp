@@ -1,13 +1,20 @@
 #include "FrozenWasteland.hpp"
 #include "dsp-compressor/SimpleComp.h"
 #include "dsp-compressor/SimpleGain.h"
+#include "dsp-compressor/compressorBank.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
 #include "ui/menu.hpp"
-#include "filters/biquad.h"
+#include "filters/biquadBank.hpp"
 
 #define BANDS 5
 
+#define GAIN_COMPUTER_REFERENCE 0
+#define GAIN_COMPUTER_FAST 1
+
+#define POLY_LINKED 0
+#define POLY_PER_VOICE 1
+
 struct ManicCompressionMB : Module {
 	enum ParamIds {
         BAND_ACTIVE_PARAM,
@@ -114,6 +121,17 @@ struct ManicCompressionMB : Module {
 
 	chunkware_simple::SimpleComp compressor[BANDS];
 	chunkware_simple::SimpleCompRms compressorRms[BANDS];
+	chunkware_simple::SimpleCompConfig compressorConfig[BANDS];
+	// All bands' gain computers in float lanes, the SimpleComps above are kept as the reference to A/B against.
+	// One bank per voice in Per Voice mode, which always runs on these. Linked keys voice 0's bank, or the reference,
+	// off every voice together
+	chunkware_simple::CompressorBank<BANDS> gainComputer[PORT_MAX_CHANNELS];
+	int gainComputerMode = GAIN_COMPUTER_FAST;
+	// Set from the menu and patch loading, process() switches over at the top of its next call
+	std::atomic<int> pendingGainComputerMode {GAIN_COMPUTER_FAST};
+	int polyMode = POLY_LINKED;
+	std::atomic<int> pendingPolyMode {POLY_LINKED}; // as pendingGainComputerMode
+	int configVoices[BANDS] = {0}; // voice banks holding each band's current settings
 	float gainReduction[BANDS];
 	double threshold[BANDS], ratio[BANDS], knee[BANDS];
 
@@ -143,10 +161,12 @@ struct ManicCompressionMB : Module {
     int envelopeMode = 0;
 
 
-	Biquad* lpFilterBank[6]; // 3 filters 2 for stereo inputs, one for sidechain x 2 to increase slope
-	Biquad* hpFilterBank[6]; // 3 filters 2 for stereo inputs, one for sidechain x 2 to increase slope
-
-	Biquad* bandFilterBank[BANDS * 2][2][3]; // 2 filters per band for increased slope (and phase correction), first index lowpass, 2nd highpass, 2nd index is channel [0] = L [1] = R, [2] = SC
+	// 2 lowpasses then 2 highpasses per band for increased slope (and phase correction), each of the four its own bank.
+	// Section b*3 + c is band b of channel c, [0] = L [1] = R, [2] = SC, so bands and channels share the lanes.
+	// A set per voice, the others copying voice 0's coefficients
+	BiquadBank<BANDS * 3> bandLowpass[PORT_MAX_CHANNELS][2];
+	BiquadBank<BANDS * 3> bandHighpass[PORT_MAX_CHANNELS][2];
+	int splitVoices = 1; // voices whose crossover is in step with voice 0
 
     //percentages
 	float bandFcPercentage[BANDS] = {0};
@@ -169,6 +189,9 @@ struct ManicCompressionMB : Module {
         sampleRate = APP->engine->getSampleRate();
 
         for(int i=0;i<BANDS;i++) {
+            compressor[i].setSampleRate(sampleRate);
+            compressorRms[i].setSampleRate(sampleRate);
+
     		configParam(BAND_CUTOFF_PARAM + i, 0.f, 1.1f, 0.5f, "Band " + std::to_string(i+1) + " Frequency", " Hz", std::pow(2, 10.f), dsp::FREQ_C4 / std::pow(2, 5.f));
     		configParam(BAND_WIDTH_PARAM + i, 0.0f, 1.f, 0.0f, "Band " + std::to_string(i+1) + " Bandwidth"," %",0,100);
 
@@ -234,13 +257,15 @@ struct ManicCompressionMB : Module {
 
             double defaultCutoff = 0.25;
             for(int c = 0;c<3;c++) {
-                double defaultLPCutoff = i == BANDS-1 ? 0.5 : defaultCutoff;    
-                double defaultHPCutoff = i == 0 ? 1.0 / sampleRate : defaultCutoff;    
-
-                bandFilterBank[i * 2][0][c] = new Biquad(bq_type_lowpass, defaultLPCutoff , 0.707, 0);
-                bandFilterBank[i * 2 + 1][0][c] = new Biquad(bq_type_lowpass, defaultLPCutoff , 0.707, 0);
-                bandFilterBank[i * 2][1][c] = new Biquad(bq_type_highpass, defaultHPCutoff , 0.707, 0);
-                bandFilterBank[i * 2 + 1][1][c] = new Biquad(bq_type_highpass, defaultHPCutoff , 0.707, 0);
+                for(int f = 0;f<2;f++) {
+                    bandLowpass[0][f].setBiquad(i * 3 + c, bq_type_lowpass, defaultCutoff , 0.707, 0);
+                    bandHighpass[0][f].setBiquad(i * 3 + c, bq_type_highpass, defaultCutoff , 0.707, 0);
+                    // The top band has no lowpass and the bottom band no highpass
+                    if(i == BANDS-1) 
+                        bandLowpass[0][f].setBypass(i * 3 + c);
+                    if(i == 0) 
+                        bandHighpass[0][f].setBypass(i * 3 + c);
+                }
             }
 
         }
@@ -270,23 +295,21 @@ struct ManicCompressionMB : Module {
 
 
 
-		double lpCutoff = 4000/sampleRate;
-		double hpCutoff = 240/sampleRate;
-
-		for(int f=0;f<6;f++) {
-			lpFilterBank[f] = new Biquad(bq_type_lowpass, lpCutoff , 0.707, 0);
-			hpFilterBank[f] = new Biquad(bq_type_highpass, hpCutoff , 0.707, 0);
-		}
-
         for(int b=0;b<BANDS;b++) {
             compressor[b].initRuntime();
             compressorRms[b].initRuntime();
         }
+        for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+            gainComputer[c].setSampleRate(sampleRate);
+            gainComputer[c].initRuntime();
+        }
 
 	}
 	void process(const ProcessArgs &args) override;
     void dataFromJson(json_t *) override;
 	void onSampleRateChange() override;
+    void setGainComputerMode(int mode);
+    void setPolyMode(int mode);
     double lerp(double v0, double v1, double t);
     double sgn(double val);
     json_t *dataToJson() override;
@@ -297,6 +320,35 @@ struct ManicCompressionMB : Module {
 	// - onReset, onRandomize, onCreate, onDelete: implements special behavior when user clicks these from the context menu
 };
 
+void ManicCompressionMB::setGainComputerMode(int mode) {
+    if(mode == gainComputerMode)
+        return;
+    gainComputerMode = mode;
+    // Whichever path takes over starts from rest with the current settings
+    for(int b=0;b<BANDS;b++) {
+        compressorConfig[b].invalidate();
+        compressor[b].initRuntime();
+        compressorRms[b].initRuntime();
+    }
+    for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+        gainComputer[c].initRuntime();
+    }
+}
+
+void ManicCompressionMB::setPolyMode(int mode) {
+    if(mode == polyMode)
+        return;
+    polyMode = mode;
+    for(int b=0;b<BANDS;b++) {
+        compressorConfig[b].invalidate();
+        compressor[b].initRuntime();
+        compressorRms[b].initRuntime();
+    }
+    for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+        gainComputer[c].initRuntime();
+    }
+}
+
 double ManicCompressionMB::lerp(double v0, double v1, double t) {
 		return (1 - t) * v0 + t * v1;
 }
@@ -314,6 +366,8 @@ json_t *ManicCompressionMB::dataToJson() {
 	json_object_set_new(rootJ, "compressSide", json_boolean(compressSide));
 	json_object_set_new(rootJ, "gateMode", json_boolean(gateMode));
     json_object_set_new(rootJ, "envelopeMode", json_integer(envelopeMode));
+    json_object_set_new(rootJ, "gainComputerMode", json_integer(pendingGainComputerMode));
+    json_object_set_new(rootJ, "polyMode", json_integer(pendingPolyMode));
 
     for(int i=0;i<BANDS;i++) {
         std::string buf = "bandEnabled-" + std::to_string(i) ;
@@ -356,6 +410,14 @@ void ManicCompressionMB::dataFromJson(json_t *rootJ) {
 	if (emJ)
 		envelopeMode = json_integer_value(emJ);
 
+    // Patches saved before there was a choice ran on the reference gain computer, so they keep it
+    json_t *gcmJ = json_object_get(rootJ, "gainComputerMode");
+	pendingGainComputerMode = gcmJ && json_integer_value(gcmJ) != GAIN_COMPUTER_REFERENCE ? GAIN_COMPUTER_FAST : GAIN_COMPUTER_REFERENCE;
+
+    json_t *pmJ = json_object_get(rootJ, "polyMode");
+	if (pmJ)
+		pendingPolyMode = json_integer_value(pmJ) == POLY_PER_VOICE ? POLY_PER_VOICE : POLY_LINKED;
+
     for(int i=0;i<BANDS;i++) {
         std::string buf = "bandEnabled-" + std::to_string(i) ;
         json_t *beJ = json_object_get(rootJ, buf.c_str());
@@ -381,31 +443,22 @@ void ManicCompressionMB::dataFromJson(json_t *rootJ) {
 
 void ManicCompressionMB::onSampleRateChange() {
 	sampleRate = APP->engine->getSampleRate();
-	double lpCutoff = 4000/sampleRate;
-	double hpCutoff = 240/sampleRate;
-
-	for(int f=0;f<6;f++) {
-		lpFilterBank[f]->setFc(lpCutoff);
-		hpFilterBank[f]->setFc(hpCutoff);
-	}
-
-    for(int c = 0;c<3;c++) {
-        double defaultLPCutoff = 0.5;    
-        double defaultHPCutoff = 1.0 / sampleRate;    
-
-        bandFilterBank[(BANDS-1) * 2][0][c]->setFc(defaultLPCutoff);
-        bandFilterBank[(BANDS-1) * 2 + 1][0][c]->setFc(defaultLPCutoff);
-        bandFilterBank[0][1][c]->setFc(defaultHPCutoff);
-        bandFilterBank[1][1][c]->setFc(defaultHPCutoff);
-    }
 
     for(int b=0;b<BANDS;b++) { //Force bands to recalc
         lastCutoff[b] = -1;
+        compressor[b].setSampleRate(sampleRate);
+        compressorRms[b].setSampleRate(sampleRate);
+    }
+    for(int c=0;c<PORT_MAX_CHANNELS;c++) {
+        gainComputer[c].setSampleRate(sampleRate);
     }
 }
 
 void ManicCompressionMB::process(const ProcessArgs &args) {
 
+	setGainComputerMode(pendingGainComputerMode);
+	setPolyMode(pendingPolyMode);
+
 	float bypassInput = inputs[BYPASS_INPUT].getVoltage();
 	if(gateMode) {
 		if(bypassed != (bypassInput !=0) && gateFlippedBypassed ) {
@@ -427,10 +480,6 @@ void ManicCompressionMB::process(const ProcessArgs &args) {
 	lights[BYPASS_LIGHT].value = bypassed ? 1.0 : 0.0;
 
     for(int b=0;b<BANDS;b++) {
-        compressor[b].setSampleRate(sampleRate);
-        compressorRms[b].setSampleRate(sampleRate);
-
-
         double freqParam = clamp(params[BAND_CUTOFF_PARAM + b].getValue() + (inputs[BAND_CUTOFF_INPUT + b].getVoltage() * 0.1 * params[BAND_CUTOFF_CV_ATTENUVERTER_PARAM + b].getValue()),0.0f,1.1f);
         bandFcPercentage[b] = freqParam / 1.1;
 		freqParam = freqParam * 10.f - 5.f;
@@ -441,22 +490,24 @@ void ManicCompressionMB::process(const ProcessArgs &args) {
         if(freqParam != lastCutoff[b] || bandwidthParam != lastBandWidth[b] ) {
             double cutoff = dsp::FREQ_C4 * pow(2.f, freqParam);
 
-            double lpCutoff = clamp(cutoff + (cutoff / 1.0 * bandwidthParam),1.0f,20000.0f);
-            double hpCutoff = clamp(cutoff - (cutoff / 1.0 * bandwidthParam),1.0f,20000.0f);
+            // Floor at the lowest band frequency, the single precision filters lose their shape much below it
+            double lpCutoff = clamp(cutoff + (cutoff / 1.0 * bandwidthParam),8.0f,20000.0f);
+            double hpCutoff = clamp(cutoff - (cutoff / 1.0 * bandwidthParam),8.0f,20000.0f);
 
             for(int c=0;c<3;c++) {
-                if(b < BANDS-1) {
-                    bandFilterBank[b*2][0][c]->setFc(lpCutoff / sampleRate);
-                    bandFilterBank[b*2 + 1][0][c]->setFc(lpCutoff / sampleRate);
-                }
-                if(b > 0) {
-                    bandFilterBank[b*2][1][c]->setFc(hpCutoff / sampleRate);
-                    bandFilterBank[b*2 + 1][1][c]->setFc(hpCutoff / sampleRate);
+                for(int f = 0;f<2;f++) {
+                    if(b < BANDS-1) {
+                        bandLowpass[0][f].setFc(b*3 + c, lpCutoff / sampleRate);
+                    }
+                    if(b > 0) {
+                        bandHighpass[0][f].setFc(b*3 + c, hpCutoff / sampleRate);
+                    }
                 }
             }
             // fprintf(stderr, "Recalculating Band:%i lFc:%f  fc:%f   lbw:%f   bw:%f  \n",b,freqParam,lastCutoff[b],bandwidthParam,lastBandWidth[b] );
             lastCutoff[b] = freqParam;
             lastBandWidth[b] = bandwidthParam;
+            splitVoices = 1;
 
         }
 
@@ -597,49 +648,29 @@ void ManicCompressionMB::process(const ProcessArgs &args) {
 
 	double mix = clamp(params[MIX_PARAM].getValue() + (inputs[MIX_CV_INPUT].getVoltage() * 0.1 * params[MIX_CV_ATTENUVERTER_PARAM].getValue()),0.0f,1.0f);
 
-
-	double inputL = inputs[SOURCE_L_INPUT].getVoltage();
-	double inputR = inputL;
-	if(inputs[SOURCE_R_INPUT].isConnected()) {
-		inputR = inputs[SOURCE_R_INPUT].getVoltage();
-	}
-	double originalInputL = inputL;
-	double originalInputR = inputR;
-
-	//In Mid-Side Mode, L=mid, R=side
-	if(midSideMode) {
-		//Encode
-		double mid = inputL + inputR;
-		double side = inputL - inputR;
-		inputL = mid;
-		inputR = side;
-	}
-
-	double processedL = inputL;
-	double processedR = inputR;
-
-    double sidechain = 0;
-    bool usingSidechain = false;
-    if(inputs[SIDECHAIN_INPUT].isConnected()) {
-        sidechain = inputs[SIDECHAIN_INPUT].getVoltage();
-        usingSidechain = true;
+    // A polyphonic source runs every voice through its own crossover. Per Voice gives each voice its own gain computers,
+    // Linked keys one set off all voices together, the loudest in peak mode and the power sum in RMS mode. Sidechain,
+    // band and envelope inputs pair up with the voices, or are shared by all of them when mono
+    int channels = std::max(inputs[SOURCE_L_INPUT].getChannels(), 1);
+    bool perVoice = polyMode == POLY_PER_VOICE;
+    int voices = perVoice ? channels : 1; // gain computers in use
+    bool fastGainComputer = perVoice || gainComputerMode == GAIN_COMPUTER_FAST;
+
+    for(int c=splitVoices;c<channels;c++) {
+        for(int f=0;f<2;f++) {
+            bandLowpass[c][f].copyCoefficients(bandLowpass[0][f]);
+            bandHighpass[c][f].copyCoefficients(bandHighpass[0][f]);
+        }
     }
+    splitVoices = std::max(splitVoices, channels);
 
-    double bandTotalL = 0;
-    double bandTotalR = 0; 
+    double bandInputGain[BANDS];
+    double makeupGain[BANDS];
     for(int b=0;b<BANDS;b++) {        
+        for(int c=0;c<voices;c++) {
+            gainComputer[c].setActive(b, bandEnabled[b]);
+        }
         if(bandEnabled[b]) {
-            double processedBandL = inputs[BAND_INPUT_L+b].isConnected() ?
-                inputs[BAND_INPUT_L+b].getVoltage() :
-                bandFilterBank[b*2][1][0]->process(bandFilterBank[b*2+1][1][0]->process(bandFilterBank[b*2][0][0]->process(bandFilterBank[b*2+1][0][0]->process(processedL))));
-
-            double processedBandR = inputs[BAND_INPUT_R+b].isConnected() ?
-                inputs[BAND_INPUT_R+b].getVoltage() :
-                bandFilterBank[b*2][1][1]->process(bandFilterBank[b*2+1][1][1]->process(bandFilterBank[b*2][0][1]->process(bandFilterBank[b*2+1][0][1]->process(processedR))));
-            double sidechainBand = 0;
-            if(usingSidechain) {
-                sidechainBand = bandFilterBank[b*2][1][2]->process(bandFilterBank[b*2+1][1][2]->process(bandFilterBank[b*2][0][2]->process(bandFilterBank[b*2+1][0][2]->process(sidechain))));
-            }
             bandFilterBypassed[b] = inputs[BAND_INPUT_L+b].isConnected() || inputs[BAND_INPUT_R+b].isConnected();
 
             float paramRatio = clamp(params[RATIO_PARAM + b].getValue() + (inputs[RATIO_CV_INPUT + b].getVoltage() * 0.1 * params[RATIO_CV_ATTENUVERTER_PARAM + b].getValue()),-0.2f,1.0f);
@@ -670,143 +701,303 @@ void ManicCompressionMB::process(const ProcessArgs &args) {
             double inputGain = clamp(params[IN_GAIN_PARAM + b].getValue() + (inputs[IN_GAIN_INPUT + b].getVoltage() * 3.0 * params[IN_GAIN_CV_ATTENUVERTER_PARAM + b].getValue()), 0.0f,30.0f);
         	inGainPercentage[b] = inputGain / 30.0;
             inputGain = chunkware_simple::dB2lin(inputGain);
-            double makeupGain = clamp(params[MAKEUP_GAIN_PARAM + b].getValue() + (inputs[MAKEUP_GAIN_INPUT + b].getVoltage() * 3.0 * params[MAKEUP_GAIN_CV_ATTENUVERTER_PARAM + b].getValue()), 0.0f,30.0f);
-            makeupGainPercentage[b] = makeupGain / 30.0;
+            makeupGain[b] = clamp(params[MAKEUP_GAIN_PARAM + b].getValue() + (inputs[MAKEUP_GAIN_INPUT + b].getVoltage() * 3.0 * params[MAKEUP_GAIN_CV_ATTENUVERTER_PARAM + b].getValue()), 0.0f,30.0f);
+            makeupGainPercentage[b] = makeupGain[b] / 30.0;
+            bandInputGain[b] = inputGain;
+
+            compressorConfig[b].setRatio(ratio[b]);
+            compressorConfig[b].setThresh(50.0+threshold[b]);
+            compressorConfig[b].setKnee(knee[b]);
+            compressorConfig[b].setAttack(attack);
+            compressorConfig[b].setRelease(release);
+            compressorConfig[b].setAttackCurve(attackCurve);
+            compressorConfig[b].setReleaseCurve(releaseCurve);
+            compressorConfig[b].setWindow(rmsWindow);
+
+            if(fastGainComputer) {
+                // Worked out on voice 0's bank, the other voices copy it
+                if(compressorConfig[b].isDirty())
+                    configVoices[b] = 1;
+                compressorConfig[b].apply(gainComputer[0], b);
+                for(int c=configVoices[b];c<voices;c++) {
+                    gainComputer[c].copyLane(gainComputer[0], b);
+                }
+                configVoices[b] = std::max(configVoices[b], voices);
+                for(int c=0;c<voices;c++) {
+                    gainComputer[c].setRms(b, rmsMode[b]);
+                    gainComputer[c].setUpward(b, compressDirection[b]);
+                }
+            } else {
+                compressorConfig[b].apply(compressor[b], compressorRms[b]);
+            }
+        } else {
+            ratioPercentage[b] = 0;
+            thresholdPercentage[b] = 0;
+            attackPercentage[b] = 0;
+            attackCurvePercentage[b] = 0;
+            releaseCurvePercentage[b] = 0;
+            releasePercentage[b] = 0;
+            rmsWindowPercentage[b] = 0;
+            inGainPercentage[b] = 0;
+            makeupGainPercentage[b] = 0;
+        }
+    }
+
+    bool usingSidechain = inputs[SIDECHAIN_INPUT].isConnected();
+
+    double originalInputL[PORT_MAX_CHANNELS];
+    double originalInputR[PORT_MAX_CHANNELS];
+    double processedBandL[PORT_MAX_CHANNELS][BANDS];
+    double processedBandR[PORT_MAX_CHANNELS][BANDS];
+    float detectorKey[PORT_MAX_CHANNELS][chunkware_simple::CompressorBank<BANDS>::LANES] = {};
+    double linkedKey[BANDS] = {0};
+    for(int c=0;c<channels;c++) {
+        double inputL = inputs[SOURCE_L_INPUT].getVoltage(c);
+        double inputR = inputL;
+        if(inputs[SOURCE_R_INPUT].isConnected()) {
+            inputR = inputs[SOURCE_R_INPUT].getPolyVoltage(c);
+        }
+        originalInputL[c] = inputL;
+        originalInputR[c] = inputR;
+
+        //In Mid-Side Mode, L=mid, R=side
+        if(midSideMode) {
+            //Encode
+            double mid = inputL + inputR;
+            double side = inputL - inputR;
+            inputL = mid;
+            inputR = side;
+        }
+
+        double sidechain = 0;
+        if(usingSidechain) {
+            sidechain = inputs[SIDECHAIN_INPUT].getPolyVoltage(c);
+        }
+
+        // Split every channel into every band at once, four band/channel pairs per float_4
+        float bandSplit[BiquadBank<BANDS * 3>::GROUPS * 4] = {0};
+        for(int b=0;b<BANDS;b++) {
+            bandSplit[b*3] = inputL;
+            bandSplit[b*3 + 1] = inputR;
+            bandSplit[b*3 + 2] = sidechain;
+        }
+        for(int g=0;g<BiquadBank<BANDS * 3>::GROUPS;g++) {
+            simd::float_4 split = simd::float_4::load(bandSplit + g*4);
+            split = bandLowpass[c][1].process(g, split);
+            split = bandLowpass[c][0].process(g, split);
+            split = bandHighpass[c][1].process(g, split);
+            split = bandHighpass[c][0].process(g, split);
+            split.store(bandSplit + g*4);
+        }
+
+        for(int b=0;b<BANDS;b++) {
+            if(!bandEnabled[b])
+                continue;
+
+            processedBandL[c][b] = inputs[BAND_INPUT_L+b].isConnected() ?
+                inputs[BAND_INPUT_L+b].getPolyVoltage(c) :
+                bandSplit[b*3];
+
+            processedBandR[c][b] = inputs[BAND_INPUT_R+b].isConnected() ?
+                inputs[BAND_INPUT_R+b].getPolyVoltage(c) :
+                bandSplit[b*3 + 1];
+            double sidechainBand = 0;
+            if(usingSidechain) {
+                sidechainBand = bandSplit[b*3 + 2];
+            }
 
             double detectorInput;
-            double calculatedGainReduction = 0;
             if(rmsMode[b]) {
-                compressorRms[b].setRatio(ratio[b]);
-                compressorRms[b].setThresh(50.0+threshold[b]);
-                compressorRms[b].setKnee(knee[b]);
-                compressorRms[b].setAttack(attack);
-                compressorRms[b].setRelease(release);
-                compressorRms[b].setAttackCurve(attackCurve);
-                compressorRms[b].setReleaseCurve(releaseCurve);
-                compressorRms[b].setWindow(rmsWindow);
-
                 if(usingSidechain) {
                     detectorInput = sidechainBand * sidechainBand;
                 } else {
-                    double inSq1 = processedBandL * processedBandL;	// square input
-                    double inSq2 = processedBandR * processedBandR;
+                    double inSq1 = processedBandL[c][b] * processedBandL[c][b];	// square input
+                    double inSq2 = processedBandR[c][b] * processedBandR[c][b];
                     double sum = inSq1 + inSq2;			// power summing
-                    detectorInput = sum * inputGain;
+                    detectorInput = sum * bandInputGain[b];
                 }
-                outputs[DETECTOR_OUTPUT + b].setVoltage(detectorInput);
-                if(!compressDirection[b])
-                    compressorRms[b].process(inputs[BAND_SIDECHAIN_INPUT + b].isConnected() ? inputs[BAND_SIDECHAIN_INPUT + b].getVoltage() : detectorInput);
-                else
-                    compressorRms[b].processUpward(inputs[BAND_SIDECHAIN_INPUT + b].isConnected() ? inputs[BAND_SIDECHAIN_INPUT + b].getVoltage() : detectorInput);
-                calculatedGainReduction = compressorRms[b].getGainReduction();
             } else {
-                compressor[b].setRatio(ratio[b]);
-                compressor[b].setThresh(50.0+threshold[b]);
-                compressor[b].setKnee(knee[b]);
-                compressor[b].setAttack(attack);
-                compressor[b].setRelease(release);
-                compressor[b].setAttackCurve(attackCurve);
-                compressor[b].setReleaseCurve(releaseCurve);
-                
                 if(usingSidechain) {
                     detectorInput = sidechainBand;
                 } else {
-                    double rect1 = fabs( processedBandL );	// rectify input
-                    double rect2 = fabs( processedBandR );
+                    double rect1 = fabs( processedBandL[c][b] );	// rectify input
+                    double rect2 = fabs( processedBandR[c][b] );
                     double link = std::max( rect1, rect2 );	// link channels with greater of 2
-                    detectorInput =  link * inputGain;
+                    detectorInput =  link * bandInputGain[b];
+                }
+            }
+            outputs[DETECTOR_OUTPUT + b].setVoltage(detectorInput, c);
+            double key = inputs[BAND_SIDECHAIN_INPUT + b].isConnected() ? inputs[BAND_SIDECHAIN_INPUT + b].getPolyVoltage(c) : detectorInput;
+
+            if(perVoice) {
+                detectorKey[c][b] = key;
+            } else if(c == 0) {
+                linkedKey[b] = key;
+            } else if(rmsMode[b]) {
+                linkedKey[b] += key;
+            } else {
+                linkedKey[b] = std::max(std::abs(linkedKey[b]), std::abs(key));
+            }
+        }
+    }
+
+    double calculatedGainReduction[PORT_MAX_CHANNELS][BANDS] = {};
+    if(perVoice) {
+        for(int c=0;c<channels;c++) {
+            for(int g=0;g<chunkware_simple::CompressorBank<BANDS>::GROUPS;g++) {
+                simd::float_4 reduction = gainComputer[c].process(g, simd::float_4::load(detectorKey[c] + g*4));
+                for(int i=0;i<4 && g*4 + i<BANDS;i++) {
+                    calculatedGainReduction[c][g*4 + i] = reduction[i];
                 }
-                outputs[DETECTOR_OUTPUT + b].setVoltage(detectorInput);
+            }
+        }
+    } else if(fastGainComputer) {
+        float bandKey[chunkware_simple::CompressorBank<BANDS>::LANES] = {0};
+        for(int b=0;b<BANDS;b++) {
+            bandKey[b] = linkedKey[b];
+        }
+        for(int g=0;g<chunkware_simple::CompressorBank<BANDS>::GROUPS;g++) {
+            simd::float_4 reduction = gainComputer[0].process(g, simd::float_4::load(bandKey + g*4));
+            for(int i=0;i<4 && g*4 + i<BANDS;i++) {
+                calculatedGainReduction[0][g*4 + i] = reduction[i];
+            }
+        }
+    } else {
+        for(int b=0;b<BANDS;b++) {
+            if(!bandEnabled[b])
+                continue;
+            if(rmsMode[b]) {
                 if(!compressDirection[b])
-                    compressor[b].process(inputs[BAND_SIDECHAIN_INPUT + b].isConnected() ? inputs[BAND_SIDECHAIN_INPUT + b].getVoltage() : detectorInput);
+                    compressorRms[b].process(linkedKey[b]);
                 else
-                    compressor[b].processUpward(inputs[BAND_SIDECHAIN_INPUT + b].isConnected() ? inputs[BAND_SIDECHAIN_INPUT + b].getVoltage() : detectorInput);
-                calculatedGainReduction = compressor[b].getGainReduction();
-            }		
-            switch(envelopeMode) {
-                case 0 : // original gain reduced linear
-                    outputs[ENVELOPE_OUT+b].setVoltage(clamp(chunkware_simple::dB2lin(calculatedGainReduction) / 3.0f,-10.0f,10.0f));
-                    break;
-                case 1 : // linear
-                    outputs[ENVELOPE_OUT+b].setVoltage(clamp(chunkware_simple::dB2lin(calculatedGainReduction),-10.0f,10.0f));
-                    break;
-                case 2 : // exponential
-                    outputs[ENVELOPE_OUT+b].setVoltage(clamp(calculatedGainReduction,-10.0f,10.0f));
-                    break;
+                    compressorRms[b].processUpward(linkedKey[b]);
+                calculatedGainReduction[0][b] = compressorRms[b].getGainReduction();
+            } else {
+                if(!compressDirection[b])
+                    compressor[b].process(linkedKey[b]);
+                else
+                    compressor[b].processUpward(linkedKey[b]);
+                calculatedGainReduction[0][b] = compressor[b].getGainReduction();
+            }
+        }
+    }
+
+    float finalGaindB[PORT_MAX_CHANNELS][chunkware_simple::CompressorBank<BANDS>::LANES] = {};
+    for(int b=0;b<BANDS;b++) {
+        outputs[ENVELOPE_OUT+b].setChannels(voices);
+        if(!bandEnabled[b])
+            continue;
+
+        if(compressDirection[b])
+            makeupGain[b] = -makeupGain[b];
+        for(int c=0;c<channels;c++) {
+            double voiceGainReduction = calculatedGainReduction[perVoice ? c : 0][b];
+            if(c < voices) {
+                switch(envelopeMode) {
+                    case 0 : // original gain reduced linear
+                        outputs[ENVELOPE_OUT+b].setVoltage(clamp(chunkware_simple::dB2lin(voiceGainReduction) / 3.0f,-10.0f,10.0f), c);
+                        break;
+                    case 1 : // linear
+                        outputs[ENVELOPE_OUT+b].setVoltage(clamp(chunkware_simple::dB2lin(voiceGainReduction),-10.0f,10.0f), c);
+                        break;
+                    case 2 : // exponential
+                        outputs[ENVELOPE_OUT+b].setVoltage(clamp(voiceGainReduction,-10.0f,10.0f), c);
+                        break;
+                }
             }
 
-            if(!inputs[ENVELOPE_INPUT+b].isConnected()) {
-                gainReduction[b] = calculatedGainReduction;
-            } else {
+            float appliedGainReduction = voiceGainReduction;
+            if(inputs[ENVELOPE_INPUT+b].isConnected()) {
                 switch(envelopeMode) {
                     case 0 : // original gain reduced linear
-                        gainReduction[b] = clamp(chunkware_simple::lin2dB(inputs[ENVELOPE_INPUT+b].getVoltage() * 3.0),-10.0f,10.0f);
+                        appliedGainReduction = clamp(chunkware_simple::lin2dB(inputs[ENVELOPE_INPUT+b].getPolyVoltage(c) * 3.0),-10.0f,10.0f);
                         break;
                     case 1 : // linear
-                        gainReduction[b] = clamp(chunkware_simple::lin2dB(inputs[ENVELOPE_INPUT+b].getVoltage()),-10.0f,10.0f);
+                        appliedGainReduction = clamp(chunkware_simple::lin2dB(inputs[ENVELOPE_INPUT+b].getPolyVoltage(c)),-10.0f,10.0f);
                         break;
                     case 2 : // exponential
-                        gainReduction[b] = clamp(inputs[ENVELOPE_INPUT+b].getVoltage(),-10.0f,10.0f);
+                        appliedGainReduction = clamp(inputs[ENVELOPE_INPUT+b].getPolyVoltage(c),-10.0f,10.0f);
                         break;
                 }                
             }
-            if(compressDirection[b])
-                makeupGain = -makeupGain;
-            double finalGainLin = chunkware_simple::dB2lin(makeupGain-gainReduction[b]);
+            // Downward reduction is positive and upward negative, the meter shows whichever voice is furthest out
+            if(c == 0 || std::abs(appliedGainReduction) > std::abs(gainReduction[b]))
+                gainReduction[b] = appliedGainReduction;
+            finalGaindB[c][b] = makeupGain[b]-appliedGainReduction;
+        }
+    }
+
+    double finalGainLin[PORT_MAX_CHANNELS][chunkware_simple::CompressorBank<BANDS>::LANES];
+    for(int c=0;c<channels;c++) {
+        if(fastGainComputer) {
+            for(int g=0;g<chunkware_simple::CompressorBank<BANDS>::GROUPS;g++) {
+                simd::float_4 gain = chunkware_simple::fastDB2lin(simd::float_4::load(finalGaindB[c] + g*4));
+                for(int i=0;i<4;i++) {
+                    finalGainLin[c][g*4 + i] = gain[i];
+                }
+            }
+        } else {
+            for(int b=0;b<BANDS;b++) {
+                finalGainLin[c][b] = chunkware_simple::dB2lin(finalGaindB[c][b]);
+            }
+        }
+    }
+
+    for(int c=0;c<channels;c++) {
+        double bandTotalL = 0;
+        double bandTotalR = 0; 
+        for(int b=0;b<BANDS;b++) {
+            if(!bandEnabled[b])
+                continue;
 
             double bandOutputL, bandOutputR;
             if(!midSideMode) {
-                bandOutputL = processedBandL * finalGainLin; 
-                bandOutputR = processedBandR * finalGainLin;
+                bandOutputL = processedBandL[c][b] * finalGainLin[c][b]; 
+                bandOutputR = processedBandR[c][b] * finalGainLin[c][b];
             } else {
-                bandOutputL =  compressMid ? processedBandL * finalGainLin : processedBandL;
-                bandOutputR =  compressSide ? processedBandR * finalGainLin : processedBandR;			
+                bandOutputL =  compressMid ? processedBandL[c][b] * finalGainLin[c][b] : processedBandL[c][b];
+                bandOutputR =  compressSide ? processedBandR[c][b] * finalGainLin[c][b] : processedBandR[c][b];			
             }
-            outputs[BAND_OUTPUT_L + b].setVoltage(clamp(bandOutputL,-10.0f,10.0f)); 
-            outputs[BAND_OUTPUT_R + b].setVoltage(clamp(bandOutputR,-10.0f,10.0f)); 
+            outputs[BAND_OUTPUT_L + b].setVoltage(clamp(bandOutputL,-10.0f,10.0f), c); 
+            outputs[BAND_OUTPUT_R + b].setVoltage(clamp(bandOutputR,-10.0f,10.0f), c); 
             bandTotalL += bandOutputL; 
             bandTotalR += bandOutputR;
-
-        } else {
-            ratioPercentage[b] = 0;
-            thresholdPercentage[b] = 0;
-            attackPercentage[b] = 0;
-            attackCurvePercentage[b] = 0;
-            releaseCurvePercentage[b] = 0;
-            releasePercentage[b] = 0;
-            rmsWindowPercentage[b] = 0;
-            inGainPercentage[b] = 0;
-            makeupGainPercentage[b] = 0;
         }
-    }
-
-	double outputL;
-	double outputR;
 
-	if(!bypassed) {
-		
-		double processedOutputL;
-		double processedOutputR;
-		if(!midSideMode) {
-			processedOutputL = bandTotalL; 
-			processedOutputR = bandTotalR;
-		} else {
-			//Decode
-			processedOutputL = bandTotalL + bandTotalR;
-			processedOutputR = bandTotalL - bandTotalR;			
-		}
+        double outputL;
+        double outputR;
 
-		outputL = lerp(originalInputL,clamp(processedOutputL,-10.0f,10.0f),mix);
-		outputR = lerp(originalInputR,clamp(processedOutputR,-10.0f,10.0f),mix);
-	} else {
-		outputL = originalInputL;
-		outputR = originalInputR;
-	}
+        if(!bypassed) {
+            
+            double processedOutputL;
+            double processedOutputR;
+            if(!midSideMode) {
+                processedOutputL = bandTotalL; 
+                processedOutputR = bandTotalR;
+            } else {
+                //Decode
+                processedOutputL = bandTotalL + bandTotalR;
+                processedOutputR = bandTotalL - bandTotalR;			
+            }
 
+            outputL = lerp(originalInputL[c],clamp(processedOutputL,-10.0f,10.0f),mix);
+            outputR = lerp(originalInputR[c],clamp(processedOutputR,-10.0f,10.0f),mix);
+        } else {
+            outputL = originalInputL[c];
+            outputR = originalInputR[c];
+        }
 
+        outputs[OUTPUT_L].setVoltage(outputL, c);
+        outputs[OUTPUT_R].setVoltage(outputR, c);
+    }
 
-	outputs[OUTPUT_L].setVoltage(outputL);
-	outputs[OUTPUT_R].setVoltage(outputR);
+    outputs[OUTPUT_L].setChannels(channels);
+    outputs[OUTPUT_R].setChannels(channels);
+    for(int b=0;b<BANDS;b++) {
+        outputs[BAND_OUTPUT_L + b].setChannels(channels);
+        outputs[BAND_OUTPUT_R + b].setChannels(channels);
+        outputs[DETECTOR_OUTPUT + b].setChannels(channels);
+    }
 }
 
 
@@ -872,8 +1063,8 @@ struct MCDisplayFiltersResponse : FramebufferWidget {
         float maxY = 0;
         for(float x=0.0f; x<224.0f; x+=1.0f) {
             double frequency = std::pow(10.0f, x/95.685 + 2.0f) / module->sampleRate;
-            double responseLP = module->bandFilterBank[b*2][0][0]->frequencyResponse(frequency); 
-            double responseHP = module->bandFilterBank[b*2][1][0]->frequencyResponse(frequency); 
+            double responseLP = module->bandLowpass[0][0].frequencyResponse(b*3, frequency); 
+            double responseHP = module->bandHighpass[0][0].frequencyResponse(b*3, frequency); 
             // fprintf(stderr, "Point x:%i l:%i freq:%f response:%f  level response: %f  \n",x,l,frequency[0],response[0],levelResponse[0]);
                 double responseDB = std::log10(std::max(responseLP * responseLP * responseHP * responseHP, 1.0e-4)) * 20;
                 float responseYCoord = clamp(0.0f - (float) responseDB * 1.25, 0.0f, 100.0f);
@@ -1307,6 +1498,20 @@ struct ManicCompressionMBWidget : ModuleWidget {
 			//OptionsMenuItem::addToMenu(mi, menu);
 			menu->addChild(mi);
 		}		
+
+        {
+			OptionsMenuItem* mi = new OptionsMenuItem("Gain Computer");
+			mi->addItem(OptionMenuItem("Reference (Double Precision)", [module]() { return module->pendingGainComputerMode == GAIN_COMPUTER_REFERENCE; }, [module]() { module->pendingGainComputerMode = GAIN_COMPUTER_REFERENCE; }));
+			mi->addItem(OptionMenuItem("Fast (SIMD)", [module]() { return module->pendingGainComputerMode == GAIN_COMPUTER_FAST; }, [module]() { module->pendingGainComputerMode = GAIN_COMPUTER_FAST; }));
+			menu->addChild(mi);
+		}
+
+        {
+			OptionsMenuItem* mi = new OptionsMenuItem("Polyphony");
+			mi->addItem(OptionMenuItem("Linked - One Detector", [module]() { return module->pendingPolyMode == POLY_LINKED; }, [module]() { module->pendingPolyMode = POLY_LINKED; }));
+			mi->addItem(OptionMenuItem("Per Voice", [module]() { return module->pendingPolyMode == POLY_PER_VOICE; }, [module]() { module->pendingPolyMode = POLY_PER_VOICE; }));
+			menu->addChild(mi);
+		}
 	}
 
     void step() override {
@@ -1,11 +1,160 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
-#include "filters/biquad.h"
+#include "ui/menu.hpp"
+#include "filters/biquadBank.hpp"
 
 using namespace std;
 
 #define BANDS 16
+#define FILTER_BANK_MODE 0 // analysis modes 1-3 are the STFT with 32, 64 or 128 bands
+#define MAX_FFT_SIZE 4096
+#define MAX_FFT_BANDS 128
+#define FFT_OVERLAP 4
+#define FFT_LOW_FREQ 100.0f
+#define FFT_HIGH_FREQ 8000.0f
+
+// Overlap-add STFT vocoder. Each hop the modulator's level is measured over log spaced groups of bins
+// and the carrier's bins are scaled by the gains the module works out from them, so the cost per hop
+// is two forward FFTs and one inverse however many bands there are.
+struct MBSSpectralVocoder {
+	dsp::RealFFT *ffts[4]; // 512, 1024, 2048 and 4096 point
+	dsp::RealFFT *fft = nullptr;
+	int blockSize = 0;
+	int hopSize = 0;
+	int bands = 0;
+	int writePos = 0;
+	int outPos = 0;
+	int hopCounter = 0;
+
+	alignas(16) float modulatorIn[MAX_FFT_SIZE] = {};
+	alignas(16) float carrierIn[MAX_FFT_SIZE] = {};
+	alignas(16) float outAccumulator[MAX_FFT_SIZE] = {};
+	alignas(16) float window[MAX_FFT_SIZE];
+	alignas(16) float frame[MAX_FFT_SIZE];
+	alignas(16) float modulatorSpectrum[MAX_FFT_SIZE];
+	alignas(16) float carrierSpectrum[MAX_FFT_SIZE];
+	int binBand[MAX_FFT_SIZE / 2]; // -1 for bins outside the vocoder's range
+
+	float bandLevel[MAX_FFT_BANDS] = {}; // modulator amplitude in each band over the last block
+	float bandGain[MAX_FFT_BANDS] = {}; // set by the caller between analyse() and synthesize()
+
+	MBSSpectralVocoder() {
+		for(int i=0; i<4; i++) {
+			ffts[i] = new dsp::RealFFT(512 << i);
+		}
+	}
+
+	~MBSSpectralVocoder() {
+		for(int i=0; i<4; i++) {
+			delete ffts[i];
+		}
+	}
+
+	void configure(int newBlockSize, int newBands, float sampleRate) {
+		blockSize = newBlockSize;
+		hopSize = blockSize / FFT_OVERLAP;
+		bands = newBands;
+		for(int i=0; i<4; i++) {
+			if((512 << i) == blockSize) {
+				fft = ffts[i];
+			}
+		}
+
+		for(int i=0; i<blockSize; i++) {
+			window[i] = 0.5f * (1.0f - cosf(2.0f * M_PI * i / blockSize));
+		}
+		memset(modulatorIn, 0, sizeof(modulatorIn));
+		memset(carrierIn, 0, sizeof(carrierIn));
+		memset(outAccumulator, 0, sizeof(outAccumulator));
+		writePos = 0;
+		outPos = 0;
+		hopCounter = 0;
+
+		//Log spaced band edges, pushed apart where needed so every band gets at least one bin
+		int nyquistBin = blockSize / 2;
+		for(int k=0; k<nyquistBin; k++) {
+			binBand[k] = -1;
+		}
+		int lowBin = std::max((int) roundf(FFT_LOW_FREQ * blockSize / sampleRate), 1);
+		for(int b=0; b<bands; b++) {
+			int highBin = (int) roundf(FFT_LOW_FREQ * powf(FFT_HIGH_FREQ / FFT_LOW_FREQ, float(b + 1) / bands) * blockSize / sampleRate);
+			highBin = std::min(std::max(highBin, lowBin + 1), nyquistBin);
+			for(int k=lowBin; k<highBin; k++) {
+				binBand[k] = b;
+			}
+			lowBin = highBin;
+		}
+	}
+
+	int getLatency() {
+		return blockSize - 1;
+	}
+
+	// Returns true when a hop is due, the caller then runs analyse(), fills bandGain and runs synthesize()
+	bool push(float modulator, float carrier) {
+		modulatorIn[writePos] = modulator;
+		carrierIn[writePos] = carrier;
+		writePos = (writePos + 1) & (blockSize - 1);
+		if(++hopCounter >= hopSize) {
+			hopCounter = 0;
+			return true;
+		}
+		return false;
+	}
+
+	void analyse() {
+		transform(modulatorIn, modulatorSpectrum);
+		transform(carrierIn, carrierSpectrum);
+
+		float bandEnergy[MAX_FFT_BANDS] = {};
+		for(int k=1; k<blockSize/2; k++) {
+			if(binBand[k] >= 0) {
+				float re = modulatorSpectrum[2*k], im = modulatorSpectrum[2*k+1];
+				bandEnergy[binBand[k]] += re * re + im * im;
+			}
+		}
+		//A Hann windowed sine of amplitude A puts 3 * N^2 * A^2 / 32 into the positive bins
+		for(int b=0; b<bands; b++) {
+			bandLevel[b] = sqrtf(bandEnergy[b] * 32.0f / 3.0f) / blockSize;
+		}
+	}
+
+	void synthesize() {
+		carrierSpectrum[0] = 0.0f;
+		carrierSpectrum[1] = 0.0f;
+		for(int k=1; k<blockSize/2; k++) {
+			float gain = binBand[k] >= 0 ? bandGain[binBand[k]] : 0.0f;
+			carrierSpectrum[2*k] *= gain;
+			carrierSpectrum[2*k+1] *= gain;
+		}
+		fft->irfft(carrierSpectrum, frame);
+
+		//Hann on the way in and out overlaps to 1.5 at 4x, the inverse FFT is unscaled
+		const float scale = 1.0f / (1.5f * blockSize);
+		int mask = blockSize - 1;
+		for(int i=0; i<blockSize; i++) {
+			outAccumulator[(outPos + i) & mask] += frame[i] * window[i] * scale;
+		}
+	}
+
+	float pop() {
+		float out = outAccumulator[outPos];
+		outAccumulator[outPos] = 0.0f;
+		outPos = (outPos + 1) & (blockSize - 1);
+		return out;
+	}
+
+	protected:
+		// Windows the last blockSize samples, oldest first
+		void transform(const float *ring, float *spectrum) {
+			int mask = blockSize - 1;
+			for(int i=0; i<blockSize; i++) {
+				frame[i] = ring[(writePos + i) & mask] * window[i];
+			}
+			fft->rfft(frame, spectrum);
+		}
+};
 
 struct MrBlueSky : Module {
 	enum ParamIds {
@@ -50,12 +199,22 @@ struct MrBlueSky : Module {
 		MOD_INVERT_LIGHT,
 		NUM_LIGHTS
 	};
-	Biquad* iFilter[2*BANDS];
-	Biquad* cFilter[2*BANDS];
+	// Sections 0..BANDS-1 are the first bandpass of each band, BANDS..2*BANDS-1 the second one it cascades into
+	BiquadBank<2*BANDS> iFilter;
+	BiquadBank<2*BANDS> cFilter;
 	float mem[BANDS] = {0};
 	float freq[BANDS] = {125,185,270,350,430,530,630,780,950,1150,1380,1680,2070,2780,3800,6400};
 	float peaks[BANDS] = {0};
 	float lastCarrierQ = 0;
+	float lastAttack = -1;
+	float lastDecay = -1;
+	float attackCoeff = 1; // per sample slew, already capped at 1 so the follower never overshoots
+	float decayCoeff = 1;
+
+	int analysisMode = FILTER_BANK_MODE;
+	int fftBlockSize = 2048;
+	MBSSpectralVocoder spectralVocoder;
+	float spectralEnvelope[MAX_FFT_BANDS] = {0};
 	float lastModQ = 0;
 
 	bool bandModInvert = false;
@@ -111,20 +270,31 @@ struct MrBlueSky : Module {
 		float sampleRate = APP->engine->getSampleRate();
 
 		for(int i=0; i<2*BANDS; i++) {
-			iFilter[i] = new Biquad(bq_type_bandpass, freq[i%BANDS] / sampleRate, 5, 0);
-			cFilter[i] = new Biquad(bq_type_bandpass, freq[i%BANDS] / sampleRate, 5, 0);
+			iFilter.setBiquad(i, bq_type_bandpass, freq[i%BANDS] / sampleRate, 5, 0);
+			cFilter.setBiquad(i, bq_type_bandpass, freq[i%BANDS] / sampleRate, 5, 0);
 		};
 	}
 
 	void process(const ProcessArgs &args) override;
+	float processFilterBank(float modifierIn, float carrierIn);
+	float processSpectral(const ProcessArgs &args, float modifierIn, float carrierIn);
 	void onSampleRateChange() override;
 
+	// Extra delay the STFT adds, the filter bank has none
+	float getLatencyMs() {
+		if(analysisMode == FILTER_BANK_MODE || spectralVocoder.blockSize == 0)
+			return 0.0f;
+		return spectralVocoder.getLatency() * 1000.0f / APP->engine->getSampleRate();
+	}
+
 	// void reset() override {
 	// 	bandOffset =0;
 	// }
 	json_t *dataToJson() override {
 		json_t *rootJ = json_object();
 		json_object_set_new(rootJ, "bandModInvert", json_integer((int) bandModInvert));
+		json_object_set_new(rootJ, "analysisMode", json_integer(analysisMode));
+		json_object_set_new(rootJ, "fftBlockSize", json_integer(fftBlockSize));
 
 		return rootJ;
 	}
@@ -135,6 +305,17 @@ struct MrBlueSky : Module {
 		if (sumJ) {
 			bandModInvert = json_integer_value(sumJ);			
 		}				
+
+		json_t *amJ = json_object_get(rootJ, "analysisMode");
+		if (amJ) {
+			analysisMode = clamp((int) json_integer_value(amJ), 0, 3);
+		}
+		json_t *fbsJ = json_object_get(rootJ, "fftBlockSize");
+		if (fbsJ) {
+			int size = json_integer_value(fbsJ);
+			if(size == 512 || size == 1024 || size == 2048 || size == 4096)
+				fftBlockSize = size;
+		}
 	}
 
 };
@@ -143,9 +324,14 @@ void MrBlueSky::onSampleRateChange() {
 	float sampleRate = APP->engine->getSampleRate();
 
 	for(int i=0; i<2*BANDS; i++) {
-		iFilter[i]->setFc(freq[i%BANDS] / sampleRate);
-		cFilter[i]->setFc(freq[i%BANDS] / sampleRate);
+		iFilter.setFc(i, freq[i%BANDS] / sampleRate);
+		cFilter.setFc(i, freq[i%BANDS] / sampleRate);
 	};
+	// Slew coefficients are per sample
+	lastAttack = -1;
+	lastDecay = -1;
+	// Bin to band map depends on the sample rate
+	spectralVocoder.blockSize = 0;
 }
 
 
@@ -211,9 +397,16 @@ void MrBlueSky::process(const ProcessArgs &args) {
 		decay = clamp(decay + inputs[DECAY_INPUT].getVoltage() * params[DECAY_CV_ATTENUVERTER_PARAM].getValue() / 40.0f,0.0f,0.25f);
 	}
 	decayPercentage = decay * 4.0;
-	float slewAttack = slewMax * powf(slewMin / slewMax, attack);
-	float slewDecay = slewMax * powf(slewMin / slewMax, decay);
-	float out = 0.0;
+	if(attack != lastAttack) {
+		float slewAttack = slewMax * powf(slewMin / slewMax, attack);
+		attackCoeff = std::min(slewAttack * shapeScale / args.sampleRate, 1.0f);
+		lastAttack = attack;
+	}
+	if(decay != lastDecay) {
+		float slewDecay = slewMax * powf(slewMin / slewMax, decay);
+		decayCoeff = std::min(slewDecay * shapeScale / args.sampleRate, 1.0f);
+		lastDecay = decay;
+	}
 
 	//Check Mod Q
 	float currentQ = params[MOD_Q_PARAM].getValue();
@@ -224,7 +417,7 @@ void MrBlueSky::process(const ProcessArgs &args) {
 	modQPercentage = (currentQ-1.0) / 14.0;
 	if (abs(currentQ - lastModQ) >= qEpsilon ) {
 		for(int i=0; i<2*BANDS; i++) {
-			iFilter[i]->setQ(currentQ);
+			iFilter.setQ(i, currentQ);
 		}
 		lastModQ = currentQ;
 	}
@@ -239,37 +432,113 @@ void MrBlueSky::process(const ProcessArgs &args) {
 	carrierQPercentage = (currentQ-1.0) / 14.0;
 	if (abs(currentQ - lastCarrierQ) >= qEpsilon ) {
 		for(int i=0; i<2*BANDS; i++) {
-			cFilter[i]->setQ(currentQ);
+			cFilter.setQ(i, currentQ);
 		}
 		lastCarrierQ = currentQ;
 	}
 
 
 	float gainAdjustedModifierInput =inM*params[GMOD_PARAM].getValue();
-	float maxCoeff = 0.0;
-	//First process all the modifier bands
-	for(int i=0; i<BANDS; i++) {
-		float coeff = mem[i];
-		float peak = abs(iFilter[i+BANDS]->process(iFilter[i]->process(gainAdjustedModifierInput)));
-		if (peak>coeff) {
-			coeff += slewAttack * shapeScale * (peak - coeff) / args.sampleRate;
-			if (coeff > peak)
-				coeff = peak;
+	float gainAdjustedCarrierInput = inC*params[GCARR_PARAM].getValue();
+	float out;
+	if(analysisMode == FILTER_BANK_MODE) {
+		out = processFilterBank(gainAdjustedModifierInput, gainAdjustedCarrierInput);
+		//Start the STFT from silence the next time it is picked
+		spectralVocoder.blockSize = 0;
+	} else {
+		out = processSpectral(args, gainAdjustedModifierInput, gainAdjustedCarrierInput);
+	}
+	float makeupGain = bandModInvert ? 1.25 : 5.0;
+	outputs[OUT].setVoltage(out * makeupGain * params[G_PARAM].getValue());
+
+}
+
+float MrBlueSky::processSpectral(const ProcessArgs &args, float modifierIn, float carrierIn) {
+	int fftBands = BANDS << analysisMode;
+	if(fftBlockSize != spectralVocoder.blockSize || fftBands != spectralVocoder.bands) {
+		spectralVocoder.configure(fftBlockSize, fftBands, args.sampleRate);
+	}
+
+	if(spectralVocoder.push(modifierIn, carrierIn)) {
+		spectralVocoder.analyse();
+
+		//The per sample slew applied once per hop
+		int hopSize = spectralVocoder.hopSize;
+		float hopAttack = 1.0f - powf(1.0f - attackCoeff, hopSize);
+		float hopDecay = 1.0f - powf(1.0f - decayCoeff, hopSize);
+
+		//Each of the 16 ports, knobs and displays covers a group of bands
+		int bandsPerPort = fftBands / BANDS;
+		float maxCoeff = 0.0;
+		for(int i=0; i<BANDS; i++) {
+			mem[i] = 0.0f;
+			peaks[i] = 0.0f;
+		}
+		for(int b=0; b<fftBands; b++) {
+			float peak = spectralVocoder.bandLevel[b];
+			float delta = peak - spectralEnvelope[b];
+			spectralEnvelope[b] += hopAttack * std::max(delta, 0.0f) + hopDecay * std::min(delta, 0.0f);
+			maxCoeff = std::max(maxCoeff, spectralEnvelope[b]);
+			mem[b / bandsPerPort] += spectralEnvelope[b] / bandsPerPort;
+			peaks[b / bandsPerPort] = std::max(peaks[b / bandsPerPort], peak);
 		}
-		else if (peak < coeff) {
-			coeff -= slewDecay * shapeScale * (coeff - peak) / args.sampleRate;
-			if (coeff < peak)
-				coeff = peak;
+		for(int i=0; i<BANDS; i++) {
+			outputs[MOD_OUT+i].setVoltage(mem[i] * 5.0);
 		}
-		peaks[i]=peak;
-		mem[i]=coeff;
-		if(coeff > maxCoeff) {
-			maxCoeff = coeff;
+
+		//Carrier bands, offset in steps of a port's worth of bands
+		for(int b=0; b<fftBands; b++) {
+			float coeff;
+			int actualBand = b + bandOffset * bandsPerPort;
+			if (actualBand < 0) {
+				actualBand += fftBands;
+			} else if (actualBand >= fftBands) {
+				actualBand -= fftBands;
+			}
+			if(inputs[CARRIER_IN+actualBand / bandsPerPort].isConnected()) {
+				coeff = inputs[CARRIER_IN+actualBand / bandsPerPort].getVoltage() / 5.0;
+			} else {
+				coeff = spectralEnvelope[actualBand];
+			}
+
+			if(bandModInvert) {
+				coeff = maxCoeff - coeff;
+			}
+
+			spectralVocoder.bandGain[b] = coeff * params[BG_PARAM+b / bandsPerPort].getValue();
 		}
-		outputs[MOD_OUT+i].setVoltage(coeff * 5.0);
+		spectralVocoder.synthesize();
+	}
+
+	return spectralVocoder.pop();
+}
+
+float MrBlueSky::processFilterBank(float modifierIn, float carrierIn) {
+	float modifierBand[BANDS];
+	float carrierBand[BANDS];
+	for(int g=0; g<BANDS/4; g++) {
+		iFilter.process(g + BANDS/4, iFilter.process(g, modifierIn)).store(modifierBand + g*4);
+		cFilter.process(g + BANDS/4, cFilter.process(g, carrierIn)).store(carrierBand + g*4);
+	}
+
+	//First process all the modifier bands, rising envelopes slew at the attack rate and falling ones at the decay rate
+	simd::float_4 maxCoeffs = 0.0f;
+	for(int g=0; g<BANDS/4; g++) {
+		simd::float_4 coeff = simd::float_4::load(mem + g*4);
+		simd::float_4 peak = simd::abs(simd::float_4::load(modifierBand + g*4));
+		simd::float_4 delta = peak - coeff;
+		coeff += attackCoeff * simd::fmax(delta, 0.0f) + decayCoeff * simd::fmin(delta, 0.0f);
+		peak.store(peaks + g*4);
+		coeff.store(mem + g*4);
+		maxCoeffs = simd::fmax(maxCoeffs, coeff);
+	}
+	float maxCoeff = std::max(std::max(maxCoeffs[0], maxCoeffs[1]), std::max(maxCoeffs[2], maxCoeffs[3]));
+	for(int i=0; i<BANDS; i++) {
+		outputs[MOD_OUT+i].setVoltage(mem[i] * 5.0);
 	}
 
 	//Then process carrier bands. Mod bands are normalled to their matched carrier band unless an insert
+	float bandCoeff[BANDS];
 	for(int i=0; i<BANDS; i++) {
 		float coeff;
 		int actualBand = i+bandOffset;
@@ -289,12 +558,14 @@ void MrBlueSky::process(const ProcessArgs &args) {
 			coeff = maxCoeff - coeff;
 		}
 		
-		float bandOut = cFilter[i+BANDS]->process(cFilter[i]->process(inC*params[GCARR_PARAM].getValue())) * coeff * params[BG_PARAM+i].getValue();
-		out += bandOut;
+		bandCoeff[i] = coeff * params[BG_PARAM+i].getValue();
 	}
-	float makeupGain = bandModInvert ? 1.25 : 5.0;
-	outputs[OUT].setVoltage(out * makeupGain * params[G_PARAM].getValue());
 
+	simd::float_4 bandOut = 0.0f;
+	for(int g=0; g<BANDS/4; g++) {
+		bandOut += simd::float_4::load(carrierBand + g*4) * simd::float_4::load(bandCoeff + g*4);
+	}
+	return bandOut[0] + bandOut[1] + bandOut[2] + bandOut[3];
 }
 
 struct MrBlueSkyBandDisplay : TransparentWidget {
@@ -441,6 +712,35 @@ struct MrBlueSkyWidget : ModuleWidget {
 		addChild(createWidget<ScrewSilver>(Vec(RACK_GRID_WIDTH - 12, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 		addChild(createWidget<ScrewSilver>(Vec(box.size.x - 2 * RACK_GRID_WIDTH + 12, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
 	}
+
+	void appendContextMenu(Menu *menu) override {
+		MrBlueSky *module = dynamic_cast<MrBlueSky*>(this->module);
+		assert(module);
+
+		menu->addChild(new MenuLabel());
+		{
+			OptionsMenuItem* mi = new OptionsMenuItem("Analysis");
+			mi->addItem(OptionMenuItem("16 Band Filter Bank", [module]() { return module->analysisMode == 0; }, [module]() { module->analysisMode = 0; }));
+			mi->addItem(OptionMenuItem("32 Band FFT", [module]() { return module->analysisMode == 1; }, [module]() { module->analysisMode = 1; }));
+			mi->addItem(OptionMenuItem("64 Band FFT", [module]() { return module->analysisMode == 2; }, [module]() { module->analysisMode = 2; }));
+			mi->addItem(OptionMenuItem("128 Band FFT", [module]() { return module->analysisMode == 3; }, [module]() { module->analysisMode = 3; }));
+			menu->addChild(mi);
+		}
+		{
+			OptionsMenuItem* mi = new OptionsMenuItem("FFT Block Size");
+			mi->addItem(OptionMenuItem("512", [module]() { return module->fftBlockSize == 512; }, [module]() { module->fftBlockSize = 512; }));
+			mi->addItem(OptionMenuItem("1024", [module]() { return module->fftBlockSize == 1024; }, [module]() { module->fftBlockSize = 1024; }));
+			mi->addItem(OptionMenuItem("2048", [module]() { return module->fftBlockSize == 2048; }, [module]() { module->fftBlockSize = 2048; }));
+			mi->addItem(OptionMenuItem("4096", [module]() { return module->fftBlockSize == 4096; }, [module]() { module->fftBlockSize = 4096; }));
+			menu->addChild(mi);
+		}
+
+		char latencyText[32];
+		snprintf(latencyText, sizeof(latencyText), "Latency: %.1f ms", module->getLatencyMs());
+		MenuLabel *latencyLabel = new MenuLabel();
+		latencyLabel->text = latencyText;
+		menu->addChild(latencyLabel);
+	}
 };
 
 Model *modelMrBlueSky = createModel<MrBlueSky, MrBlueSkyWidget>("MrBlueSky");
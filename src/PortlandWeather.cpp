@@ -2,20 +2,122 @@
 #include "dsp-delay/delayLine.cpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
-#include "ringbuffer.hpp"
 #include "StateVariableFilter.h"
 #include "dsp-compressor/SimpleComp.h"
 #include "dsp-compressor/SimpleGain.h"
 #include <iostream>
 #include <time.h>
 
-#define HISTORY_SIZE (1<<24)
 #define NUM_TAPS 16
 #define MAX_GRAINS 4
 #define CHANNELS 2
 #define DIVISIONS 36
 #define NUM_GROOVES 16
 #define SMOOTHING 100 //# of samples
+#define MAX_DELAY_TIME 99.0f // seconds
+#define TAP_GROUPS (NUM_TAPS / 4)
+
+using simd::float_4;
+
+
+// Tap filter types, as set by TAP_FILTER_TYPE_PARAM
+enum FilterModes {
+	FILTER_NONE,
+	FILTER_LOWPASS,
+	FILTER_HIGHPASS,
+	FILTER_BANDPASS,
+	FILTER_NOTCH
+};
+
+// Tap filter, mute smoothing, level and pan state kept structure-of-arrays so four taps run per float_4.
+// Setters are per tap and only called when a control changes, process() runs every sample
+struct PWTapBank {
+	float_4 inL[TAP_GROUPS] = {}, inR[TAP_GROUPS] = {};
+	float_4 outL[TAP_GROUPS] = {}, outR[TAP_GROUPS] = {};
+
+	float_4 filterFreq[TAP_GROUPS], filterQ[TAP_GROUPS];
+	StateVariableFilterParams<float_4> filterParams[TAP_GROUPS];
+	StateVariableFilterState<float_4> filterStateL[TAP_GROUPS], filterStateR[TAP_GROUPS];
+	// Filter response is a weighted sum of the SVF outputs so the mode never branches: LP, HP, BP, Notch = LP+HP, Off = dry
+	float_4 lowMix[TAP_GROUPS], hiMix[TAP_GROUPS], bandMix[TAP_GROUPS], dryMix[TAP_GROUPS], filterActive[TAP_GROUPS];
+
+	float_4 muted[TAP_GROUPS] = {}, smoothPosition[TAP_GROUPS] = {};
+	float_4 gainL[TAP_GROUPS] = {}, gainR[TAP_GROUPS] = {};
+
+	PWTapBank() {
+		for(int g = 0; g < TAP_GROUPS; g++) {
+			filterFreq[g] = float_4(0.1f);
+			filterQ[g] = float_4(1.0f);
+			filterParams[g].setFreq(filterFreq[g]);
+			filterParams[g].setQ(filterQ[g]);
+			smoothPosition[g] = float_4(SMOOTHING);
+		}
+		for(int tap = 0; tap < NUM_TAPS; tap++) {
+			setFilterType(tap, FILTER_NONE);
+		}
+	}
+
+	void setFilterType(int tap, int filterType) {
+		int g = tap / 4, lane = tap % 4;
+		lowMix[g][lane] = (filterType == FILTER_LOWPASS || filterType == FILTER_NOTCH) ? 1.0f : 0.0f;
+		hiMix[g][lane] = (filterType == FILTER_HIGHPASS || filterType == FILTER_NOTCH) ? 1.0f : 0.0f;
+		bandMix[g][lane] = filterType == FILTER_BANDPASS ? 1.0f : 0.0f;
+		dryMix[g][lane] = filterType == FILTER_NONE ? 1.0f : 0.0f;
+		filterActive[g][lane] = filterType == FILTER_NONE ? 0.0f : 1.0f;
+	}
+
+	// units are 1 == sample rate
+	void setFilterFreq(int tap, float fc) {
+		filterFreq[tap / 4][tap % 4] = fc;
+		filterParams[tap / 4].setFreq(filterFreq[tap / 4]);
+	}
+
+	void setFilterQ(int tap, float q) {
+		filterQ[tap / 4][tap % 4] = q;
+		filterParams[tap / 4].setQ(filterQ[tap / 4]);
+	}
+
+	void setMuted(int tap, bool tapMuted) {
+		int g = tap / 4, lane = tap % 4;
+		float newMuted = tapMuted ? 1.0f : 0.0f;
+		if(muted[g][lane] != newMuted) {
+			muted[g][lane] = newMuted;
+			smoothPosition[g][lane] = 0.0f;
+		}
+	}
+
+	void setGains(int tap, float left, float right) {
+		gainL[tap / 4][tap % 4] = left;
+		gainR[tap / 4][tap % 4] = right;
+	}
+
+	// Taps with the filter off keep their state where it was
+	inline float_4 filter(float_4 in, StateVariableFilterState<float_4> &state, int g) {
+		StateVariableFilterState<float_4> lastState = state;
+		StateVariableFilterOutputs<float_4> d = StateVariableFilter<float_4>::runAll(in, state, filterParams[g]);
+
+		float_4 active = filterActive[g] > 0.0f;
+		state.z1 = simd::ifelse(active, state.z1, lastState.z1);
+		state.z2 = simd::ifelse(active, state.z2, lastState.z2);
+		return d.lowPass * lowMix[g] + d.hiPass * hiMix[g] + d.bandPass * bandMix[g] + in * dryMix[g];
+	}
+
+	void process() {
+		for(int g = 0; g < TAP_GROUPS; g++) {
+			float_4 l = filter(inL[g], filterStateL[g], g);
+			float_4 r = filter(inR[g], filterStateR[g], g);
+
+			// muted ? 1 - position : position, ramping over SMOOTHING samples
+			float_4 ramp = smoothPosition[g] / float(SMOOTHING);
+			float_4 muteSmoothing = ramp + muted[g] * (1.0f - 2.0f * ramp);
+			smoothPosition[g] = simd::fmin(smoothPosition[g] + 1.0f, float(SMOOTHING));
+
+			outL[g] = l * muteSmoothing * gainL[g];
+			outR[g] = r * muteSmoothing * gainR[g];
+		}
+	}
+};
+
 
 struct PortlandWeather : Module {
 	
@@ -119,13 +221,6 @@ struct PortlandWeather : Module {
 		PHASE_REVERSE_R_LIGHT,
 		NUM_LIGHTS
 	};
-	enum FilterModes {
-		FILTER_NONE,
-		FILTER_LOWPASS,
-		FILTER_HIGHPASS,
-		FILTER_BANDPASS,
-		FILTER_NOTCH
-	};
 	enum TriggerModes {
 		TRIGGER_TRIGGER_MODE,
 		GATE_TRIGGER_MODE
@@ -226,12 +321,13 @@ struct PortlandWeather : Module {
 	int grainCount = 3; //NOTE Should be 3
 	float grainSize = 0.5f; //Can be between 0 and 1			
 	bool tapMuted[NUM_TAPS];
-	bool lastTapMutedStatus[NUM_TAPS] = {0};
-	float lastTapSmoothPosition[NUM_TAPS] = {0};
 	bool tapStacked[NUM_TAPS];
+	int stackedDelayTap[NUM_TAPS]; // tap whose delay time each tap uses once stacking is applied
 	int lastFilterType[NUM_TAPS];
-	float lastTapFc[NUM_TAPS];
+	float lastTapCutoff[NUM_TAPS];
 	float lastTapQ[NUM_TAPS];
+	float lastTapPitch[NUM_TAPS + CHANNELS];
+	float tapRatio[NUM_TAPS + CHANNELS];
 	float tapPitchShift[NUM_TAPS];
 	float tapDetune[NUM_TAPS];
 	int tapFilterType[NUM_TAPS];
@@ -291,8 +387,7 @@ struct PortlandWeather : Module {
 	float pDetunePercentage[NUM_TAPS] = {0};
 
 	
-	StateVariableFilterState<T> filterStates[NUM_TAPS][CHANNELS];
-    StateVariableFilterParams<T> filterParams[NUM_TAPS];
+	PWTapBank tapBank;
 	dsp::RCFilter lowpassFilter[CHANNELS];
 	dsp::RCFilter highpassFilter[CHANNELS];
 	float lastColor = 0.0f;
@@ -317,8 +412,9 @@ struct PortlandWeather : Module {
 
 	
 	MultiTapDelayLine<FloatFrame, NUM_TAPS+CHANNELS> delayLine;
-	FrozenWasteland::ReverseRingBuffer<float, HISTORY_SIZE> reverseHistoryBuffer[CHANNELS];
-	GranularPitchShifter granularPitchShift[NUM_TAPS + CHANNELS]; // Each tap, plus each channel 
+	int reverseSegmentSize = 0; // frames each reverse segment plays back, follows the feedback delay
+	GranularPitchShifterBank<NUM_TAPS> tapPitchShifter; // Each tap
+	GranularPitchShifter feedbackPitchShift[CHANNELS]; // Each channel 
 	
 	FloatFrame lastFeedback = {0.0f,0.0f};
 
@@ -330,6 +426,19 @@ struct PortlandWeather : Module {
 		return powf(2,semiTone/12.0f);
 	}
 
+	void allocateDelayLine() {
+		//Longest tap is the full base delay, feedback slip can add half a tap on top of that, plus 10ms of time CV
+		delayLine.setMaxDelay(sampleRate, MAX_DELAY_TIME * (1.0f + 0.5f / NUM_TAPS) + 0.01f);
+		//Force every tap to recompute its position against the new size
+		for(int i = 0; i < NUM_TAPS+CHANNELS; i++) {
+			lastDelayTime[i] = -1.0f;
+		}
+		//Cutoffs are stored relative to the sample rate
+		for(int i = 0; i < NUM_TAPS; i++) {
+			lastTapCutoff[i] = -1.0f;
+		}
+	}
+
 	PortlandWeather() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 
@@ -443,8 +552,14 @@ struct PortlandWeather : Module {
 		rightExpander.consumerMessage = rightMessages[1];
 
 		sampleRate = APP->engine->getSampleRate();
+		allocateDelayLine();
+
+		for(int i = 0; i < NUM_TAPS+CHANNELS; i++) {
+			lastTapPitch[i] = -1000.0f; // forces the first ratio calculation
+		}
 		
 		for (uint8_t i = 0; i < CHANNELS + 1; i++) {
+			compressor[i].setSampleRate(sampleRate);
 			compressor[i].initRuntime();
 			compressor[i].setRatio(20.0);
 			compressor[i].setThresh(i < CHANNELS ? 45.0 : 5.0);
@@ -461,12 +576,12 @@ struct PortlandWeather : Module {
 			tapStacked[i] = false;
 			tapPitchShift[i] = 0.0f;
 			tapDetune[i] = 0.0f;
+			stackedDelayTap[i] = i;
 			lastFilterType[i] = FILTER_NONE;
-			lastTapFc[i] = 800.0f / sampleRate;
+			lastTapCutoff[i] = -1.0f;
 			lastTapQ[i] = 5.0f;
-			filterParams[i].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-			filterParams[i].setQ(5); 	
-	        filterParams[i].setFreq(T(800.0f / sampleRate));
+			tapBank.setFilterQ(i, 5.0f);
+			tapBank.setFilterFreq(i, 800.0f / sampleRate);
 			delayTime[i] = 0.0f;
 
 	    }	
@@ -678,13 +793,13 @@ struct PortlandWeather : Module {
 				//duration = 1;
 			}	
 			//baseDelay = duration / division;
-			baseDelay = clamp(duration / multiplier * division,0.001f,99.0f);
+			baseDelay = clamp(duration / multiplier * division,0.001f,MAX_DELAY_TIME);
 			// if(baseDelay > HISTORY_SIZE / sampleRate) {
 			// 	baseDelay = HISTORY_SIZE / sampleRate - 1.0;
 			// }
 				
 		} else {
-			baseDelay = clamp(params[TIME_PARAM].getValue() + inputs[TIME_CV_INPUT].getVoltage(), 0.001f, 99.0f);	
+			baseDelay = clamp(params[TIME_PARAM].getValue() + inputs[TIME_CV_INPUT].getVoltage(), 0.001f, MAX_DELAY_TIME);	
 			timePercentage = baseDelay / 10.0;
 			duration = 0.0f;
 			firstClockReceived = false;
@@ -717,8 +832,7 @@ struct PortlandWeather : Module {
 		}
 		lights[REVERSE_LIGHT].value = reverse;
 		if(reverse && reverse != reversePrevious) {
-			reverseHistoryBuffer[0].clear();
-			reverseHistoryBuffer[1].clear();		
+			delayLine.resetReverse();
 		}
 
 		// Phase Reverse L
@@ -765,8 +879,6 @@ struct PortlandWeather : Module {
 		FloatFrame dryFrame = {0.0, 0.0};
 		FloatFrame inFrame = {0.0, 0.0};
 		for(int channel = 0;channel < CHANNELS;channel++) {
-			compressor[channel].setSampleRate(double(args.sampleRate));
-			
 			// Get input to delay block
 			feedbackTap[channel] = (int)clamp(params[FEEDBACK_TAP_L_PARAM+channel].getValue() + (inputs[FEEDBACK_TAP_L_INPUT+channel].isConnected() ? (inputs[FEEDBACK_TAP_L_INPUT+channel].getVoltage() / 10.0f) : 0),0.0f,17.0);
 			feedbackSlip[channel] = clamp(params[FEEDBACK_L_SLIP_PARAM+channel].getValue() + (inputs[FEEDBACK_L_SLIP_CV_INPUT+channel].isConnected() ? (inputs[FEEDBACK_L_SLIP_CV_INPUT+channel].getVoltage() / 10.0f) : 0),-0.5f,0.5);
@@ -794,30 +906,16 @@ struct PortlandWeather : Module {
 
 		}
 		float inLeval = std::max(abs(inFrame.l),abs(inFrame.r));		
-		compressor[2].setSampleRate(double(args.sampleRate));
 		compressor[2].process(inLeval);
 		double duckingGainReduction = compressor[2].getGainReduction();
 
-		FloatFrame dryToUse = dryFrame; //Normally the same as dry unless in reverse mode
-
-		// Push dry sample into reverse history buffers
-		reverseHistoryBuffer[0].push(dryFrame.l);
-		reverseHistoryBuffer[1].push(dryFrame.r);
-		if(reverse) {
-			FloatFrame reverseDry;
-			reverseDry.l = reverseHistoryBuffer[0].shift();
-			reverseDry.r = reverseHistoryBuffer[1].shift();
-			dryToUse = reverseDry;
-		}	
-
-		// Push dry sample into history buffer
-		delayLine.write(dryToUse);
+		// Push dry sample into history buffer - reverse mode reads it backwards, so it is always stored forwards
+		delayLine.write(dryFrame);
 
 		FloatFrame wet = {0.0f, 0.0f}; // This is the mix of delays and input that is outputed
 		FloatFrame feedbackValue = {0.0f, 0.0f}; // This is the output of a tap that gets sent back to input
-				
-		for(int tap = 0; tap < NUM_TAPS;tap++) { 
 
+		for(int tap = 0; tap < NUM_TAPS;tap++) { 
 			// Stacking
 			if(params[STACK_TRIGGER_MODE_PARAM].getValue() == GATE_TRIGGER_MODE && inputs[TAP_STACK_CV_INPUT+tap].isConnected()) {
 				tapStacked[tap] = inputs[TAP_STACK_CV_INPUT+tap].getVoltage() > 0.0f;
@@ -826,6 +924,14 @@ struct PortlandWeather : Module {
 			if (tap < NUM_TAPS -1 && stackingTrigger[tap].process(params[TAP_STACKED_PARAM+tap].getValue() + (params[STACK_TRIGGER_MODE_PARAM].getValue() == TRIGGER_TRIGGER_MODE ? inputs[TAP_STACK_CV_INPUT+tap].getVoltage() : 0.0f))) {
 				tapStacked[tap] = !tapStacked[tap];
 			}
+		}
+		//Normally the delay tap is the same as the tap itself, unless it is stacked, then it is its neighbor;
+		stackedDelayTap[NUM_TAPS-1] = NUM_TAPS-1;
+		for(int tap = NUM_TAPS-2; tap >= 0;tap--) { 
+			stackedDelayTap[tap] = tapStacked[tap] ? stackedDelayTap[tap+1] : tap;
+		}
+				
+		for(int tap = 0; tap < NUM_TAPS;tap++) { 
 
 			float pitch,detune;
 
@@ -839,13 +945,12 @@ struct PortlandWeather : Module {
 			tapPitchShift[tap] = pitch;
 			tapDetune[tap] = detune;
 			pitch += detune/100.0f; 
-
-			
-			//Normally the delay tap is the same as the tap itself, unless it is stacked, then it is its neighbor;
-			int delayTap = tap;
-			while(delayTap < NUM_TAPS && tapStacked[delayTap]) {
-				delayTap++;			
+			if(pitch != lastTapPitch[tap]) {
+				tapRatio[tap] = SemitonesToRatio(pitch);
+				lastTapPitch[tap] = pitch;
 			}
+
+			int delayTap = stackedDelayTap[tap];
 			
 			// Compute delay from base and groove
 			float delay = baseDelay / NUM_TAPS * lerp(tapGroovePatterns[0][delayTap],tapGroovePatterns[tapGroovePattern][delayTap],grooveAmount); //Balance between straight time and groove
@@ -860,18 +965,11 @@ struct PortlandWeather : Module {
 				lastDelayTime[tap] = delayTime[tap];
 			}
 			
-			FloatFrame wetTap = {0.0f, 0.0f};
-
 			//Get Delay Tap Output
-			FloatFrame initialOutput = delayLine.getTap(tap);
+			FloatFrame initialOutput = reverse ? delayLine.getReverseTap(tap,reverseSegmentSize) : delayLine.getTap(tap);
 		
-			granularPitchShift[tap].setRatio(SemitonesToRatio(pitch));
-			granularPitchShift[tap].setSize(grainSize);
-
-			FloatFrame pitchShiftOut = granularPitchShift[tap].process(initialOutput,true); 
-				
-			wetTap.l +=pitchShiftOut.l;
-			wetTap.r +=pitchShiftOut.r;
+			tapPitchShifter.setRatio(tap,tapRatio[tap]);
+			tapPitchShifter.in[tap] = initialOutput;
 					
 			// Muting			
 			if(params[MUTE_TRIGGER_MODE_PARAM].getValue() == GATE_TRIGGER_MODE && inputs[TAP_MUTE_CV_INPUT+tap].isConnected()) {
@@ -881,83 +979,59 @@ struct PortlandWeather : Module {
 			if (mutingTrigger[tap].process(params[TAP_MUTE_PARAM+tap].getValue() + (inputs[TAP_MUTE_CV_INPUT+tap].isConnected() && params[MUTE_TRIGGER_MODE_PARAM].getValue() == TRIGGER_TRIGGER_MODE ? inputs[TAP_MUTE_CV_INPUT+tap].getVoltage() : 0))) {
 				tapMuted[tap] = !tapMuted[tap];
 			}			
+			tapBank.setMuted(tap, tapMuted[tap] || expanderMuteTaps[tap]);
 
 			//Each tap - channel has its own filter
 			int tapFilterType = (int)params[TAP_FILTER_TYPE_PARAM+tap].getValue();
-			// Apply Filter to tap wet output			
+			if(tapFilterType != lastFilterType[tap]) {
+				tapBank.setFilterType(tap, tapFilterType);
+			}
 			if(tapFilterType != FILTER_NONE) {
-				if(tapFilterType != lastFilterType[tap]) {
-					switch(tapFilterType) {
-						case FILTER_LOWPASS:
-						filterParams[tap].setMode(StateVariableFilterParams<T>::Mode::LowPass);
-						break;
-						case FILTER_HIGHPASS:
-						filterParams[tap].setMode(StateVariableFilterParams<T>::Mode::HiPass);
-						break;
-						case FILTER_BANDPASS:
-						filterParams[tap].setMode(StateVariableFilterParams<T>::Mode::BandPass);
-						break;
-						case FILTER_NOTCH:
-						filterParams[tap].setMode(StateVariableFilterParams<T>::Mode::Notch);
-						break;
-					}					
-				}
-
 				float cutoffExp = clamp((hasExpanderFcs ? expanderFcs[tap] : params[TAP_FC_PARAM+tap].getValue()) + inputs[TAP_FC_CV_INPUT+tap].getVoltage() / 10.0f,0.0f,1.0f);
 				fcPercentage[tap] = cutoffExp;
 
 				float tapQ = clamp((hasExpanderQs ? expanderQs[tap] : params[TAP_Q_PARAM+tap].getValue()) + (inputs[TAP_Q_CV_INPUT+tap].getVoltage() / 10.0f),0.01f,1.0f) * 50; 
 				qPercentage[tap] = tapQ / 50.0;
 
-				float tapFc = minCutoff * powf(maxCutoff / minCutoff, cutoffExp) / sampleRate;
-				if(lastTapFc[tap] != tapFc) {
-					filterParams[tap].setFreq(T(tapFc));
-					lastTapFc[tap] = tapFc;
+				if(lastTapCutoff[tap] != cutoffExp) {
+					float tapFc = minCutoff * powf(maxCutoff / minCutoff, cutoffExp) / sampleRate;
+					tapBank.setFilterFreq(tap, tapFc);
+					lastTapCutoff[tap] = cutoffExp;
 				}
 				if(lastTapQ[tap] != tapQ) {
-					filterParams[tap].setQ(tapQ); 
+					tapBank.setFilterQ(tap, tapQ);
 					lastTapQ[tap] = tapQ;
 				}
-				for(int channel=0;channel <CHANNELS;channel++) {		
-					if(channel == 0) {
-						wetTap.l = StateVariableFilter<T>::run(wetTap.l, filterStates[tap][channel], filterParams[tap]);
-					} else {
-						wetTap.r = StateVariableFilter<T>::run(wetTap.r, filterStates[tap][channel], filterParams[tap]);
-					}
-				}
 			} else {
 				fcPercentage[tap] = 0.0;
 				qPercentage[tap] = 0.0;
 			}
 			lastFilterType[tap] = tapFilterType;
 
-			
-			bool tapCurrentlyMuted = tapMuted[tap] || expanderMuteTaps[tap];
-			if(tapCurrentlyMuted != lastTapMutedStatus[tap]) {
-				lastTapSmoothPosition[tap] = 0;
-				lastTapMutedStatus[tap] = tapCurrentlyMuted;
-			}
-			
-			float muteSmoothing = 1.0;
-			if(lastTapSmoothPosition[tap] < SMOOTHING) {
-				muteSmoothing = tapCurrentlyMuted ? lerp(1.0,0.0,lastTapSmoothPosition[tap]/SMOOTHING) : lerp(0.0,1.0,lastTapSmoothPosition[tap]/SMOOTHING);				
-				lastTapSmoothPosition[tap]++;
-			} else {
-				muteSmoothing = tapCurrentlyMuted ? 0.0 : 1.0;
-			}
-			
-
 			float level = clamp(((hasExpanderLevels ? expanderLevels[tap] : params[TAP_LEVEL_PARAM+tap].getValue()) + (inputs[TAP_PAN_CV_INPUT+tap].isConnected() ? (inputs[TAP_PAN_CV_INPUT+tap].getVoltage() / 10.0f) : 0)),0.0f,1.0f);
 			levelPercentage[tap] = level;
 			 
 			float pan = clamp(((hasExpanderPans ? expanderPans[tap] : params[TAP_PAN_PARAM+tap].getValue()) + (inputs[TAP_PAN_CV_INPUT+tap].isConnected() ? (inputs[TAP_PAN_CV_INPUT+tap].getVoltage() / 5.0f) : 0)),-1.0f,1.0f);
 			panPercentage[tap] = pan;
-			wetTap.l = wetTap.l * muteSmoothing * level * std::max(1.0 - pan,0.0);  
-			wetTap.r = wetTap.r * muteSmoothing * level * std::max(pan+1.0,1.0);   
+			tapBank.setGains(tap, level * std::max(1.0f - pan,0.0f), level * std::max(pan+1.0f,1.0f));
+
+			lights[TAP_STACKED_LIGHT+tap].value = tapStacked[tap];
+			lights[TAP_MUTED_LIGHT+tap].value = (tapMuted[tap] || expanderMuteTaps[tap]);	
+		}
 
+		// Pitch shift, then filter, mute, level and pan four taps at a time
+		tapPitchShifter.setSize(grainSize);
+		tapPitchShifter.process(true);
+		for(int tap = 0; tap < NUM_TAPS;tap++) { 
+			tapBank.inL[tap / 4][tap % 4] = tapPitchShifter.out[tap].l;
+			tapBank.inR[tap / 4][tap % 4] = tapPitchShifter.out[tap].r;
+		}
+		tapBank.process();
 
-			if(tapBreakoutPresent)
-			{	
+		if(tapBreakoutPresent)
+		{	
+			for(int tap = 0; tap < NUM_TAPS;tap++) { 
+				FloatFrame wetTap = {tapBank.outL[tap / 4][tap % 4], tapBank.outR[tap / 4][tap % 4]};
 				//For Breakout
 				tapLSends[tap] = wetTap.l;
 				tapRSends[tap] = wetTap.r;
@@ -967,22 +1041,24 @@ struct PortlandWeather : Module {
 				}
 				bool isExpanderPortConnectedR = (bool)tapRConnections[tap]; 
 				if (isExpanderPortConnectedR) {
-					wetTap.r = tapRReturns[tap]; \
+					wetTap.r = tapRReturns[tap];
 				}				
-			}
-
-
-			wet.l += wetTap.l;
-			wet.r += wetTap.r;
-		
-
-			lights[TAP_STACKED_LIGHT+tap].value = tapStacked[tap];
-			lights[TAP_MUTED_LIGHT+tap].value = (tapMuted[tap] || expanderMuteTaps[tap]);	
 
+				wet.l += wetTap.l;
+				wet.r += wetTap.r;
+			}
+		} else {
+			float_4 wetL = 0.0f, wetR = 0.0f;
+			for(int g = 0; g < TAP_GROUPS; g++) {
+				wetL += tapBank.outL[g];
+				wetR += tapBank.outR[g];
+			}
+			wet.l = wetL[0] + wetL[1] + wetL[2] + wetL[3];
+			wet.r = wetR[0] + wetR[1] + wetR[2] + wetR[3];
 		}
 
-				
 		//Process Feedback delays and pitch shifting
+		int nextReverseSegmentSize = 0;
 		for(int channel = 0;channel < CHANNELS;channel ++) {
 			float delay = 0.0f;
 			FloatFrame initialFBOutput = {0.0f, 0.0f};
@@ -995,10 +1071,7 @@ struct PortlandWeather : Module {
 					delay = clamp(inputs[EXTERNAL_DELAY_TIME_INPUT].getVoltage(), 0.001f, 10.0f); //Need to process this same as other size...
 				} else { 
 					// Use tap as basis of delay time
-					int delayTap = feedbackTap[channel];				
-					while(delayTap < NUM_TAPS && tapStacked[delayTap]) {
-						delayTap++;			
-					}
+					int delayTap = stackedDelayTap[feedbackTap[channel]];
 
 					float slip = feedbackSlip[channel] * baseDelay / NUM_TAPS;
 					delay = delayTime[delayTap] + slip; 
@@ -1009,7 +1082,7 @@ struct PortlandWeather : Module {
 					delayLine.setDelayTime(NUM_TAPS+channel,index);
 				}
 
-				FloatFrame tempOutput = delayLine.getTap(NUM_TAPS+channel);
+				FloatFrame tempOutput = reverse ? delayLine.getReverseTap(NUM_TAPS+channel,reverseSegmentSize) : delayLine.getTap(NUM_TAPS+channel);
 				if(channel == 0) {
 					initialFBOutput.l = tempOutput.l; 
 				} else {
@@ -1026,19 +1099,23 @@ struct PortlandWeather : Module {
 				}
 			}
 					
-			//Set reverse size = delay of feedback
-			reverseHistoryBuffer[channel].setDelaySize((delay) * sampleRate);			
+			//Set reverse size = delay of feedback, taps are stereo so use the longer side
+			nextReverseSegmentSize = std::max(nextReverseSegmentSize, int(delay * sampleRate));
 			
 			float pitch,detune;
 			pitch = feedbackPitch[channel];
 			detune = feedbackDetune[channel];
 			pitch += detune/100.0f; 
+			if(pitch != lastTapPitch[NUM_TAPS+channel]) {
+				tapRatio[NUM_TAPS+channel] = SemitonesToRatio(pitch);
+				lastTapPitch[NUM_TAPS+channel] = pitch;
+			}
 
 			FloatFrame pitchShiftedFB = {0.0f,0.0f};			
-			granularPitchShift[NUM_TAPS+channel].setRatio(SemitonesToRatio(pitch));
-			granularPitchShift[NUM_TAPS+channel].setSize(grainSize);
+			feedbackPitchShift[channel].setRatio(tapRatio[NUM_TAPS+channel]);
+			feedbackPitchShift[channel].setSize(grainSize);
 
-			FloatFrame pitchShiftOut = granularPitchShift[NUM_TAPS+channel].process(initialFBOutput,true); 
+			FloatFrame pitchShiftOut = feedbackPitchShift[channel].process(initialFBOutput,true); 
 				
 			pitchShiftedFB.l +=pitchShiftOut.l; 
 			pitchShiftedFB.r +=pitchShiftOut.r;
@@ -1052,6 +1129,8 @@ struct PortlandWeather : Module {
 	
 		
 
+		reverseSegmentSize = nextReverseSegmentSize;
+
 		//Apply global filtering
 		float color = clamp(params[FEEDBACK_TONE_PARAM].getValue() + inputs[FEEDBACK_TONE_INPUT].getVoltage() / 10.0f, 0.0f, 1.0f);
 		feedbackTonePercentage = color;
@@ -1205,6 +1284,15 @@ struct PortlandWeather : Module {
 	}
 
 
+	void onSampleRateChange() override {
+		sampleRate = APP->engine->getSampleRate();
+		allocateDelayLine();
+
+		for (uint8_t i = 0; i < CHANNELS + 1; i++) {
+			compressor[i].setSampleRate(sampleRate);
+		}
+	}
+
 	void onReset() override {
 		reverse = false;
 		pingPong = false;
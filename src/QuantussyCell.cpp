@@ -1,67 +1,7 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
-
-struct LowFrequencyOscillator {
-	float phase = 0.0;
-	float pw = 0.5;
-	float freq = 1.0;
-	bool offset = false;
-	bool invert = false;
-	dsp::SchmittTrigger resetTrigger;
-	LowFrequencyOscillator() {}
-	void setPitch(float pitch) {
-		pitch = fminf(pitch, 8.0);
-		freq = powf(2.0, pitch);
-	}
-	void setPulseWidth(float pw_) {
-		const float pwMin = 0.01;
-		pw = clamp(pw_, pwMin, 1.0f - pwMin);
-	}
-	void setReset(float reset) {
-		if (resetTrigger.process(reset)) {
-			phase = 0.0;
-		}
-	}
-	void step(float dt) {
-		float deltaPhase = fminf(freq * dt, 0.5);
-		phase += deltaPhase;
-		if (phase >= 1.0)
-			phase -= 1.0;
-	}
-	float sin() {
-		if (offset)
-			return 1.0 - cosf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-		else
-			return sinf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-	}
-	float tri(float x) {
-		return 4.0 * fabsf(x - roundf(x));
-	}
-	float tri() {
-		if (offset)
-			return tri(invert ? phase - 0.5 : phase);
-		else
-			return -1.0 + tri(invert ? phase - 0.25 : phase - 0.75);
-	}
-	float saw(float x) {
-		return 2.0 * (x - roundf(x));
-	}
-	float saw() {
-		if (offset)
-			return invert ? 2.0 * (1.0 - phase) : 2.0 * phase;
-		else
-			return saw(phase) * (invert ? -1.0 : 1.0);
-	}
-	float sqr() {
-		float sqr = (phase < pw) ^ invert ? 1.0 : -1.0;
-		return offset ? sqr + 1.0 : sqr;
-	}
-	float light() {
-		return sinf(2*M_PI * phase);
-	}
-};
-
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
 
 
 struct QuantussyCell : Module {
@@ -94,7 +34,7 @@ struct QuantussyCell : Module {
 	};
 
 
-	LowFrequencyOscillator oscillator;
+	LowFrequencyOscillator<float> oscillator;
 
 
 	//Stuff for S&Hs
@@ -185,7 +125,7 @@ void QuantussyCell::process(const ProcessArgs &args) {
 	}
 
 
-	lights[BLINK_LIGHT].setSmoothBrightness(fmaxf(0.0, oscillator.light()), deltaTime);
+	lights[BLINK_LIGHT].setSmoothBrightness(fmaxf(0.0, lfoSine(oscillator.progress())), deltaTime);
 
 }
 
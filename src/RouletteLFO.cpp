@@ -2,6 +2,8 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "ui/scopeCapture.hpp"
+#include "dsp-lfo/quadratureOscillator.hpp"
 
 
 #define BUFFER_SIZE 512
@@ -56,11 +58,9 @@ struct RouletteLFO : Module {
 	};
 	
 
-	float bufferX1[BUFFER_SIZE] = {};
-	float bufferY1[BUFFER_SIZE] = {};
+	// X and Y in lanes 0 and 1, before scaling
+	ScopeCapture<BUFFER_SIZE> scope;
 	float displayScaling = 1;
-	int bufferIndex = 0;
-	float frameIndex = 0;	
 	float scopeDeltaTime = powf(2.0, -8);
 
 	//SchmittTrigger resetTrigger;
@@ -68,8 +68,12 @@ struct RouletteLFO : Module {
 
 	float x1 = 0.0;
 	float y1 = 0.0;
-	float fixedPhase = 0.0;
-	float generatorPhase = 0.0;
+	QuadratureOscillator fixedOscillator;
+	QuadratureOscillator generatorOscillator;
+
+	// 2^pitch is only worked out again when the pitch moves
+	float lastPitch = 0.0;
+	float freq = 1.0;
 
 	//percenatages
 	float radiusRatioPercentage = 0;
@@ -123,7 +127,13 @@ struct RouletteLFO : Module {
 		configOutput(OUTPUT_X, "X");
 		configOutput(OUTPUT_Y, "Y");
 
+		onSampleRateChange();
+	}
+
+	void onSampleRateChange() override {
+		scope.setDecimation((int)ceilf(scopeDeltaTime * APP->engine->getSampleRate()));
 	}
+
 	void process(const ProcessArgs &args) override {
 
 
@@ -166,34 +176,22 @@ struct RouletteLFO : Module {
 
 		displayScaling = fmaxf(eF + eG/2.0 + d*0.5,1.0f);
 
-		float freq = powf(2.0, pitch);
+		if (pitch != lastPitch) {
+			freq = powf(2.0, pitch);
+			lastPitch = pitch;
+		}
 		float deltaTime = 1.0 / args.sampleRate;
 		float deltaPhase = fminf(freq * deltaTime, 0.5);
-		
-		generatorPhase += deltaPhase * ratio;
-		if (generatorPhase >= 1.0)
-			generatorPhase -= 1.0;
-
-		fixedPhase += deltaPhase; //Fixed shape rolls in opposite direction
-		if (fixedPhase >= 1.0)
-			fixedPhase -= 1.0;
-
-		float generatorTheta = (generatorInitialPhase + generatorPhase) * 2 * M_PI;
-		float fixedTheta = (fixedInitialPhase + fixedPhase) * 2 * M_PI;
-
-		//Fixed object is always horizontal, so major and minor axis vectors are constant
-		float fixedX = ratio * (eF*sinf(fixedTheta));
-		float fixedY = ratio * (cosf(fixedTheta));
-
-		float a0 = 0.0f;
-		float b0 = 0.0f;
-		float ax = eG * cosf(generatorTheta);
-		float ay = eG * sinf(generatorTheta);
-		float bx = cosf(generatorTheta - M_PI / 2);
-		float by = sinf(generatorTheta - M_PI / 2);
 
-		float generatorX = a0 + d * (ax*sinf(generatorTheta) + bx*cosf(generatorTheta));
-		float generatorY = b0 + d * (ay*sinf(generatorTheta) + by*cosf(generatorTheta));
+		// Lanes 0 and 1 are the sine and cosine for X and Y of the curve, 2 and 3 are left free for a second curve.
+		// The generator rolls ratio times faster, and its point goes round twice per turn (see below)
+		float generatorDelta = 2.0f * deltaPhase * ratio;
+		fixedOscillator.setDelta(simd::float_4(deltaPhase, deltaPhase, 0.f, 0.f));
+		fixedOscillator.setPhaseOffset(simd::float_4(fixedInitialPhase, fixedInitialPhase + 0.25f, 0.f, 0.25f));
+		generatorOscillator.setDelta(simd::float_4(generatorDelta, generatorDelta, 0.f, 0.f));
+		generatorOscillator.setPhaseOffset(simd::float_4(2.0f * generatorInitialPhase, 2.0f * generatorInitialPhase + 0.25f, 0.f, 0.25f));
+		fixedOscillator.step();
+		generatorOscillator.step();
 
 	// x(theta) = a0 + ax*sin(theta) + bx*cos(theta)
 	// y(theta) = b0 + ay*sin(theta) + by*cos(theta)
@@ -202,38 +200,31 @@ struct RouletteLFO : Module {
 	// (ax,ay) vector representing the major axis
 	// (bx,by) vector representing the minor axis
 
-		//float scaling = eF + eg/2.0;
+		// Fixed object is always horizontal, so it's (ratio*eF*sin(theta), ratio*cos(theta)). The generator has
+		// a = eG*(cos(theta), sin(theta)) and b = (sin(theta), -cos(theta)) at its own theta, which works out to
+		// d * ((eG+1)/2 * sin(2*theta), (eG-1)/2 - (eG+1)/2 * cos(2*theta)). Everything is divided by ratio on the way out
+		float generatorRadius = d * (eG + 1.0f) * 0.5f / ratio;
+		float generatorCenter = d * (eG - 1.0f) * 0.5f / ratio;
+		simd::float_4 fixedPoint = simd::float_4(eF, 1.f, eF, 1.f) * fixedOscillator.sine;
+		simd::float_4 generatorPoint = simd::float_4(generatorRadius, -generatorRadius, generatorRadius, -generatorRadius) * generatorOscillator.sine
+			+ simd::float_4(0.f, generatorCenter, 0.f, generatorCenter);
 
+		//float scaling = eF + eg/2.0;
 
+		simd::float_4 amplitude = simd::float_4(xAmplitude, yAmplitude, xAmplitude, yAmplitude);
+		simd::float_4 curve;
 		if(params[INSIDE_OUTSIDE_PARAM].getValue() == INSIDE_ROULETTE) {
-			x1 = (fixedX - generatorX) / ratio * xAmplitude;
-			y1 = (fixedY - generatorY) / ratio * yAmplitude;
+			curve = (fixedPoint - generatorPoint) * amplitude;
 		} else {
-			x1 = (fixedX + generatorX) / ratio * xAmplitude;
-			y1 = (fixedY + generatorY) / ratio * yAmplitude;
+			curve = (fixedPoint + generatorPoint) * amplitude;
 		}
+		x1 = curve[0];
+		y1 = curve[1];
 		//scaling += d > 1 ? d - 1 : 0;
 		float scaling = 10.0f / (displayScaling + (eF + eG + d / 2.0f - 2));
 
 
-		//Update scope.
-		int frameCount = (int)ceilf(scopeDeltaTime * args.sampleRate);
-
-		// Add frame to buffers
-		if (bufferIndex < BUFFER_SIZE) {
-			if (++frameIndex > frameCount) {
-				frameIndex = 0;
-				bufferX1[bufferIndex] = x1;
-				bufferY1[bufferIndex] = y1;
-				bufferIndex++;
-			}
-		}
-
-		// Are we waiting on the next trigger?
-		if (bufferIndex >= BUFFER_SIZE) {
-			bufferIndex = 0;
-			frameIndex = 0;
-		}
+		scope.process(curve);
 
 		x1 = x1 * scaling;
 		y1 = y1 * scaling;
@@ -270,9 +261,7 @@ struct RouletteScopeDisplay : TransparentWidget {
 	RouletteScopeDisplay() {
 	}
 
-	void drawWaveform(const DrawArgs &args, float *valuesX, float *valuesY) {
-		if (!valuesX)
-			return;
+	void drawWaveform(const DrawArgs &args, const simd::float_4 *points, float scaling) {
 		nvgSave(args.vg);
 		Rect b = Rect(Vec(0, 0), box.size);
 		nvgScissor(args.vg, b.pos.x, b.pos.y, b.size.x, b.size.y);
@@ -280,8 +269,8 @@ struct RouletteScopeDisplay : TransparentWidget {
 		// Draw maximum display left to right
 		for (int i = 0; i < BUFFER_SIZE; i++) {
 			Vec v;
-			v.x = valuesX[i] / 1.5 + 0.5;
-			v.y = valuesY[i] + 0.5;
+			v.x = points[i][0] / (1.5f * scaling) / 1.5 + 0.5;
+			v.y = points[i][1] / (1.5f * scaling) + 0.5;
 			Vec p;
 			p.x = rescale(v.x, 0.f, 1.f, 0, box.size.x);
 			p.y = rescale(v.y, 0.f, 1.f, box.size.y, 0);
@@ -305,19 +294,9 @@ struct RouletteScopeDisplay : TransparentWidget {
 	void draw(const DrawArgs &args) override {
 		if (!module)
 			return;
-		float valuesX[BUFFER_SIZE];
-		float valuesY[BUFFER_SIZE];
-		float scaling = module->displayScaling;
-		for (int i = 0; i < BUFFER_SIZE; i++) {
-			int j = i;
-			// Lock display to buffer if buffer update deltaTime <= 2^-11
-			j = (i + module->bufferIndex) % BUFFER_SIZE;
-			valuesX[i] = (module->bufferX1[j]) / (1.5f * scaling);
-			valuesY[i] = (module->bufferY1[j]) / (1.5f * scaling);
-		}
 
 		nvgStrokeColor(args.vg, nvgRGBA(0x9f, 0xe4, 0x36, 0xc0));
-		drawWaveform(args, valuesX, valuesY);
+		drawWaveform(args, module->scope.snapshot(), module->displayScaling);
 	}
 };
 
@@ -1,6 +1,9 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
 #include "ui/ports.hpp"
+#include "ui/menu.hpp"
+#include "dsp-lfo/controlRate.hpp"
+#include "ui/controlRateMenu.hpp"
 
 #include <ctime>
 
@@ -133,6 +136,9 @@ struct SeriouslySlowEG : Module {
 
 	bool firstStep = true;
 
+	ControlRateRamp<float> controlRate;
+	int eocCountdown = 0;
+
 	//percentages
 	float delayTimePercentage = 0;
 	float attackTimePercentage =0;
@@ -259,6 +265,25 @@ struct SeriouslySlowEG : Module {
 	}
 
 	void process(const ProcessArgs &args) override {
+		// Gate edges are checked every sample and bring the next update forward so the envelope turns on the edge
+		bool gateWasHigh = gateTrigger.isHigh();
+		bool triggered = gateTrigger.process(params[TRIGGER_PARAM].getValue() + inputs[TRIGGER_INPUT].getVoltage());
+		bool gateEdge = triggered || gateTrigger.isHigh() != gateWasHigh;
+		if (controlRate.process(gateEdge)) {
+			updateEnvelope(args, triggered, gateEdge);
+		}
+
+		outputs[ENVELOPE_OUT].setVoltage(controlRate.next());
+
+		if (eocCountdown > 0 && --eocCountdown == 0) {
+			eocPulse.trigger(1e-3);
+		}
+		float eocOutputValue = eocPulse.process(args.sampleTime) ? 10.0 : 0;
+		outputs[EOC_OUTPUT].setVoltage(eocOutputValue);
+	}
+
+	// Moves the envelope on by a whole update, controlRate.counter samples, and sets the output ramping to where it gets to
+	void updateEnvelope(const ProcessArgs &args, bool triggered, bool gateEdge) {
 
 		const float shapeExponent = 2.0;
 		const float shapeInverseExponent = 0.5;
@@ -325,7 +350,14 @@ struct SeriouslySlowEG : Module {
 		sustainLevel = clamp(params[SUSTAIN_LEVEL_PARAM].getValue() + (inputs[SUSTAIN_LEVEL_INPUT].getVoltage() / 10.0),0.0f,1.0f);
 		sustainLevelPercentage = sustainLevel;
 
-		if (gateTrigger.process(params[TRIGGER_PARAM].getValue() + inputs[TRIGGER_INPUT].getVoltage()))
+		double samples = controlRate.counter;
+
+		if (gateEdge && !controlRate.jumpPending) {
+			// The envelope was already worked out to the end of the last update, so start from where the output has got to
+			envelope = controlRate.value / 10.0;
+		}
+
+		if (triggered)
 		{
 			if (stage == STOPPED_STAGE || params[RETRIGGER_MODE_PARAM].getValue() <= 0.5) {
 				stage = DELAY_STAGE;
@@ -391,7 +423,7 @@ struct SeriouslySlowEG : Module {
 					bool holdComplete = holdProgress >= 1.0;
 					if (!holdComplete) {
 						// run the hold accumulation even if we're not in hold mode, in case we switch mid-cycle.
-						holdProgress += 1.0/holdTime;
+						holdProgress += samples/holdTime;
 						holdComplete = holdProgress >= 1.0;
 					}
 
@@ -407,6 +439,10 @@ struct SeriouslySlowEG : Module {
 			}
 		}
 
+		if (gateEdge || controlRate.jumpPending) {
+			controlRate.jump(envelope * 10.0);
+		}
+
 		bool complete = false;
 		switch (stage) {
 			case STOPPED_STAGE: {
@@ -414,7 +450,7 @@ struct SeriouslySlowEG : Module {
 			}
 
 			case DELAY_STAGE: {
-				stageProgress += 1.0 / delayTime;
+				stageProgress += samples / delayTime;
 				if (stageProgress >= 1.0) {
 					// std::time_t t = std::time(0);
 					// fprintf(stderr, "Attack Started: %s \n", std::ctime(&t));
@@ -425,7 +461,7 @@ struct SeriouslySlowEG : Module {
 			}
 
 			case ATTACK_STAGE: {
-				stageProgress += 1.0 / attackTime;
+				stageProgress += samples / attackTime;
 				switch (attackCurve) {
 					case LINEAR_SHAPE: {
 						envelope = stageProgress;
@@ -450,7 +486,7 @@ struct SeriouslySlowEG : Module {
 			}
 
 			case DECAY_STAGE: {
-				stageProgress += 1.0/decayTime;
+				stageProgress += samples/decayTime;
 				switch (decayCurve) {
 					case LINEAR_SHAPE: {
 						envelope = 1.0 - stageProgress;
@@ -481,7 +517,7 @@ struct SeriouslySlowEG : Module {
 			}
 
 			case RELEASE_STAGE: {
-				stageProgress += 1.0/releaseTime;
+				stageProgress += samples/releaseTime;
 				switch (releaseCurve) {
 					case LINEAR_SHAPE: {
 						envelope = 1.0 - stageProgress;
@@ -513,14 +549,12 @@ struct SeriouslySlowEG : Module {
 			}
 		}
 
-		float env = envelope * 10.0;
-		outputs[ENVELOPE_OUT].setVoltage(env);
+		controlRate.rampTo(envelope * 10.0);
 
+		// The ramp reaches the end of the cycle when the update does, so that's when end of cycle fires
 		if (complete) {
-			eocPulse.trigger(1e-3);
+			eocCountdown = controlRate.counter;
 		}
-		float eocOutputValue = eocPulse.process(1.0 / args.sampleRate) ? 10.0 : 0;
-		outputs[EOC_OUTPUT].setVoltage(eocOutputValue);
 
 		firstStep = false;
 	}
@@ -537,6 +571,7 @@ struct SeriouslySlowEG : Module {
 		json_object_set_new(rootJ, "attackCurve", json_integer((int) attackCurve));
 		json_object_set_new(rootJ, "decayCurve", json_integer((int) decayCurve));
 		json_object_set_new(rootJ, "releaseCurve", json_integer((int) releaseCurve));
+		json_object_set_new(rootJ, "controlRate", json_integer(controlRate.interval));
 		return rootJ;
 	}
 
@@ -566,6 +601,9 @@ struct SeriouslySlowEG : Module {
 		json_t *rcJ = json_object_get(rootJ, "releaseCurve");
 		if (rcJ)
 			releaseCurve = json_integer_value(rcJ);
+		// Patches saved before there was a choice ran every sample
+		json_t *crJ = json_object_get(rootJ, "controlRate");
+		controlRate.interval = crJ ? clamp((int) json_integer_value(crJ), 1, 256) : 1;
 
 	}
 
@@ -887,6 +925,14 @@ struct SeriouslySlowEGWidget : ModuleWidget {
 
 
 	}
+
+	void appendContextMenu(Menu *menu) override {
+		SeriouslySlowEG *module = dynamic_cast<SeriouslySlowEG*>(this->module);
+		assert(module);
+
+		menu->addChild(new MenuLabel());
+		menu->addChild(createControlRateMenuItem(&module->controlRate));
+	}
 };
 
 Model *modelSeriouslySlowEG = createModel<SeriouslySlowEG, SeriouslySlowEGWidget>("SeriouslySlowEG");
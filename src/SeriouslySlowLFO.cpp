@@ -1,5 +1,9 @@
 #include "FrozenWasteland.hpp"
 #include "ui/knobs.hpp"
+#include "ui/menu.hpp"
+#include "dsp-lfo/lowFrequencyOscillator.hpp"
+#include "dsp-lfo/controlRate.hpp"
+#include "ui/controlRateMenu.hpp"
 
 
 
@@ -38,87 +42,9 @@ struct SeriouslySlowLFO : Module {
 		NUM_LIGHTS
 	};
 
-struct LowFrequencyOscillator {
-	double basePhase = 0.0;
-	double phase = 0.0;
-	float pw = 0.5;
-	double freq = 1.0;
-	bool offset = false;
-	bool invert = false;
-	
-	LowFrequencyOscillator() {}
-	void setPitch(double pitch) {
-		pitch = fminf(pitch, 8.0);
-		freq = powf(2.0, pitch);
-	}
-	void setFrequency(double frequency) {
-		freq = frequency;
-	}
-	void setPulseWidth(float pw_) {
-		const float pwMin = 0.01;
-		pw = clamp(pw_, pwMin, 1.0f - pwMin);
-	}
-
-	void setBasePhase(double initialPhase) {
-		//Apply change, then remember
-		phase += initialPhase - basePhase;
-		if (phase >= 1.0)
-			phase -= 1.0;
-		else if (phase < 0)
-			phase += 1.0;	
-		basePhase = initialPhase;
-	}	
-
-	
-	void hardReset()
-	{
-		phase = basePhase;
-	}
-
-	void step(double dt) {
-		//float deltaPhase = fminf(freq * dt, 0.5);
-		double deltaPhase = freq * dt;
-		phase += deltaPhase;
-		if (phase >= 1.0)
-			phase -= 1.0;
-	}
-	float sin() {
-		if (offset)
-			return 1.0 - cosf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-		else
-			return sinf(2*M_PI * phase) * (invert ? -1.0 : 1.0);
-	}
-	float tri(double x) {
-		return 4.0 * fabsf(x - roundf(x));
-	}
-	float tri() {
-		if (offset)
-			return tri(invert ? phase - 0.5 : phase);
-		else
-			return -1.0 + tri(invert ? phase - 0.25 : phase - 0.75);
-	}
-	float saw(double x) {
-		return 2.0 * (x - roundf(x));
-	}
-	float saw() {
-		if (offset)
-			return invert ? 2.0 * (1.0 - phase) : 2.0 * phase;
-		else
-			return saw(phase) * (invert ? -1.0 : 1.0);
-	}
-	float sqr() {
-		float sqr = (phase < pw) ^ invert ? 1.0 : -1.0;
-		return offset ? sqr + 1.0 : sqr;
-	}
-	double progress() {
-		return phase;
-	}
-};
-
-
-
-
-	LowFrequencyOscillator oscillator;
+	LowFrequencyOscillator<double> oscillator;
+	// Sine, triangle, saw and square in one lane each
+	ControlRateRamp<simd::float_4> controlRate;
 	dsp::SchmittTrigger timeBaseTrigger[5], quantizePhaseTrigger, resetTrigger;
 	
 	double duration = 0.0;
@@ -167,88 +93,101 @@ struct LowFrequencyOscillator {
 		// 	oscillator.hardReset();
 		// }
 
-		for(int timeIndex = 0;timeIndex<5;timeIndex++)
-		{	
-			if (timeBaseTrigger[timeIndex].process(params[TIME_BASE_PARAM+timeIndex].getValue())) {
-				timeBase = timeIndex;
-				oscillator.hardReset();
+		// Reset is checked every sample and brings the next update forward so the outputs jump on the edge
+		bool reset = resetTrigger.process(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage());
+		if (controlRate.process(reset)) {
+			for(int timeIndex = 0;timeIndex<5;timeIndex++)
+			{	
+				if (timeBaseTrigger[timeIndex].process(params[TIME_BASE_PARAM+timeIndex].getValue())) {
+					timeBase = timeIndex;
+					reset = true;
+				}
 			}
-		}
-
-		if(resetTrigger.process(params[RESET_PARAM].getValue() + inputs[RESET_INPUT].getVoltage())) {
-			oscillator.hardReset();
-		}
 
-		double numberOfSeconds = 0;
-		switch(timeBase) {
-			case 0 :
-				numberOfSeconds = 60; // Minutes
-				break;
-			case 1 :
-				numberOfSeconds = 3600; // Hours
-				break;
-			case 2 :
-				numberOfSeconds = 86400; // Days
-				break;
-			case 3 :
-				numberOfSeconds = 604800; // Weeks
-				break;
-			case 4 :
-				numberOfSeconds = 2592000; // Months
-				break;
-		}
-
-		duration = params[DURATION_PARAM].getValue();
-		if(inputs[FM_INPUT].isConnected()) {
-			duration +=inputs[FM_INPUT].getVoltage() * params[FM_CV_ATTENUVERTER_PARAM].getValue();
-		}
-		duration = clamp(duration,1.0f,100.0f);
-		durationPercentage = duration / 100.0;
+			if(reset) {
+				oscillator.hardReset();
+			}
 
-		oscillator.setFrequency(1.0 / (duration * numberOfSeconds));
+			double numberOfSeconds = 0;
+			switch(timeBase) {
+				case 0 :
+					numberOfSeconds = 60; // Minutes
+					break;
+				case 1 :
+					numberOfSeconds = 3600; // Hours
+					break;
+				case 2 :
+					numberOfSeconds = 86400; // Days
+					break;
+				case 3 :
+					numberOfSeconds = 604800; // Weeks
+					break;
+				case 4 :
+					numberOfSeconds = 2592000; // Months
+					break;
+			}
 
-		if (quantizePhaseTrigger.process(params[QUANTIZE_PHASE_PARAM].getValue())) {
-			phase_quantized = !phase_quantized;
-		}
-		lights[QUANTIZE_PHASE_LIGHT].value = phase_quantized;
+			duration = params[DURATION_PARAM].getValue();
+			if(inputs[FM_INPUT].isConnected()) {
+				duration +=inputs[FM_INPUT].getVoltage() * params[FM_CV_ATTENUVERTER_PARAM].getValue();
+			}
+			duration = clamp(duration,1.0f,100.0f);
+			durationPercentage = duration / 100.0;
 
-		initialPhase = params[PHASE_PARAM].getValue();
-		if(inputs[PHASE_INPUT].isConnected()) {
-			initialPhase += (inputs[PHASE_INPUT].getVoltage() / 10 * params[PHASE_CV_ATTENUVERTER_PARAM].getValue());
-		}
-		if (initialPhase >= 1.0)
-			initialPhase -= 1.0;
-		else if (initialPhase < 0)
-			initialPhase += 1.0;	
-		phasePercentage = initialPhase; 			
-		if(phase_quantized) // Limit to 90 degree increments
-			initialPhase = std::round(initialPhase * 4.0f) / 4.0f;
+			oscillator.setFrequency(1.0 / (duration * numberOfSeconds));
 
-		
-		oscillator.offset = (params[OFFSET_PARAM].getValue() > 0.0);
-		oscillator.setBasePhase(initialPhase);
+			if (quantizePhaseTrigger.process(params[QUANTIZE_PHASE_PARAM].getValue())) {
+				phase_quantized = !phase_quantized;
+			}
+			lights[QUANTIZE_PHASE_LIGHT].value = phase_quantized;
 
-		//sr= args.sampleRate / 1000; // Test Code
-		oscillator.step(args.sampleTime);
+			initialPhase = params[PHASE_PARAM].getValue();
+			if(inputs[PHASE_INPUT].isConnected()) {
+				initialPhase += (inputs[PHASE_INPUT].getVoltage() / 10 * params[PHASE_CV_ATTENUVERTER_PARAM].getValue());
+			}
+			if (initialPhase >= 1.0)
+				initialPhase -= 1.0;
+			else if (initialPhase < 0)
+				initialPhase += 1.0;	
+			phasePercentage = initialPhase; 			
+			if(phase_quantized) // Limit to 90 degree increments
+				initialPhase = std::round(initialPhase * 4.0f) / 4.0f;
+
+			
+			oscillator.offset = (params[OFFSET_PARAM].getValue() > 0.0);
+			oscillator.setBasePhase(initialPhase);
+
+			if(reset || controlRate.jumpPending) {
+				controlRate.jump(waveValues());
+			}
 
-		        //fprintf(stderr, "sample time %f \n",args.sampleTime);
+			//sr= args.sampleRate / 1000; // Test Code
+			oscillator.step(controlRate.counter * args.sampleTime);
+			controlRate.rampTo(waveValues());
 
+			for(int lightIndex = 0;lightIndex<5;lightIndex++)
+			{
+				lights[lightIndex].value = lightIndex != timeBase ? 0.0 : 1.0;
+			}
+		}
 
-		outputs[SIN_OUTPUT].setVoltage(5.0 * oscillator.sin());
-		outputs[TRI_OUTPUT].setVoltage(5.0 * oscillator.tri());
-		outputs[SAW_OUTPUT].setVoltage(5.0 * oscillator.saw());
-		outputs[SQR_OUTPUT].setVoltage( 5.0 * oscillator.sqr());
+		simd::float_4 waves = controlRate.next();
+		outputs[SIN_OUTPUT].setVoltage(waves[0]);
+		outputs[TRI_OUTPUT].setVoltage(waves[1]);
+		outputs[SAW_OUTPUT].setVoltage(waves[2]);
+		outputs[SQR_OUTPUT].setVoltage(waves[3]);
+	}
 
-		for(int lightIndex = 0;lightIndex<5;lightIndex++)
-		{
-			lights[lightIndex].value = lightIndex != timeBase ? 0.0 : 1.0;
-		}
+	// Sine, triangle, saw and square at the oscillator's current phase
+	simd::float_4 waveValues() {
+		return simd::float_4(5.0 * oscillator.sin(), 5.0 * oscillator.tri(), 5.0 * oscillator.saw(), 5.0 * oscillator.sqr());
 	}
 
 
 	json_t *dataToJson() override {
 		json_t *rootJ = json_object();
 		json_object_set_new(rootJ, "timeBase", json_integer((int) timeBase));
+		json_object_set_new(rootJ, "controlRate", json_integer(controlRate.interval));
 		return rootJ;
 	}
 
@@ -256,6 +195,9 @@ struct LowFrequencyOscillator {
 		json_t *sumJ = json_object_get(rootJ, "timeBase");
 		if (sumJ)
 			timeBase = json_integer_value(sumJ);
+		// Patches saved before there was a choice ran every sample
+		json_t *crJ = json_object_get(rootJ, "controlRate");
+		controlRate.interval = crJ ? clamp((int) json_integer_value(crJ), 1, 256) : 1;
 	}
 
 	// void reset() override {
@@ -389,6 +331,14 @@ struct SeriouslySlowLFOWidget : ModuleWidget {
 
 		addChild(createLight<LargeLight<BlueLight>>(Vec(59.5, 185.5), module, SeriouslySlowLFO::QUANTIZE_PHASE_LIGHT));
 	}
+
+	void appendContextMenu(Menu *menu) override {
+		SeriouslySlowLFO *module = dynamic_cast<SeriouslySlowLFO*>(this->module);
+		assert(module);
+
+		menu->addChild(new MenuLabel());
+		menu->addChild(createControlRateMenuItem(&module->controlRate));
+	}
 };
 
 Model *modelSeriouslySlowLFO = createModel<SeriouslySlowLFO, SeriouslySlowLFOWidget>("SeriouslySlowLFO");
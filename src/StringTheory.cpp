@@ -6,10 +6,69 @@
 #include "filters/Compressor.hpp"
 
 using namespace frozenwasteland::dsp;
+using simd::float_4;
 
 #define HISTORY_SIZE (1<<21)
 #define MAX_GRAINS 8
+#define MAX_VOICES 16
 #define GRAIN_SPACING 256 //This will undoubtably become a parameter
+#define MAX_STRING_TIME 0.52f // coarse (0.5s) + fine (20ms)
+#define MAX_SAMPLE_ADJUST 200
+#define PITCH_HEADROOM 2.0f // room for a V/Oct of -1, lower notes are held at the end of the line
+#define GRAIN_GROUPS (MAX_GRAINS / 4)
+#define COLOR_CONTROL_RATE 16 // samples between color coefficient updates
+#define COLOR_SMOOTHING 0.25f // how far each update moves toward the color knob/CV
+
+// The lowpass/highpass color pair for every grain of a voice, four grains per float_4. Same one-pole as dsp::RCFilter,
+// with 1/(1+c) and (1-c)/(1+c) worked out ahead of time as a gain and a feedback term
+struct STColorFilterBank {
+	float_4 lowpassX[GRAIN_GROUPS];
+	float_4 lowpassY[GRAIN_GROUPS];
+	float_4 highpassX[GRAIN_GROUPS];
+	float_4 highpassY[GRAIN_GROUPS];
+
+	STColorFilterBank() {
+		for(int g=0;g<GRAIN_GROUPS;g++) {
+			lowpassX[g] = 0.f;
+			lowpassY[g] = 0.f;
+			highpassX[g] = 0.f;
+			highpassY[g] = 0.f;
+		}
+	}
+
+	// Filters wet in place. Grains whose active flag is 0 are left alone, state and all
+	void process(float *wet, const float *active, float lowpassGain, float lowpassFeedback, float highpassGain, float highpassFeedback) {
+		for(int g=0;g<GRAIN_GROUPS;g++) {
+			float_4 in = float_4::load(wet + g * 4);
+			float_4 mask = float_4::load(active + g * 4) > 0.f;
+
+			float_4 lowpass = (in + lowpassX[g]) * lowpassGain - lowpassY[g] * lowpassFeedback;
+			float_4 highpassState = (lowpass + highpassX[g]) * highpassGain - highpassY[g] * highpassFeedback;
+
+			lowpassX[g] = simd::ifelse(mask, in, lowpassX[g]);
+			lowpassY[g] = simd::ifelse(mask, lowpass, lowpassY[g]);
+			highpassX[g] = simd::ifelse(mask, lowpass, highpassX[g]);
+			highpassY[g] = simd::ifelse(mask, highpassState, highpassY[g]);
+
+			simd::ifelse(mask, lowpass - highpassState, in).store(wet + g * 4);
+		}
+	}
+};
+
+// Grain state for one plucked voice. Each array holds a lane per grain so a voice's grains line up as float_4s
+struct STVoice {
+	//Consider Changing to FloatFrame to make this stereo
+	DelayLine<float> delayLine[MAX_GRAINS];
+	Compressor compressor[MAX_GRAINS];
+	STColorFilterBank colorFilter;
+	dsp::SchmittTrigger pluckTrigger;
+
+	float lastWet[MAX_GRAINS] = {0.f};
+	float individualWet[MAX_GRAINS] = {0.f};
+	float timeDelay[MAX_GRAINS] = {0.0};
+	float timeElapsed[MAX_GRAINS] = {0.0};
+	bool acceptingInput[MAX_GRAINS] = {false}; //If true, means pluck has been activated and will accept input 
+};
 
 struct StringTheory : Module {
 	enum ParamIds {
@@ -88,26 +147,19 @@ struct StringTheory : Module {
 	// dsp::DoubleRingBuffer<float, 16> outBuffer[MAX_GRAINS];
 	// SRC_STATE *src[MAX_GRAINS];
 
-	//Consider Changing to FloatFrame to make this stereo
-	DelayLine<float> delayLine[MAX_GRAINS];
-
-	dsp::RCFilter lowpassFilter;
-	dsp::RCFilter highpassFilter;
+	// Every grain of every voice gets its own line in one pool, sized from the sample rate in allocateDelayLines
+	DelayLinePool<float> delayPool;
+	STVoice voices[MAX_VOICES];
 
 	WhiteNoiseGenerator _whiteNoise;
 	PinkNoiseGenerator _pinkNoise;
 	GaussianNoiseGenerator _gaussianNoise;
 
-	Compressor compressor[MAX_GRAINS];
+	dsp::ClockDivider colorDivider;
 
-	dsp::SchmittTrigger pluckTrigger, noiseTypeTrigger,windowFunctionTrigger,compressionModeTrigger;
+	dsp::SchmittTrigger noiseTypeTrigger,windowFunctionTrigger,compressionModeTrigger;
 
-	float lastDelayTime = -1;
-	float lastWet[MAX_GRAINS] = {0.f};
-	float individualWet[MAX_GRAINS] = {0.f};
-	bool acceptingInput[MAX_GRAINS]; //If true, means pluck has been activated and will accept input 
-	float timeDelay[MAX_GRAINS] = {0.0};
-	float timeElapsed[MAX_GRAINS] = {0.0};
+	int voiceCount = 0;
 	int noiseType = WHITE_NOISE;
 	int windowFunction = NO_WINDOW_FUNCTION;
 	int grainCount = MAX_GRAINS;
@@ -115,6 +167,13 @@ struct StringTheory : Module {
 
 	float sampleRate;
 
+	// Color only moves the filter coefficients when the smoothed knob/CV does
+	float smoothedColor = 0.5f;
+	float lowpassGain = 0.f;
+	float lowpassFeedback = 0.f;
+	float highpassGain = 0.f;
+	float highpassFeedback = 0.f;
+
 	//percentages
 	float coarseTimenPercentage = 0;
 	float fineTimePercentage = 0;
@@ -131,26 +190,28 @@ struct StringTheory : Module {
 	void changeCompressionMode (uint8_t newMode) {
 		if (newMode == COMPRESSION_HARD) {
 			// reset to hard compression
-			for(int i=0;i<MAX_GRAINS;i++) {
-				compressor[i].setCoefficients(1.0f, 30.0f, 5.0f, 20.0f, sampleRate);
+			for(int c=0;c<MAX_VOICES;c++) {
+				for(int i=0;i<MAX_GRAINS;i++) {
+					voices[c].compressor[i].setCoefficients(1.0f, 30.0f, 5.0f, 20.0f, sampleRate);
+				}
 			}
 		}
 
 		// compressionMode = newMode;
 	}
 
-	inline float limit (float in, int which) {
+	inline float limit (float in, Compressor &compressor) {
 		if (compressionMode == COMPRESSION_NONE) {
 			return in;
 		} else if (compressionMode == COMPRESSION_CLAMP) {
 			return clamp(in, -6.0f, 6.0f);
 		} else if (compressionMode == COMPRESSION_HARD) {
-			return compressor[which].process(in);
+			return compressor.process(in);
 		} else {
 			// adaptive compression	
 			float ratio = fabs(in) / 4.0f;
-			compressor[which].setCoefficients(1.0f, 30.0f, 5.0f, ratio, sampleRate);
-			return compressor[which].process(in);
+			compressor.setCoefficients(1.0f, 30.0f, 5.0f, ratio, sampleRate);
+			return compressor.process(in);
 		}
 	}
 
@@ -169,6 +230,32 @@ struct StringTheory : Module {
 	float lerp(float v0, float v1, float t) {
 		return (1 - t) * v0 + t * v1;
 	}
+
+	void setColorCoefficients(float color) {
+		float colorFreq = std::pow(100.f, 2.f * color - 1.f);
+		float lowpassFreq = clamp(20000.f * colorFreq, 20.f, 20000.f);
+		float highpassFreq = clamp(20.f * colorFreq, 20.f, 20000.f);
+
+		// Same cutoffs the shared RCFilters got - setCutoffFreq for the lowpass, setCutoff for the highpass
+		float lowpassC = 2.f / (2.f * M_PI * lowpassFreq / sampleRate);
+		float highpassC = 2.f / (highpassFreq / sampleRate);
+		lowpassGain = 1.f / (1.f + lowpassC);
+		lowpassFeedback = (1.f - lowpassC) * lowpassGain;
+		highpassGain = 1.f / (1.f + highpassC);
+		highpassFeedback = (1.f - highpassC) * highpassGain;
+	}
+
+	void allocateDelayLines(float sampleRate) {
+		this->sampleRate = sampleRate;
+		int maxDelay = int(std::ceil(sampleRate * MAX_STRING_TIME * PITCH_HEADROOM)) + MAX_SAMPLE_ADJUST;
+		delayPool.allocate(MAX_VOICES * MAX_GRAINS, maxDelay);
+		for(int c=0;c<MAX_VOICES;c++) {
+			for(int i=0;i<MAX_GRAINS;i++) {
+				delayPool.attach(voices[c].delayLine[i], c * MAX_GRAINS + i);
+			}
+		}
+		setColorCoefficients(smoothedColor);
+	}
 	
 
 	StringTheory() {
@@ -210,7 +297,12 @@ struct StringTheory : Module {
 		configOutput(OUT_OUTPUT, "String");
 		configOutput(FB_SEND_OUTPUT, "Feedback Send");
 
+		colorDivider.setDivision(COLOR_CONTROL_RATE);
+		allocateDelayLines(APP->engine->getSampleRate());
+	}
 
+	void onSampleRateChange() override {
+		allocateDelayLines(APP->engine->getSampleRate());
 	}
 
 
@@ -247,8 +339,6 @@ struct StringTheory : Module {
 	void process(const ProcessArgs &args) override {
 		
 
-		sampleRate = args.sampleRate;
-
 		grainCount = params[GRAIN_COUNT_PARAM].getValue();
 
 		// Compute delay time in seconds - eventually milliseconds
@@ -264,27 +354,11 @@ struct StringTheory : Module {
 		// Number of delay samples
 		float delay = coarseDelay + fineDelay;
 
-		float pitch = inputs[V_OCT_INPUT].getVoltage();
-		delay = delay / std::pow(2.0f, pitch);
-
-		float sampleAdjust = clamp(params[SAMPLE_TIME_PARAM].getValue() + (inputs[SAMPLE_TIME_INPUT].getVoltage() * 20.0),0.0f,200.0f);
+		float sampleAdjust = clamp(params[SAMPLE_TIME_PARAM].getValue() + (inputs[SAMPLE_TIME_INPUT].getVoltage() * 20.0),0.0f,(float)MAX_SAMPLE_ADJUST);
 		sampleTimePercentage = sampleAdjust / 200.0;
 
-		float index = (delay * sampleRate) + sampleAdjust; // Maybe get rid of rounding
-
-		float pluckInput = params[PLUCK_PARAM].getValue();
-		if(inputs[PLUCK_INPUT].isConnected()) {
-			pluckInput += inputs[PLUCK_INPUT].getVoltage();
-		} 
 		float phaseOffset = clamp(params[PHASE_OFFSET_PARAM].getValue() + inputs[PHASE_OFFSET_INPUT].getVoltage() / 10.0f,0.0f,1.0f);
 		phaseOffsetPercentage = phaseOffset;
-		if(pluckTrigger.process(pluckInput)) {
-			for(int i=0; i<grainCount;i++) {
-				acceptingInput[i] = true;
-				timeElapsed[i] = 0.0;
-				timeDelay[i] = ((float) i) * index / 2.0 * phaseOffset;
-			}
-		}	
 
 		if(noiseTypeTrigger.process(params[NOISE_TYPE_PARAM].getValue())) {
 			noiseType = (noiseType + 1) % NUM_NOISE_TYPES;
@@ -377,107 +451,148 @@ struct StringTheory : Module {
 
 		float spread = clamp(params[SPREAD_PARAM].getValue() + inputs[SPREAD_INPUT].getVoltage() / 10.0f,0.0f,1.0f);
 		spreadPercentage = spread;
-		for(int i=0; i<grainCount;i++) {
-			timeDelay[i] -= 1.0;
-			if(timeDelay[i] > 0)
-				continue;
-
-			timeElapsed[i] += 1.0;
-			if(timeElapsed[i] > index * (1.0 + (float)i / (float)grainCount * spread)) {
-				acceptingInput[i] = false;
+		// Each V/Oct or pluck channel is a voice plucking its own set of grains
+		int channels = std::max(std::max(inputs[V_OCT_INPUT].getChannels(), inputs[PLUCK_INPUT].getChannels()), 1);
+		for(int c = voiceCount; c < channels; c++) {
+			for(int i=0; i<MAX_GRAINS;i++) {
+				voices[c].lastWet[i] = 0.0f;
+				voices[c].acceptingInput[i] = false;
+			}
+		}
+		voiceCount = channels;
+
+		if(colorDivider.process()) {
+			float color = params[COLOR_PARAM].getValue() + inputs[COLOR_INPUT].getVoltage() / 10.f;
+			color = clamp(color, 0.f, 1.f);
+			colorPercentage = color;
+			if(color != smoothedColor) {
+				smoothedColor += (color - smoothedColor) * COLOR_SMOOTHING;
+				if(std::fabs(color - smoothedColor) < 1e-4f) {
+					smoothedColor = color;
+				}
+				setColorCoefficients(smoothedColor);
 			}
+		}
+
+		// Feedback send/return carry every grain of as many voices as fit in one cable, voice by voice
+		int feedbackChannels = std::min(channels * grainCount, PORT_MAX_CHANNELS);
+		float maxIndex = delayPool.getMaxDelaySize();
+
+		for(int c = 0; c < channels; c++) {
+			STVoice &voice = voices[c];
+
+			float pitch = inputs[V_OCT_INPUT].getPolyVoltage(c);
+			float index = std::fmin((delay / std::pow(2.0f, pitch) * sampleRate) + sampleAdjust, maxIndex); // Maybe get rid of rounding
+
+			float pluckInput = params[PLUCK_PARAM].getValue();
+			if(inputs[PLUCK_INPUT].isConnected()) {
+				pluckInput += inputs[PLUCK_INPUT].getPolyVoltage(c);
+			} 
+			if(voice.pluckTrigger.process(pluckInput)) {
+				for(int i=0; i<grainCount;i++) {
+					voice.acceptingInput[i] = true;
+					voice.timeElapsed[i] = 0.0;
+					voice.timeDelay[i] = ((float) i) * index / 2.0 * phaseOffset;
+				}
+			}	
+
+			float grainActive[MAX_GRAINS] = {0.f};
+			for(int i=0; i<grainCount;i++) {
+				voice.timeDelay[i] -= 1.0;
+				if(voice.timeDelay[i] > 0)
+					continue;
+				grainActive[i] = 1.f;
+
+				voice.timeElapsed[i] += 1.0;
+				if(voice.timeElapsed[i] > index * (1.0 + (float)i / (float)grainCount * spread)) {
+					voice.acceptingInput[i] = false;
+				}
 
-			// if(lastDelayTime != index) {
-			// 	delayLine[i].setDelayTime(index);
-			// }
-
-
-			float in = 0.0;
-			if(acceptingInput[i]) {
-				float phase = timeElapsed[i] / index;
-				// Get input to delay block
-				if(inputs[IN_INPUT].isConnected()) {
-					in = inputs[IN_INPUT].getVoltage();
-				} else {
-					switch(noiseType) {
-						case WHITE_NOISE :
-							in = _whiteNoise.next() * 5.0f;
+				float in = 0.0;
+				if(voice.acceptingInput[i]) {
+					float phase = voice.timeElapsed[i] / index;
+					// Get input to delay block
+					if(inputs[IN_INPUT].isConnected()) {
+						in = inputs[IN_INPUT].getPolyVoltage(c);
+					} else {
+						switch(noiseType) {
+							case WHITE_NOISE :
+								in = _whiteNoise.next() * 5.0f;
+								break;
+							case PINK_NOISE :
+								in = _pinkNoise.next() * 5.0f;
+								break;
+							case GAUSSIAN_NOISE :
+								in = _gaussianNoise.next() * 5.0f;
+								break;
+						}
+					}
+					switch (windowFunction) {
+						case NO_WINDOW_FUNCTION :
 							break;
-						case PINK_NOISE :
-							in = _pinkNoise.next() * 5.0f;
+						case HANNING_WINDOW_FUNCTION :
+							in = in * HanningWindow(phase);
 							break;
-						case GAUSSIAN_NOISE :
-							in = _gaussianNoise.next() * 5.0f;
+						case BLACKMAN_WINDOW_FUNCTION :
+							in = in * BlackmanWindow(phase);
 							break;
 					}
 				}
-				switch (windowFunction) {
-					case NO_WINDOW_FUNCTION :
-						break;
-					case HANNING_WINDOW_FUNCTION :
-						in = in * HanningWindow(phase);
-						break;
-					case BLACKMAN_WINDOW_FUNCTION :
-						in = in * BlackmanWindow(phase);
-						break;
-				}
-			}
 
-			float dry = clamp(in + lastWet[i] * feedback,-10.0,10.0);
+				float dry = clamp(in + voice.lastWet[i] * feedback,-10.0,10.0);
 
-			// Push dry sample into history buffer
-			delayLine[i].write(dry);
-		
-			//individualWet[i] = delayLine[i].getDelay();
-			individualWet[i] = delayLine[i].getLangrangeInterpolatedDelay(index);
-		
-			if(i < ringModGrain) {
-				float ringModdedValue = ringModIn * individualWet[i] / 5.0f;
-				individualWet[i] = lerp(individualWet[i], ringModdedValue, ringModMix);
+				// Push dry sample into history buffer
+				voice.delayLine[i].write(dry);
 			}
 
-			outputs[FB_SEND_OUTPUT].setVoltage(individualWet[i],i);
+			// Every grain of a voice reads the same delay, so they're interpolated together. Grains still waiting on their
+			// phase offset don't advance and keep their last value
+			float wetRead[MAX_GRAINS];
+			DelayLine<float>::getLangrangeInterpolatedDelays(voice.delayLine, MAX_GRAINS, index, wetRead);
 
-			if(inputs[FB_RETURN_INPUT].isConnected()) {
-				individualWet[i] = clamp(inputs[FB_RETURN_INPUT].getPolyVoltage(i),-10.0,10.0);	
-			}
-
-			//Apply compression
-			individualWet[i] = limit(individualWet[i],i);
+			for(int i=0; i<grainCount;i++) {
+				if(grainActive[i] == 0.f)
+					continue;
 
-			// Apply color to delay wet output
-			float color = params[COLOR_PARAM].getValue() + inputs[COLOR_INPUT].getVoltage() / 10.f;
-			color = clamp(color, 0.f, 1.f);
-			colorPercentage = color;
-			float colorFreq = std::pow(100.f, 2.f * color - 1.f);
+				voice.individualWet[i] = wetRead[i];
+			
+				if(i < ringModGrain) {
+					float ringModdedValue = ringModIn * voice.individualWet[i] / 5.0f;
+					voice.individualWet[i] = lerp(voice.individualWet[i], ringModdedValue, ringModMix);
+				}
 
-			float lowpassFreq = clamp(20000.f * colorFreq, 20.f, 20000.f);
-			lowpassFilter.setCutoffFreq(lowpassFreq / sampleRate);
-			lowpassFilter.process(individualWet[i]);
-			individualWet[i] = lowpassFilter.lowpass();
+				int feedbackChannel = c * grainCount + i;
+				if(feedbackChannel < feedbackChannels) {
+					outputs[FB_SEND_OUTPUT].setVoltage(voice.individualWet[i],feedbackChannel);
 
-			float highpassFreq = clamp(20.f * colorFreq, 20.f, 20000.f);
-			highpassFilter.setCutoff(highpassFreq / sampleRate);
-			highpassFilter.process(individualWet[i]);
-			individualWet[i] = highpassFilter.highpass();
-			
-		}
+					if(inputs[FB_RETURN_INPUT].isConnected()) {
+						voice.individualWet[i] = clamp(inputs[FB_RETURN_INPUT].getPolyVoltage(feedbackChannel),-10.0,10.0);	
+					}
+				}
 
-		lastDelayTime = index;
+				//Apply compression
+				voice.individualWet[i] = limit(voice.individualWet[i],voice.compressor[i]);
+			}
 
-		float wet = 0.f;
-		for(int i= 0; i<grainCount;i++) {
-			lastWet[i] = individualWet[(i + feedBackShift) % grainCount];
-			if(i < ringModGrain) {
-				float ringModdedValue = ringModIn * individualWet[i] / 5.0f;
-				individualWet[i] = lerp(individualWet[i], ringModdedValue, ringModMix);
+			// Apply color to delay wet output
+			voice.colorFilter.process(voice.individualWet, grainActive, lowpassGain, lowpassFeedback, highpassGain, highpassFeedback);
+
+			float wet = 0.f;
+			for(int i= 0; i<grainCount;i++) {
+				voice.lastWet[i] = voice.individualWet[(i + feedBackShift) % grainCount];
+				if(i < ringModGrain) {
+					float ringModdedValue = ringModIn * voice.individualWet[i] / 5.0f;
+					voice.individualWet[i] = lerp(voice.individualWet[i], ringModdedValue, ringModMix);
+				}
+				wet += voice.individualWet[i];
 			}
-			wet += individualWet[i];
+			wet = wet / std::sqrt((float)grainCount); //RMS 
+
+			outputs[OUT_OUTPUT].setVoltage(wet, c);
 		}
-		wet = wet / std::sqrt((float)grainCount); //RMS 
 		
-		outputs[FB_SEND_OUTPUT].setChannels(grainCount);
-		outputs[OUT_OUTPUT].setVoltage(wet);
+		outputs[FB_SEND_OUTPUT].setChannels(feedbackChannels);
+		outputs[OUT_OUTPUT].setChannels(channels);
 	}
 };
 
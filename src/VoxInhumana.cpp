@@ -5,6 +5,7 @@
 using namespace std;
 
 #define BANDS 5
+#define MAX_POLY_GROUPS 4 // 16 channels as float_4s
 
 struct VoxInhumana : Module {
 	typedef float T;
@@ -71,8 +72,9 @@ struct VoxInhumana : Module {
 		NUM_LIGHTS
 	};
 	
-	StateVariableFilterState<T> filterStates[BANDS * 2];
-    StateVariableFilterParams<T> filterParams[BANDS * 2];
+	// Channel c is lane c%4 of group c/4, every channel and both slopes share the band's coefficients
+	StateVariableFilterState<simd::float_4> filterStates[BANDS * 2][MAX_POLY_GROUPS];
+	StateVariableFilterParams<simd::float_4> filterParams[BANDS];
 	
 	float freq[BANDS] = {0};
 	float lastFreq[BANDS] = {0};
@@ -82,6 +84,9 @@ struct VoxInhumana : Module {
 	float lastQ[BANDS] = {0};
 
 	float peak[BANDS] = {0};
+	float lastPeak[BANDS] = {0};
+	float peakGain[BANDS] = {1,1,1,1,1}; // peak in linear terms, only worked out when the peak moves
+	float attenuation[BANDS] = {0};
 
 	bool twelveDbSlope[BANDS] = {false};
 
@@ -207,10 +212,9 @@ struct VoxInhumana : Module {
 
 		configOutput(VOX_OUTPUT, "Vox");
 
-		for (int i = 0; i < BANDS * 2; ++i) {
-			filterParams[i].setMode(StateVariableFilterParams<T>::Mode::BandPass);
-			filterParams[i].setQ(5); 	
-	        filterParams[i].setFreq(T(.1));
+		for (int i = 0; i < BANDS; ++i) {
+			filterParams[i].setQ(simd::float_4(5)); 	
+	        filterParams[i].setFreq(simd::float_4(.1));
 	    }
 
 		onReset();
@@ -228,8 +232,6 @@ struct VoxInhumana : Module {
 	
 	void process(const ProcessArgs &args) override {
 	
-		float signalIn = inputs[SIGNAL_IN].getVoltage()/5.0f;
-		
 
 		vowel1 = (int)clamp(params[VOWEL_1_PARAM].getValue() + (inputs[VOWEL_1_CV_IN].getVoltage() * params[VOWEL_1_ATTENUVERTER_PARAM].getValue()),0.0f,4.0f);
 		vowel1Percentage = vowel1 / 4.0;
@@ -275,37 +277,40 @@ struct VoxInhumana : Module {
 
 			if(freq[i] != lastFreq[i]) {	
 				float Fc = freq[i] / args.sampleRate;
-				filterParams[i].setFreq(T(Fc));
-				filterParams[BANDS + i].setFreq(T(Fc));
+				filterParams[i].setFreq(simd::float_4(Fc));
 				lastFreq[i] = freq[i];
 			}
 			float newQ = Q[i] + expanderQ[i];
 			if(newQ != lastQ[i]) {
-				filterParams[i].setQ(newQ); 
-				filterParams[BANDS + i].setQ(newQ); 
+				filterParams[i].setQ(simd::float_4(newQ)); 
 				lastQ[i] = newQ;
 			}		
-		}
+			if(peak[i] != lastPeak[i]) {
+				peakGain[i] = powf(10,peak[i] / 20.0f);
+				lastPeak[i] = peak[i];
+			}
 
-		float out = 0.0f;	
-		for(int i=0;i<BANDS;i++) {
-			float lastFilterOut;
-			float firstFilterOut = StateVariableFilter<T>::run(signalIn, filterStates[i], filterParams[i]);
-			if(twelveDbSlope[i]) { //Engage second filter
-				lastFilterOut = StateVariableFilter<T>::run(firstFilterOut, filterStates[BANDS + i], filterParams[BANDS + i]);
-			} else {
-				lastFilterOut = firstFilterOut;
-			} 
-
-			float attenuation = powf(10,peak[i] / 20.0f);
 			float manualAttenuation = clamp(params[AMP_1_PARAM+i].getValue() + inputs[AMP_1_INPUT+i].getVoltage() * params[AMP_1_CV_ATTENUVERTER_PARAM+i].getValue(),0.0f,2.0f); 
 			ampPercentage[i] = manualAttenuation / 2.0;
-			attenuation = clamp(attenuation * manualAttenuation, 0.0f, 1.0f);
-			out += lastFilterOut * attenuation * 5.0f;
+			attenuation[i] = clamp(peakGain[i] * manualAttenuation, 0.0f, 1.0f);
 		}
 
+		int channels = std::max(inputs[SIGNAL_IN].getChannels(), 1);
+		for (int c = 0; c < channels; c += 4) {
+			simd::float_4 signalIn = inputs[SIGNAL_IN].getVoltageSimd<simd::float_4>(c) / 5.0f;
+
+			simd::float_4 out = 0.0f;	
+			for(int i=0;i<BANDS;i++) {
+				simd::float_4 lastFilterOut = StateVariableFilter<simd::float_4>::run<StateVariableFilterParams<simd::float_4>::Mode::BandPass>(signalIn, filterStates[i][c / 4], filterParams[i]);
+				if(twelveDbSlope[i]) { //Engage second filter
+					lastFilterOut = StateVariableFilter<simd::float_4>::run<StateVariableFilterParams<simd::float_4>::Mode::BandPass>(lastFilterOut, filterStates[BANDS + i][c / 4], filterParams[i]);
+				}
+				out += lastFilterOut * attenuation[i] * 5.0f;
+			}
 
-		outputs[VOX_OUTPUT].setVoltage(out / 5.0f);
+			outputs[VOX_OUTPUT].setVoltageSimd(out / 5.0f, c);
+		}
+		outputs[VOX_OUTPUT].setChannels(channels);
 		
 	}
 };
@@ -110,6 +110,101 @@ namespace chunkware_simple
 
 	};	// end SimpleCompRms class
 
+	//-------------------------------------------------------------
+	// compressor settings, pushed only when something changed
+	//-------------------------------------------------------------
+	class SimpleCompConfig
+	{
+	public:
+		SimpleCompConfig() : dirty_( true ) {}
+
+		// setters only flag a change, nothing is recomputed here
+		void setThresh( double dB )				{ update( threshdB_, dB ); }
+		void setRatio( double ratio )			{ update( ratio_, ratio ); }
+		void setKnee( double dB )				{ update( kneedB_, dB ); }
+		void setAttack( double ms )				{ update( attackMs_, ms ); }
+		void setRelease( double ms )			{ update( releaseMs_, ms ); }
+		void setAttackCurve( double linearity )	{ update( attackCurve_, linearity ); }
+		void setReleaseCurve( double linearity ){ update( releaseCurve_, linearity ); }
+		void setWindow( double ms )				{ update( windowMs_, ms ); }
+
+		// force the next apply(), e.g. after the compressors were reset
+		void invalidate( void ) { dirty_ = true; }
+		bool isDirty( void ) const { return dirty_; }
+
+		// push settings to both detectors if anything changed since last time
+		void apply( SimpleComp &comp, SimpleCompRms &compRms )
+		{
+			if ( !dirty_ )
+				return;
+			applyTo( comp );
+			applyTo( compRms );
+			compRms.setWindow( windowMs_ );
+			dirty_ = false;
+		}
+
+		void apply( SimpleComp &comp )
+		{
+			if ( !dirty_ )
+				return;
+			applyTo( comp );
+			dirty_ = false;
+		}
+
+		// same for one lane of a CompressorBank
+		template <typename BANK>
+		void apply( BANK &bank, int lane )
+		{
+			if ( !dirty_ )
+				return;
+			bank.setLane( lane, threshdB_, ratio_, kneedB_, attackMs_, releaseMs_, attackCurve_, releaseCurve_, windowMs_ );
+			dirty_ = false;
+		}
+
+		// or to every lane of one, e.g. one lane per voice
+		template <typename BANK>
+		void applyAll( BANK &bank )
+		{
+			if ( !dirty_ )
+				return;
+			bank.setAll( threshdB_, ratio_, kneedB_, attackMs_, releaseMs_, attackCurve_, releaseCurve_, windowMs_ );
+			dirty_ = false;
+		}
+
+	private:
+
+		void update( double &value, double newValue )
+		{
+			if ( value != newValue ) {
+				value = newValue;
+				dirty_ = true;
+			}
+		}
+
+		void applyTo( SimpleComp &comp ) const
+		{
+			comp.setThresh( threshdB_ );
+			comp.setRatio( ratio_ );
+			comp.setKnee( kneedB_ );
+			comp.setAttack( attackMs_ );
+			comp.setRelease( releaseMs_ );
+			comp.setAttackCurve( attackCurve_ );
+			comp.setReleaseCurve( releaseCurve_ );
+		}
+
+		double threshdB_ = 0.0;
+		double ratio_ = 1.0;
+		double kneedB_ = 0.0;
+		double attackMs_ = 10.0;
+		double releaseMs_ = 100.0;
+		double attackCurve_ = 0.0;
+		double releaseCurve_ = 0.0;
+		double windowMs_ = 5.0;
+
+		bool dirty_;
+
+	};	// end SimpleCompConfig class
+
 }	// end namespace chunkware_simple
 
 // include inlined process function
@@ -42,35 +42,55 @@ namespace chunkware_simple
 		sampleRate_ = sampleRate;
 		linearity_ = linearity;
 		ms_ = ms;
+		updateTc();
+		updateShape();
 	}
 
 	//-------------------------------------------------------------
 	void EnvelopeDetector::setTc( double ms )
 	{
 		assert( ms > 0.0 );
+		if ( ms == ms_ )
+			return;
 		ms_ = ms;
+		updateTc();
 	}
 
 	//-------------------------------------------------------------
 	void EnvelopeDetector::setLinearity( double linearity )
 	{
+		if ( linearity == linearity_ )
+			return;
 		linearity_ = linearity;
+		updateShape();
 	}
 
 	//-------------------------------------------------------------
 	void EnvelopeDetector::setSampleRate( double sampleRate )
 	{
 		assert( sampleRate > 0.0 );
+		if ( sampleRate == sampleRate_ )
+			return;
 		sampleRate_ = sampleRate;
+		updateTc();
 	}
 
 	//-------------------------------------------------------------
-	double EnvelopeDetector::getCoef( double delta )
+	void EnvelopeDetector::updateTc( void )
 	{
-		delta = std::min(delta,18.0);
+		tcScale_ = 1000.0 / ( ms_ * sampleRate_ );
+		flatCoef_ = exp( -tcScale_ );
+	}
+
+	//-------------------------------------------------------------
+	void EnvelopeDetector::updateShape( void )
+	{
+		// equally spaced deltas, so each entry is the last one times a fixed step
 		const double slopeContstant = 1.2;
-		double adjustment = pow(slopeContstant,linearity_ * delta); 
-		return exp( -1000.0 / ( ms_ * sampleRate_ * adjustment) );
+		double step = pow( slopeContstant, -linearity_ * MAX_DELTA / SHAPE_TABLE_SIZE );
+		shape_[ 0 ] = 1.0;
+		for ( int i = 1; i <= SHAPE_TABLE_SIZE; i++ )
+			shape_[ i ] = shape_[ i - 1 ] * step;
 	}
 
 	//-------------------------------------------------------------
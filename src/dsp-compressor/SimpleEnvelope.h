@@ -84,7 +84,28 @@ namespace chunkware_simple
 		double ms_;				// time constant in ms
 		double linearity_;      // Slope adjuster
 		double coef_;			// runtime coefficient
-		double getCoef( double delta );	// coef calculation
+
+		// coef = exp( -1000 / ( ms * sampleRate * 1.2^( linearity * delta ) ) )
+		// 1.2^( -linearity * delta ) is tabled over delta and interpolated, for |linearity| <= 1
+		// this keeps the time constant within 0.003% of the direct calculation
+		static const int SHAPE_TABLE_SIZE = 256;
+		static constexpr double MAX_DELTA = 18.0;
+		double tcScale_;		// 1000 / ( ms * sampleRate )
+		double flatCoef_;		// coef when linearity is 0
+		double shape_[ SHAPE_TABLE_SIZE + 1 ];
+
+		void updateTc( void );		// after ms or sample rate change
+		void updateShape( void );	// after linearity change
+
+		INLINE double getCoef( double delta ) {
+			if ( linearity_ == 0.0 )
+				return flatCoef_;
+			double position = std::min( delta, MAX_DELTA ) * ( SHAPE_TABLE_SIZE / MAX_DELTA );
+			int index = std::min( (int) position, SHAPE_TABLE_SIZE - 1 );
+			double frac = position - index;
+			double shape = shape_[ index ] + frac * ( shape_[ index + 1 ] - shape_[ index ] );
+			return exp( -tcScale_ * shape );
+		}
 
 	};	// end SimpleComp class
 
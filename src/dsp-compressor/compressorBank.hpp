@@ -0,0 +1,281 @@
+#pragma once
+
+#include "rack.hpp"
+#include "SimpleEnvelope.h"
+
+namespace chunkware_simple {
+
+static const float LOG2_TO_DB = 6.0205999f;		// 20 * log10( 2 )
+static const float DB_TO_LOG2 = 0.16609640f;	// log2( 10 ) / 20
+
+// log2(x) for normal x > 0. Exponent straight from the float bits, log2 of the mantissa by a degree 6 minimax
+// polynomial. Absolute error under 6e-6 across the float range, which is under 4e-5 dB once scaled to decibels
+inline simd::float_4 fastLog2(simd::float_4 x) {
+	simd::int32_4 bits = simd::int32_4::cast(x);
+	simd::float_4 exponent = simd::float_4((bits >> 23) - 127);
+	simd::float_4 t = simd::float_4::cast((bits & 0x007fffff) | 0x3f800000) - 1.f;
+	simd::float_4 q = -0.026457450f;
+	q = q * t + 0.12345149f;
+	q = q * t - 0.27953814f;
+	q = q * t + 0.45827081f;
+	q = q * t - 0.71828192f;
+	q = q * t + 1.4425531f;
+	return exponent + t * q;
+}
+
+// 2^x. Integer part straight into the float exponent, 2^fraction by a degree 5 minimax polynomial.
+// Relative error under 2e-7, x is held to the normal float range
+inline simd::float_4 fastExp2(simd::float_4 x) {
+	x = simd::fmin(simd::fmax(x, -126.f), 126.f);
+	simd::float_4 whole = simd::floor(x);
+	simd::float_4 f = x - whole;
+	simd::float_4 q = 0.0018671301f;
+	q = q * f + 0.0090170303f;
+	q = q * f + 0.055799913f;
+	q = q * f + 0.24016445f;
+	q = q * f + 0.69315131f;
+	simd::float_4 scale = simd::float_4::cast((simd::int32_4(whole) + 127) << 23);
+	return scale * (1.f + f * q);
+}
+
+inline simd::float_4 fastDB2lin(simd::float_4 dB) {
+	return fastExp2(dB * DB_TO_LOG2);
+}
+
+// N SimpleComp gain computers side by side as float_4 lanes, so every band of a multiband compressor is worked out in
+// one pass. A lane follows SimpleComp::process, or processUpward, and in RMS mode runs the SimpleCompRms averager
+// first. Single precision, with the log, exp and attack/release curve done by fastLog2/fastExp2 instead of the double
+// libm calls. The envelope stays within 0.001dB of SimpleComp's and the gain reduction within 0.02dB, except right on
+// the edge of the knee where SimpleComp's transfer function steps and the two can land either side of it. Unlike a
+// SimpleComp/SimpleCompRms pair a lane has one envelope, so switching it between peak and RMS carries the envelope over
+template <int N>
+struct CompressorBank {
+	static const int GROUPS = (N + 3) / 4;
+	static const int LANES = GROUPS * 4;
+
+	// settings, as SimpleComp takes them
+	double sampleRate = 44100.0;
+	double threshdB[LANES];
+	double ratio[LANES];
+	double kneedB[LANES];
+	double attackMs[LANES];
+	double releaseMs[LANES];
+	double attackCurve[LANES];
+	double releaseCurve[LANES];
+	double windowMs[LANES];
+	bool upward[LANES];
+
+	// per lane coefficients, loaded four at a time when a group runs
+	float thresh[LANES];
+	float halfKnee[LANES];
+	float knee[LANES];
+	float kneeSlope[LANES];		// gain reduction = kneeSlope * (env + knee/2)^2 inside the knee
+	float slope[LANES];			// gain reduction = slope * env above it
+	float attackTc[LANES];		// -1000 / ( ms * sampleRate )
+	float releaseTc[LANES];
+	float windowTc[LANES];
+	float attackStep[LANES];	// envelope step with no curve, 1 - exp( tc )
+	float releaseStep[LANES];
+	float attackShape[LANES];	// -linearity * log2( 1.2 ), the EnvelopeDetector curve
+	float releaseShape[LANES];
+	float rms[LANES];
+	float up[LANES];
+	float active[LANES];
+
+	simd::float_4 env[GROUPS];
+	simd::float_4 aveOfSqrs[GROUPS];
+	simd::float_4 gainReduction[GROUPS];
+
+	CompressorBank() {
+		for (int i = 0; i < LANES; i++) {
+			threshdB[i] = 0.0;
+			ratio[i] = 1.0;
+			kneedB[i] = 0.0;
+			attackMs[i] = 10.0;
+			releaseMs[i] = 100.0;
+			attackCurve[i] = 0.0;
+			releaseCurve[i] = 0.0;
+			windowMs[i] = 5.0;
+			upward[i] = false;
+			rms[i] = 0.f;
+			active[i] = i < N;
+			updateLane(i);
+		}
+		initRuntime();
+	}
+
+	void initRuntime() {
+		for (int g = 0; g < GROUPS; g++) {
+			env[g] = DC_OFFSET;
+			aveOfSqrs[g] = DC_OFFSET;
+			gainReduction[g] = 0.f;
+		}
+	}
+
+	void setSampleRate(double sampleRate) {
+		if (sampleRate == this->sampleRate)
+			return;
+		this->sampleRate = sampleRate;
+		for (int i = 0; i < LANES; i++) {
+			updateLane(i);
+		}
+	}
+
+	void setLane(int lane, double threshdB, double ratio, double kneedB, double attackMs, double releaseMs, double attackCurve, double releaseCurve, double windowMs) {
+		this->threshdB[lane] = threshdB;
+		this->ratio[lane] = ratio;
+		this->kneedB[lane] = kneedB;
+		this->attackMs[lane] = attackMs;
+		this->releaseMs[lane] = releaseMs;
+		this->attackCurve[lane] = attackCurve;
+		this->releaseCurve[lane] = releaseCurve;
+		this->windowMs[lane] = windowMs;
+		updateLane(lane);
+	}
+
+	// Same settings on every lane, for voices sharing one set of controls. Worked out once and copied
+	void setAll(double threshdB, double ratio, double kneedB, double attackMs, double releaseMs, double attackCurve, double releaseCurve, double windowMs) {
+		setLane(0, threshdB, ratio, kneedB, attackMs, releaseMs, attackCurve, releaseCurve, windowMs);
+		for (int i = 1; i < LANES; i++) {
+			copyLane(*this, 0, i);
+		}
+	}
+
+	// Takes one lane's settings from another bank, e.g. to run the same band for several voices
+	void copyLane(const CompressorBank &source, int lane) {
+		copyLane(source, lane, lane);
+	}
+
+	void setUpward(int lane, bool upward) {
+		if (upward == this->upward[lane])
+			return;
+		this->upward[lane] = upward;
+		updateLane(lane);
+	}
+
+	void setRms(int lane, bool rms) {
+		this->rms[lane] = rms;
+	}
+
+	// inactive lanes hold their state, like a SimpleComp that isn't being processed
+	void setActive(int lane, bool active) {
+		this->active[lane] = active;
+	}
+
+	float getGainReduction(int lane) {
+		return gainReduction[lane / 4][lane % 4];
+	}
+
+	// key is what SimpleComp::process or SimpleCompRms::process would be given, returns the gain reduction in dB
+	simd::float_4 process(int g, simd::float_4 key) {
+		simd::float_4 activeLanes = simd::float_4::load(active + g * 4) != 0.f;
+		if (!simd::movemask(activeLanes))
+			return gainReduction[g];
+		simd::float_4 rmsLanes = simd::float_4::load(rms + g * 4) != 0.f;
+		simd::float_4 upwardLanes = simd::float_4::load(up + g * 4) != 0.f;
+
+		// RMS averager, skipped when the whole group is peak detecting
+		if (simd::movemask(rmsLanes)) {
+			simd::float_4 sum = key + (float) DC_OFFSET;
+			simd::float_4 ave = aveOfSqrs[g];
+			ave += curvedStep(simd::float_4::load(windowTc + g * 4), AVERAGER_SHAPE, sum - ave) * (sum - ave);
+			aveOfSqrs[g] = simd::ifelse(rmsLanes & activeLanes, ave, aveOfSqrs[g]);
+			key = simd::ifelse(rmsLanes, simd::sqrt(ave), key);
+		}
+
+		// key to dB, then distance past the threshold
+		simd::float_4 keydB = fastLog2(simd::abs(key) + (float) DC_OFFSET) * LOG2_TO_DB;
+		simd::float_4 thresholddB = simd::float_4::load(thresh + g * 4);
+		simd::float_4 halfKneedB = simd::float_4::load(halfKnee + g * 4);
+		simd::float_4 overdB = simd::ifelse(upwardLanes, thresholddB - halfKneedB - simd::fmax(keydB, 0.f), keydB - thresholddB - halfKneedB);
+		overdB = simd::fmax(overdB, 0.f) + (float) DC_OFFSET;
+
+		// attack/release
+		simd::float_4 envdB = env[g];
+		simd::float_4 attacking = overdB > envdB;
+		simd::float_4 step = simd::ifelse(attacking, simd::float_4::load(attackStep + g * 4), simd::float_4::load(releaseStep + g * 4));
+		simd::float_4 shape = simd::ifelse(attacking, simd::float_4::load(attackShape + g * 4), simd::float_4::load(releaseShape + g * 4));
+		// Curves are the less common setting, so the step is only worked out per sample when a lane has one
+		if (simd::movemask(shape != 0.f)) {
+			simd::float_4 tc = simd::ifelse(attacking, simd::float_4::load(attackTc + g * 4), simd::float_4::load(releaseTc + g * 4));
+			step = simd::ifelse(shape != 0.f, curvedStep(tc, shape, overdB - envdB), step);
+		}
+		envdB += step * (overdB - envdB);
+		envdB -= (float) DC_OFFSET;
+
+		// transfer function
+		simd::float_4 kneedB = simd::float_4::load(knee + g * 4);
+		simd::float_4 a = envdB + halfKneedB;
+		simd::float_4 inKnee = (envdB > 0.f) & (envdB < kneedB);
+		simd::float_4 reduction = simd::ifelse(inKnee, simd::float_4::load(kneeSlope + g * 4) * a * a, simd::float_4::load(slope + g * 4) * envdB);
+
+		env[g] = simd::ifelse(activeLanes, envdB, env[g]);
+		gainReduction[g] = simd::ifelse(activeLanes, reduction, gainReduction[g]);
+		return gainReduction[g];
+	}
+
+private:
+	// SimpleCompRms leaves its averager at the default EnvelopeDetector linearity of 1
+	static constexpr float AVERAGER_SHAPE = -0.26303441f;	// -log2( 1.2 )
+	static constexpr float LOG2_E = 1.4426950f;
+
+	// 1 - exp( -1000 / ( ms * sampleRate * 1.2^( linearity * delta ) ) ), how far the envelope moves toward its input,
+	// with the curve capped at EnvelopeDetector's table range. EnvelopeDetector keeps the coefficient itself, but at long
+	// time constants that is too close to 1 for a float, so the step is worked out directly: a series while it is small
+	static simd::float_4 curvedStep(simd::float_4 tc, simd::float_4 shape, simd::float_4 delta) {
+		simd::float_4 x = tc * fastExp2(shape * simd::fmin(simd::abs(delta), 18.f));
+		simd::float_4 step = -x * (1.f + x * (0.5f + x * (1.f / 6.f + x * (1.f / 24.f + x * (1.f / 120.f)))));
+		simd::float_4 large = x <= -0.25f;
+		if (simd::movemask(large))
+			step = simd::ifelse(large, 1.f - fastExp2(x * LOG2_E), step);
+		return step;
+	}
+
+	void copyLane(const CompressorBank &source, int from, int to) {
+		threshdB[to] = source.threshdB[from];
+		ratio[to] = source.ratio[from];
+		kneedB[to] = source.kneedB[from];
+		attackMs[to] = source.attackMs[from];
+		releaseMs[to] = source.releaseMs[from];
+		attackCurve[to] = source.attackCurve[from];
+		releaseCurve[to] = source.releaseCurve[from];
+		windowMs[to] = source.windowMs[from];
+		upward[to] = source.upward[from];
+		thresh[to] = source.thresh[from];
+		halfKnee[to] = source.halfKnee[from];
+		knee[to] = source.knee[from];
+		kneeSlope[to] = source.kneeSlope[from];
+		slope[to] = source.slope[from];
+		attackTc[to] = source.attackTc[from];
+		releaseTc[to] = source.releaseTc[from];
+		windowTc[to] = source.windowTc[from];
+		attackStep[to] = source.attackStep[from];
+		releaseStep[to] = source.releaseStep[from];
+		attackShape[to] = source.attackShape[from];
+		releaseShape[to] = source.releaseShape[from];
+		up[to] = source.up[from];
+	}
+
+	void updateLane(int lane) {
+		static const double LOG2_SLOPE = 0.26303440583379378;	// log2( 1.2 )
+
+		thresh[lane] = threshdB[lane];
+		halfKnee[lane] = kneedB[lane] / 2.0;
+		knee[lane] = kneedB[lane];
+		up[lane] = upward[lane];
+		double kneeGain = upward[lane] ? (1.0 / ratio[lane]) - 1.0 : 1.0 - (1.0 / ratio[lane]);
+		kneeSlope[lane] = kneedB[lane] > 0.0 ? kneeGain / (2.0 * kneedB[lane]) : 0.0;
+		slope[lane] = upward[lane] ? (1.0 / ratio[lane]) - 1.0 : ratio[lane] - 1.0;
+		double attack = -1000.0 / (attackMs[lane] * sampleRate);
+		double release = -1000.0 / (releaseMs[lane] * sampleRate);
+		attackTc[lane] = attack;
+		releaseTc[lane] = release;
+		windowTc[lane] = -1000.0 / (windowMs[lane] * sampleRate);
+		attackStep[lane] = -std::expm1(attack);
+		releaseStep[lane] = -std::expm1(release);
+		attackShape[lane] = -attackCurve[lane] * LOG2_SLOPE;
+		releaseShape[lane] = -releaseCurve[lane] * LOG2_SLOPE;
+	}
+};
+
+}	// end namespace chunkware_simple
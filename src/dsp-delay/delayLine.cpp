@@ -1,6 +1,8 @@
 #include "frame.h"
+#include <vector>
 
-#define DELAY_LINE_SIZE 1<<24
+#define REVERSE_CROSSFADE_SIZE 256 // frames of overlap each time a reverse segment restarts
+#define PITCH_SHIFT_CROSSFADE_SIZE 256 // frames to fade between the resting read and the shifter when the ratio leaves or returns to 1
 
 #define MAKE_INTEGRAL_FRACTIONAL(x) \
   int x ## _integral = static_cast<int32_t>(x); \
@@ -8,10 +10,14 @@
 
 
 
+// A delay line over storage it doesn't own, carved out of a DelayLinePool so many short lines can share one allocation.
+// The pool hands out power of two sizes, so wrapping is a mask
 template <typename T>
 struct DelayLine {
 
-    T DelayBuffer[DELAY_LINE_SIZE] = {0.0f};
+    T *DelayBuffer = nullptr;
+	int bufferSize = 0;
+	int bufferMask = 0;
     int readPtr = 0; // read ptr
 	int desiredReadPtr = 0;
     int writePtr = 0; // write ptr
@@ -21,12 +27,23 @@ struct DelayLine {
 		return (1 - t) * v0 + t * v1;
 	}
 
-    void write(T in) {
-        DelayBuffer[writePtr++] = in; 
+	void attach(T *buffer, int size) {
+		DelayBuffer = buffer;
+		bufferSize = size;
+		bufferMask = size - 1;
+		readPtr = 0;
+		desiredReadPtr = 0;
+		writePtr = 0;
+	}
 
-		if (writePtr >= DELAY_LINE_SIZE) { 
-			writePtr -= DELAY_LINE_SIZE; 
-		}
+	// Longest delay getLangrangeInterpolatedDelay can read without its four points wrapping onto the write head
+	int getMaxDelaySize() {
+		return bufferSize - 4;
+	}
+
+    void write(T in) {
+        DelayBuffer[writePtr] = in; 
+		writePtr = (writePtr + 1) & bufferMask;
     }
 
 	T getLangrangeInterpolatedDelay(float delay) {
@@ -40,10 +57,10 @@ struct DelayLine {
 		int read3 = read0 + 3;
 		float fDelay = readPtrf - floor(readPtrf) + 1.0f;
 
-		if (read0<0) read0 += DELAY_LINE_SIZE;
-		if (read1<0) read1 += DELAY_LINE_SIZE;
-		if (read2<0) read2 += DELAY_LINE_SIZE;
-		if (read3<0) read3 += DELAY_LINE_SIZE;
+		read0 &= bufferMask;
+		read1 &= bufferMask;
+		read2 &= bufferMask;
+		read3 &= bufferMask;
 	    	
 		out =   DelayBuffer[read3] *  fDelay       * (fDelay-1.0f) * (fDelay-2.0f) / 6.0f 
 	          - DelayBuffer[read2] *  fDelay       * (fDelay-1.0f) * (fDelay-3.0f) / 2.0f 
@@ -54,6 +71,62 @@ struct DelayLine {
 		return out;
 	}
 
+	// getLangrangeInterpolatedDelay for count float lines read at the same delay. Every line's write head is a whole
+	// frame, so the fractional part and the four weights are shared and only worked out once. The lines are then
+	// gathered and weighted four at a time as float_4s. count must be a multiple of 4, out gets one value per line
+	static void getLangrangeInterpolatedDelays(DelayLine<float> *lines, int count, float delay, float *out) {
+		float readOffset = -std::fmax(delay, 3.0f);
+		float readFloor = std::floor(readOffset);
+		int offset = int(readFloor) - 1; // oldest of the four points, relative to the write head
+		float fDelay = readOffset - readFloor + 1.0f;
+
+		simd::float_4 c3 =  fDelay        * (fDelay-1.0f) * (fDelay-2.0f) * (1.0f / 6.0f);
+		simd::float_4 c2 = -fDelay        * (fDelay-1.0f) * (fDelay-3.0f) * 0.5f;
+		simd::float_4 c1 =  fDelay        * (fDelay-2.0f) * (fDelay-3.0f) * 0.5f;
+		simd::float_4 c0 = -(fDelay-1.0f) * (fDelay-2.0f) * (fDelay-3.0f) * (1.0f / 6.0f);
+
+		for (int i = 0; i < count; i += 4) {
+			simd::float_4 x0, x1, x2, x3;
+			for (int l = 0; l < 4; l++) {
+				DelayLine<float> &line = lines[i + l];
+				int read0 = line.writePtr + offset;
+				x0[l] = line.DelayBuffer[read0 & line.bufferMask];
+				x1[l] = line.DelayBuffer[(read0 + 1) & line.bufferMask];
+				x2[l] = line.DelayBuffer[(read0 + 2) & line.bufferMask];
+				x3[l] = line.DelayBuffer[(read0 + 3) & line.bufferMask];
+			}
+			simd::float_4 wet = x3 * c3 + x2 * c2 + x1 * c1 + x0 * c0;
+			wet.store(out + i);
+		}
+	}
+
+};
+
+
+// One heap arena split into equal, power of two long DelayLines
+template <typename T>
+struct DelayLinePool {
+
+	std::vector<T> arena;
+	int lineSize = 0;
+
+	// Allocates, so call it from the constructor or onSampleRateChange, never from process().
+	// Lines attached before this point to the old arena, so attach them again afterwards
+	void allocate(int lineCount, int maxDelay) {
+		lineSize = 4;
+		while (lineSize < maxDelay + 4) {
+			lineSize <<= 1;
+		}
+		std::vector<T>(size_t(lineCount) * lineSize, T()).swap(arena);
+	}
+
+	void attach(DelayLine<T> &line, int lineNumber) {
+		line.attach(arena.data() + size_t(lineNumber) * lineSize, lineSize);
+	}
+
+	int getMaxDelaySize() {
+		return lineSize - 4;
+	}
 };
 
 
@@ -106,11 +179,23 @@ struct InterpolatedDelay {
 template <typename T, int N>
 struct MultiTapDelayLine {
 
-    T DelayBuffer[DELAY_LINE_SIZE] = {{0.0f, 0.0f}};
+	// Heap backed so the size follows the sample rate and the longest delay the module can ask for
+	std::vector<T> DelayBuffer;
+	int bufferSize = 0;
     int readPtr[N] = {0}; // read ptr
 	int desiredReadPtr[N] = {0};
     int writePtr = 0; // write ptr
 	float balance[N] = {0.0};
+	// Frames written since the last clear(), anything older reads as silence. Stops counting once the whole buffer has been rewritten
+	int framesSinceClear = 0;
+	// Reverse read heads, stored as how far behind the tap's forward position they are
+	int reverseOffset[N] = {0};
+	int reverseTailOffset[N] = {0};
+	int reverseFade[N] = {0};
+
+	MultiTapDelayLine() {
+		resize(1);
+	}
 
 	float lerp(float v0, float v1, float t) {
 		return (1 - t) * v0 + t * v1;
@@ -120,47 +205,118 @@ struct MultiTapDelayLine {
 		return {(1 - t) * v0.l + t * v1.l,(1 - t) * v0.r + t * v1.r};
 	}
 
+	int wrap(int position) {
+		if (position < 0) {
+			position += bufferSize;
+		}
+		if (position >= bufferSize) {
+			position -= bufferSize;
+		}
+		return position;
+	}
+
+	// Allocates the buffer. Allocates, so call it from the constructor or onSampleRateChange, never from process()
+	void resize(int frames) {
+		frames = std::max(frames, 2);
+		if (frames == bufferSize) {
+			return;
+		}
 
-	void clear() {
+		//Keep each tap the same distance behind the write head, as far as the new size allows
+		int tapDistance[N];
+		int desiredTapDistance[N];
+		for (int i = 0; i < N; i++) {
+			tapDistance[i] = bufferSize > 0 ? std::min(wrap(writePtr - readPtr[i]), frames - 1) : 0;
+			desiredTapDistance[i] = bufferSize > 0 ? std::min(wrap(writePtr - desiredReadPtr[i]), frames - 1) : 0;
+		}
 
 		T empty;
 		empty.l = 0;
 		empty.r = 0;
-		// std::fill(&buffer_[0], &buffer_[size], 0); //REMEMBER THIS FUNCTION!!!!
-		std::fill_n(DelayBuffer, DELAY_LINE_SIZE, empty); 
-		// std::fill(&readPtr[0], &readPtr[N-1], 0); 
-		// std::fill(&desiredReadPtr[0], &desiredReadPtr[N-1], 0); 
-    	// writePtr = 0; // write ptr
+		std::vector<T>(frames, empty).swap(DelayBuffer);
+		bufferSize = frames;
+		writePtr = 0;
+		framesSinceClear = bufferSize;
+
+		for (int i = 0; i < N; i++) {
+			readPtr[i] = wrap(-tapDistance[i]);
+			desiredReadPtr[i] = wrap(-desiredTapDistance[i]);
+		}
+	}
+
+	void setMaxDelay(float sampleRate, float maxDelayTime) {
+		// Couple of extra frames so a tap at the exact maximum never lands on the write head
+		resize(int(std::ceil(sampleRate * maxDelayTime)) + 2);
+	}
+
+	int getMaxDelaySize() {
+		return bufferSize - 1;
 	}
 
 
+	// Constant time - rather than zeroing the buffer, start a new epoch and let read() hide everything written before it.
+	// The old samples are physically overwritten as the write head laps the buffer, so nothing ever has to be filled
+	void clear() {
+		framesSinceClear = 0;
+	}
+
+	T read(int position) {
+		if (framesSinceClear < bufferSize && wrap(writePtr - 1 - position) >= framesSinceClear) {
+			T empty;
+			empty.l = 0;
+			empty.r = 0;
+			return empty;
+		}
+		return DelayBuffer[position];
+	}
+
+
+	// Frame delaySize frames behind the write head, for readers that keep their own delay bookkeeping instead of a tap
+	T readDelayed(int delaySize) {
+		return read(wrap(writePtr - delaySize));
+	}
+
 	void setDelayTime(int tapNumber, int delaySize) {
 		//readPtr[tapNumber] = desiredReadPtr[tapNumber];
+		delaySize = clamp(delaySize, 0, bufferSize - 1);
 		desiredReadPtr[tapNumber] = writePtr - delaySize;
 		if (desiredReadPtr[tapNumber] < 0) { 
-			desiredReadPtr[tapNumber] += DELAY_LINE_SIZE;
+			desiredReadPtr[tapNumber] += bufferSize;
 		}
 		balance[tapNumber] = 0;
 	}
 
+	// Drops any crossfade and reads from the desired delay straight away, for a tap that hasn't been read for a while
+	void snapTap(int tapNumber) {
+		readPtr[tapNumber] = desiredReadPtr[tapNumber];
+		balance[tapNumber] = 0;
+	}
+
     void write(T in) {
         DelayBuffer[writePtr++] = in; 
 
-		if (writePtr >= DELAY_LINE_SIZE) { 
-			writePtr -= DELAY_LINE_SIZE; 
+		if (writePtr >= bufferSize) { 
+			writePtr -= bufferSize; 
+		}
+		if (framesSinceClear < bufferSize) {
+			framesSinceClear++;
 		}
     }
 
-	T getTap(int tapNumber)
-	{
-		T out;
-				
-		out = DelayBuffer[readPtr[tapNumber]];
+	T readTap(int tapNumber, int offset) {
+		T out = read(wrap(readPtr[tapNumber] - offset));
 
 		int distance = desiredReadPtr[tapNumber] - readPtr[tapNumber];
 		if(distance !=0) {
-			T desiredOut = DelayBuffer[desiredReadPtr[tapNumber]]; 
+			T desiredOut = read(wrap(desiredReadPtr[tapNumber] - offset)); 
 			out = lerp(out,desiredOut,balance[tapNumber]);
+		}
+		return out;
+	}
+
+	void advanceTap(int tapNumber) {
+		int distance = desiredReadPtr[tapNumber] - readPtr[tapNumber];
+		if(distance !=0) {
 			balance[tapNumber] +=.001;
 
 			if(balance[tapNumber] >= 1) {
@@ -172,28 +328,101 @@ struct MultiTapDelayLine {
 		desiredReadPtr[tapNumber]++;
 
 
-		if (desiredReadPtr[tapNumber] >= DELAY_LINE_SIZE) {
-			desiredReadPtr[tapNumber] -= DELAY_LINE_SIZE;
+		if (desiredReadPtr[tapNumber] >= bufferSize) {
+			desiredReadPtr[tapNumber] -= bufferSize;
 		}
-		if (readPtr[tapNumber] >= DELAY_LINE_SIZE) {
-			readPtr[tapNumber] -= DELAY_LINE_SIZE;
+		if (readPtr[tapNumber] >= bufferSize) {
+			readPtr[tapNumber] -= bufferSize;
 		}
+	}
 
+	T getTap(int tapNumber)
+	{
+		T out = readTap(tapNumber, 0);
+		advanceTap(tapNumber);
 		return out;
+	}
 
+	void resetReverse() {
+		for (int i = 0; i < N; i++) {
+			reverseOffset[i] = 0;
+			reverseFade[i] = 0;
+		}
+	}
+
+	// Plays the segmentSize frames behind the tap backwards, straight out of the history - no second buffer.
+	// Each time the head reaches the end of the segment it jumps back to the tap and the old head fades out under the new one
+	T getReverseTap(int tapNumber, int segmentSize)
+	{
+		//Reverse head can't run off the far end of the history
+		int maxOffset = bufferSize - 1 - wrap(writePtr - 1 - readPtr[tapNumber]) - REVERSE_CROSSFADE_SIZE * 2;
+		if (maxOffset < REVERSE_CROSSFADE_SIZE * 2) {
+			//Tap is too close to the end of the history for a segment and its crossfade, so play it forwards
+			reverseOffset[tapNumber] = 0;
+			reverseFade[tapNumber] = 0;
+			return getTap(tapNumber);
+		}
+		segmentSize = std::min(std::max(segmentSize, REVERSE_CROSSFADE_SIZE * 2), maxOffset);
+
+		T out = readTap(tapNumber, reverseOffset[tapNumber]);
+		if (reverseFade[tapNumber] > 0) {
+			float fade = (float) reverseFade[tapNumber] / REVERSE_CROSSFADE_SIZE;
+			fade = fade * fade * (3.0f - 2.0f * fade);
+			T tail = readTap(tapNumber, reverseTailOffset[tapNumber]);
+			out = lerp(out, tail, fade);
+			reverseTailOffset[tapNumber] += 2;
+			reverseFade[tapNumber]--;
+		}
+
+		// Forward pointer moves up one, so moving the offset two makes the head run backwards in real time
+		reverseOffset[tapNumber] += 2;
+		if (reverseOffset[tapNumber] >= segmentSize) {
+			reverseTailOffset[tapNumber] = reverseOffset[tapNumber];
+			reverseFade[tapNumber] = REVERSE_CROSSFADE_SIZE;
+			reverseOffset[tapNumber] = 0;
+		}
+
+		advanceTap(tapNumber);
+		return out;
 	}
 };
 
 
 struct GranularPitchShifter {
-	float ratio;
-	float windowSize;
-	float phase = 0.0;
+	float ratio = 1.0f;
+	float windowSize = 1023.0f;
+	float phase = 1.0f;
+	float wetMix = 0.0f; // 0 = ratio is 1 and only the resting read is heard
 
 	InterpolatedDelay<2048> delayLine;
 
+	// At ratio 1 the phase rests at 1, where the window puts all the gain on one read this far back. Reading just that
+	// keeps the latency unshifted signals have always had
+	float restingOffset(bool useTriangleWindow) {
+		return useTriangleWindow ? 1.0f + windowSize * 0.5f : windowSize;
+	}
+
 	FloatFrame process(FloatFrame in, bool useTriangleWindow) {
 
+		float wetTarget = ratio != 1.0f ? 1.0f : 0.0f;
+		bool identity = wetMix == 0.0f && wetTarget == 0.0f;
+		if (!identity) {
+			wetMix += clamp(wetTarget - wetMix, -1.0f / PITCH_SHIFT_CROSSFADE_SIZE, 1.0f / PITCH_SHIFT_CROSSFADE_SIZE);
+		}
+
+		delayLine.write(in);
+		FloatFrame resting = {0.0f, 0.0f};
+		if (wetMix < 1.0f) {
+			delayLine.interpolate(restingOffset(useTriangleWindow), 1.0f);
+			resting = delayLine.accumulator;
+			if (identity) {
+				//Nothing to shift, one read instead of two
+				phase = 1.0f;
+				return resting;
+			}
+			delayLine.accumulator = {0.0f, 0.0f};
+		}
+
 		phase += (1.0f - ratio) / windowSize;
 		if (phase >= 1.0f) {
 			phase -= 1.0f;
@@ -213,10 +442,13 @@ struct GranularPitchShifter {
 			halfPhaseOffset -= windowSize;
 		}
 
-		delayLine.write(in);
 		delayLine.interpolate(phaseOffset,tri);
 		delayLine.interpolate(halfPhaseOffset,1.0f-tri);
-		return delayLine.accumulator;
+
+		FloatFrame out;
+		out.l = resting.l + (delayLine.accumulator.l - resting.l) * wetMix;
+		out.r = resting.r + (delayLine.accumulator.r - resting.r) * wetMix;
+		return out;
 	}
   
 	void setRatio(float newRatio) {
@@ -229,4 +461,98 @@ struct GranularPitchShifter {
 		float target_size = (2048 * size) -  1; 
 		windowSize = target_size;
 	}
-};
\ No newline at end of file
+};
+
+
+// N GranularPitchShifters run together - phases, window gains and read offsets are worked out four shifters per float_4,
+// only the delay reads themselves are per shifter. Groups where every ratio is 1 only make the resting read
+template <int N>
+struct GranularPitchShifterBank {
+	static const int GROUPS = (N + 3) / 4;
+
+	InterpolatedDelay<2048> delayLine[N];
+	simd::float_4 ratio[GROUPS];
+	simd::float_4 windowSize[GROUPS];
+	simd::float_4 phase[GROUPS];
+	simd::float_4 wetMix[GROUPS];
+
+	FloatFrame in[N];
+	FloatFrame out[N];
+
+	GranularPitchShifterBank() {
+		for (int g = 0; g < GROUPS; g++) {
+			ratio[g] = 1.0f;
+			windowSize[g] = 1023.0f;
+			phase[g] = 1.0f;
+			wetMix[g] = 0.0f;
+		}
+	}
+
+	void setRatio(int shifter, float newRatio) {
+		ratio[shifter / 4][shifter % 4] = newRatio;
+	}
+
+	//Size comes in as a percentage, same for every shifter in the bank
+	void setSize(float size) {
+		float target_size = (2048 * size) -  1; 
+		for (int g = 0; g < GROUPS; g++) {
+			windowSize[g] = target_size;
+		}
+	}
+
+	void process(bool useTriangleWindow) {
+		for (int g = 0; g < GROUPS; g++) {
+			int lanes = std::min(4, N - g * 4);
+			simd::float_4 wetTarget = simd::ifelse(ratio[g] != 1.0f, 1.0f, 0.0f);
+			// Same resting read as GranularPitchShifter
+			simd::float_4 restingOffset = useTriangleWindow ? 1.0f + windowSize[g] * 0.5f : windowSize[g];
+
+			if (simd::movemask((wetMix[g] > 0.0f) | (wetTarget > 0.0f)) == 0) {
+				//Whole group is identity
+				phase[g] = 1.0f;
+				for (int lane = 0; lane < lanes; lane++) {
+					int i = g * 4 + lane;
+					delayLine[i].write(in[i]);
+					delayLine[i].interpolate(restingOffset[lane], 1.0f);
+					out[i] = delayLine[i].accumulator;
+				}
+				continue;
+			}
+
+			phase[g] = simd::ifelse((wetMix[g] == 0.0f) & (wetTarget == 0.0f), 1.0f, phase[g]);
+			phase[g] += (1.0f - ratio[g]) / windowSize[g];
+			phase[g] = simd::ifelse(phase[g] >= 1.0f, phase[g] - 1.0f, phase[g]);
+			phase[g] = simd::ifelse(phase[g] <= 0.0f, phase[g] + 1.0f, phase[g]);
+
+			simd::float_4 tri = 1.0f;
+			if (useTriangleWindow) {
+				tri = 2.0f * simd::ifelse(phase[g] >= 0.5f, 1.0f - phase[g], phase[g]);
+			}
+			simd::float_4 phaseOffset = phase[g] * windowSize[g];
+			simd::float_4 halfPhaseOffset = phase[g] + windowSize[g] * 0.5f;
+			halfPhaseOffset = simd::ifelse(halfPhaseOffset >= windowSize[g], halfPhaseOffset - windowSize[g], halfPhaseOffset);
+
+			wetMix[g] += simd::clamp(wetTarget - wetMix[g], -1.0f / PITCH_SHIFT_CROSSFADE_SIZE, 1.0f / PITCH_SHIFT_CROSSFADE_SIZE);
+
+			for (int lane = 0; lane < lanes; lane++) {
+				int i = g * 4 + lane;
+				delayLine[i].write(in[i]);
+				float mix = wetMix[g][lane];
+				FloatFrame resting = {0.0f, 0.0f};
+				if (mix < 1.0f) {
+					delayLine[i].interpolate(restingOffset[lane], 1.0f);
+					resting = delayLine[i].accumulator;
+					if (mix == 0.0f) {
+						out[i] = resting;
+						continue;
+					}
+					delayLine[i].accumulator = {0.0f, 0.0f};
+				}
+				delayLine[i].interpolate(phaseOffset[lane], tri[lane]);
+				delayLine[i].interpolate(halfPhaseOffset[lane], 1.0f - tri[lane]);
+				out[i].l = resting.l + (delayLine[i].accumulator.l - resting.l) * mix;
+				out[i].r = resting.r + (delayLine[i].accumulator.r - resting.r) * mix;
+			}
+		}
+	}
+};
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "rack.hpp"
 #include "AudioMath.h"
 
 template <typename T> class StateVariableFilterState;
@@ -26,6 +27,15 @@ template <typename T> class StateVariableFilterParams;
  *
  */
 
+template <typename T> struct StateVariableFilterOutputs;
+
+/**
+ * T may be float or a SIMD lane type such as simd::float_4, in which case
+ * every lane is its own filter with its own Fc and Q.
+ * Nothing in the per sample path branches: the runtime mode is applied with
+ * gains worked out in setMode(), the templated run() picks the response at
+ * compile time, and runAll() hands back every response for per lane masking.
+ */
 template <typename T>
 class StateVariableFilter
 {
@@ -33,49 +43,61 @@ public:
     StateVariableFilter() = delete;       // we are only static
     static T run(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params);
 
+    template <typename StateVariableFilterParams<T>::Mode M>
+    static T run(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params);
+
+    static StateVariableFilterOutputs<T> runAll(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params);
 };
 
 template <typename T>
-inline T StateVariableFilter<T>::run(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params)
+struct StateVariableFilterOutputs
+{
+    T lowPass;
+    T hiPass;
+    T bandPass;
+    T notch;
+};
+
+template <typename T>
+inline StateVariableFilterOutputs<T> StateVariableFilter<T>::runAll(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params)
 {
     const T dLow = state.z2 + params.fcGain * state.z1;
     const T dHi = input - (state.z1 * params.qGain + dLow);
     T dBand = dHi * params.fcGain + state.z1;
 
     // TODO: figure out why we get these crazy values
-#if 1
-    if (dBand >= 1000) {
-        dBand = 999;               // clip it
-    }
-    if (dBand < -1000) {
-        dBand = -999;               // clip it
-    }
+    // clip it
+    dBand = rack::simd::ifelse(dBand >= T(1000), T(999), rack::simd::ifelse(dBand < T(-1000), T(-999), dBand));
 
-#endif
+    state.z1 = dBand;
+    state.z2 = dLow;
 
-    T d;
-    switch (params.mode) {
+    return {dLow, dHi, dBand, dLow + dHi};
+}
+
+template <typename T>
+inline T StateVariableFilter<T>::run(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params)
+{
+    const StateVariableFilterOutputs<T> d = runAll(input, state, params);
+    return d.lowPass * params.lowPassGain + d.hiPass * params.hiPassGain + d.bandPass * params.bandPassGain;
+}
+
+template <typename T>
+template <typename StateVariableFilterParams<T>::Mode M>
+inline T StateVariableFilter<T>::run(T input, StateVariableFilterState<T>& state, const StateVariableFilterParams<T>& params)
+{
+    const StateVariableFilterOutputs<T> d = runAll(input, state, params);
+    switch (M) {
         case StateVariableFilterParams<T>::Mode::LowPass:
-            d = dLow;
-            break;
+            return d.lowPass;
         case StateVariableFilterParams<T>::Mode::HiPass:
-            d = dHi;
-            break;
+            return d.hiPass;
         case StateVariableFilterParams<T>::Mode::BandPass:
-            d = dBand;
-            break;
+            return d.bandPass;
         case StateVariableFilterParams<T>::Mode::Notch:
-            d = dLow + dHi;
-            break;
-        default:
-            assert(false);
-            d = 0.0;
+            return d.notch;
     }
-
-    state.z1 = dBand;
-    state.z2 = dLow;
-
-    return d;
+    return d.bandPass;
 }
 
 /****************************************************************/
@@ -111,24 +133,30 @@ public:
      * units are 1 == sample rate
      */
     void setFreq(T f);
-    void setMode(Mode m)
-    {
-        mode = m;
-    }
+    void setMode(Mode m);
 private:
     Mode mode = Mode::BandPass;
     T qGain = 1.;		// internal amp gains
     T fcGain = T(.001);
+    T lowPassGain = 0.;		// response mix for the runtime mode
+    T hiPassGain = 0.;
+    T bandPassGain = 1.;
 };
 
 template <typename T>
 inline void StateVariableFilterParams<T>::setQ(T q)
 {
-    if (q < .49) {
-        assert(false);
-        q = T(.6);
-    }
-    qGain = 1 / q;
+    // Out of range lanes fall back to .6
+    qGain = T(1) / rack::simd::ifelse(q < T(.49), T(.6), q);
+}
+
+template <typename T>
+inline void StateVariableFilterParams<T>::setMode(Mode m)
+{
+    mode = m;
+    lowPassGain = (m == Mode::LowPass || m == Mode::Notch) ? 1 : 0;
+    hiPassGain = (m == Mode::HiPass || m == Mode::Notch) ? 1 : 0;
+    bandPassGain = m == Mode::BandPass ? 1 : 0;
 }
 
 template <typename T>
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "rack.hpp"
+
+// Lets a slow generator run at control rate. The module works its outputs out every `interval` samples and they're
+// ramped linearly in between. The generator should be stepped a whole update ahead, so each ramp arrives at a value
+// just as it falls due rather than an update late. T is float for one output or float_4 for up to four.
+template <typename T>
+struct ControlRateRamp {
+	int interval = 64;
+	// Samples left until the next update, which is also how far the generator has to step when one comes round
+	int counter = 0;
+	T value = 0.f;
+	T delta = 0.f;
+	// The first update has nothing to ramp from, so it should jump as a reset does
+	bool jumpPending = true;
+
+	// True when the outputs are due, or straight away when a trigger forces it. Either way the count starts again
+	bool process(bool force = false) {
+		if (--counter > 0 && !force)
+			return false;
+		counter = std::max(interval, 1);
+		return true;
+	}
+
+	// Outputs that should move straight to v on this sample, e.g. after a reset
+	void jump(T v) {
+		value = v;
+		delta = 0.f;
+		jumpPending = false;
+	}
+
+	void rampTo(T target) {
+		delta = (target - value) / T((float) counter);
+	}
+
+	T next() {
+		value += delta;
+		return value;
+	}
+};
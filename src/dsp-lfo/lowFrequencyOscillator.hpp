@@ -0,0 +1,176 @@
+#pragma once
+
+#include "rack.hpp"
+
+// sin(2*pi*x) for any x. The argument is folded onto the quarter cycle [-0.25, 0.25] and fed to an odd
+// polynomial (Taylor terms up to x^11). Max error is about 6e-8 in double and 4e-7 in float over a cycle, a little
+// more in float once the phase is offset past 1. Works on float, double or float_4 so the same code serves one
+// oscillator or four lanes.
+template <typename V>
+inline V lfoSine(V x) {
+	V u = x + V(0.25f);
+	u -= simd::floor(u);
+	V z = V(0.25f) - simd::abs(u - V(0.5f));
+	V z2 = z * z;
+	V p = V(-15.094642576822984);
+	p = p * z2 + V(42.058693944897634);
+	p = p * z2 + V(-76.70585975306136);
+	p = p * z2 + V(81.60524927607504);
+	p = p * z2 + V(-41.341702240399755);
+	p = p * z2 + V(6.283185307179586);
+	return z * p;
+}
+
+// Fractional part, [0,1)
+template <typename V>
+inline V lfoWrap(V x) {
+	return x - simd::floor(x);
+}
+
+// 0 at whole numbers, 2 half way between
+template <typename V>
+inline V lfoTriangle(V x) {
+	return V(4.f) * simd::abs(x - simd::floor(x + V(0.5f)));
+}
+
+// -1 to 1, jumps at the half
+template <typename V>
+inline V lfoSawtooth(V x) {
+	return V(2.f) * (x - simd::floor(x + V(0.5f)));
+}
+
+inline bool lfoChanged(float a, float b) {
+	return a != b;
+}
+
+inline bool lfoChanged(double a, double b) {
+	return a != b;
+}
+
+inline bool lfoChanged(simd::float_4 a, simd::float_4 b) {
+	return simd::movemask(a != b) != 0;
+}
+
+// The oscillator every LFO module runs on. T is the lane type of the phase accumulator: double, float, or float_4 for
+// four independent oscillators stepped together. The waveforms are templated on the type they are worked out in, so a
+// scalar oscillator read at four phase offsets is one float_4 pass, e.g. skewsaw(simd::float_4(0.f, 0.125f, 0.25f, 0.5f)).
+template <typename T>
+struct LowFrequencyOscillator {
+	T basePhase = 0.f;
+	// Distance since the last reset. Each step lands in phaseRemainder and only whole 1/4096ths of a cycle move across
+	// to phase. Steps are only ever added to something smaller than 1/4096, so a slow LFO on a float lane doesn't lose
+	// its tiny steps against a phase near 1
+	T phase = 0.f;
+	T phaseRemainder = 0.f;
+	T freq = 1.f;
+	T pw = 0.5f;
+	T skew = 0.5f; // Triangle
+	T waveSlope = 0.f; //Original (1 is sin)
+	bool offset = false;
+	bool invert = false;
+
+	// 2^pitch is only worked out again when the pitch moves
+	T lastPitch = 0.f;
+
+	void setPitch(T pitch) {
+		pitch = simd::fmin(pitch, T(8.f));
+		if (lfoChanged(pitch, lastPitch)) {
+			freq = simd::pow(T(2.f), pitch);
+			lastPitch = pitch;
+		}
+	}
+	void setFrequency(T frequency) {
+		freq = frequency;
+	}
+	void setPulseWidth(T pw_) {
+		const float pwMin = 0.01;
+		pw = simd::fmax(simd::fmin(pw_, T(1.f - pwMin)), T(pwMin));
+	}
+
+	void setBasePhase(T initialPhase) {
+		basePhase = initialPhase;
+	}
+
+	void hardReset() {
+		phase = 0.f;
+		phaseRemainder = 0.f;
+	}
+
+	void step(T dt) {
+		phaseRemainder += simd::fmin(freq * dt, T(0.5f));
+		T whole = simd::floor(phaseRemainder * T(4096.f)) * T(1.f / 4096.f);
+		phaseRemainder -= whole;
+		phase += whole;
+		phase -= simd::floor(phase);
+	}
+
+	// Where in the cycle the waveforms are read, unwrapped
+	T position() const {
+		return phase + phaseRemainder + basePhase;
+	}
+
+	T progress() const {
+		return lfoWrap(position());
+	}
+
+	template <typename V = T>
+	V sin(V phaseOffset = V(0.f)) const {
+		V x = V(position()) + phaseOffset;
+		V sign = V(invert ? -1.f : 1.f);
+		if (offset)
+			return V(1.f) - sign * lfoSine(x + V(0.25f));
+		return sign * lfoSine(x);
+	}
+
+	template <typename V = T>
+	V tri(V phaseOffset = V(0.f)) const {
+		V x = V(position()) + phaseOffset;
+		if (offset)
+			return lfoTriangle(invert ? x - V(0.5f) : x);
+		return V(-1.f) + lfoTriangle(invert ? x - V(0.25f) : x - V(0.75f));
+	}
+
+	template <typename V = T>
+	V saw(V phaseOffset = V(0.f)) const {
+		V x = V(position()) + phaseOffset;
+		if (offset) {
+			V w = lfoWrap(x);
+			return invert ? V(2.f) * (V(1.f) - w) : V(2.f) * w;
+		}
+		return lfoSawtooth(x) * V(invert ? -1.f : 1.f);
+	}
+
+	template <typename V = T>
+	V sqr(V phaseOffset = V(0.f)) const {
+		V w = lfoWrap(V(position()) + phaseOffset);
+		V high = V(invert ? -1.f : 1.f);
+		V sqr = simd::ifelse(w < V(pw), high, -high);
+		return offset ? sqr + V(1.f) : sqr;
+	}
+
+	// Rises over skew, falls over the rest. Skew 0 is a falling ramp rather than the 0/0 it used to be
+	template <typename V = T>
+	V skewsaw(V phaseOffset = V(0.f)) const {
+		V w = lfoWrap(V(position()) + phaseOffset);
+		V s = V(skew);
+		V wave = simd::ifelse(w < s, V(2.f) * w / s, V(2.f) * (V(1.f) - w) / (V(1.f) - s));
+		return offset ? wave : wave - V(1.f);
+	}
+
+	// The skewed saw and the square morph into a sine as waveSlope goes to 1. The sine is 90 degrees behind so it
+	// lines up with the triangle
+	template <typename V = T>
+	V shapedSkewsaw(V phaseOffset = V(0.f)) const {
+		return lerp(skewsaw(phaseOffset), sin(phaseOffset - V(0.25f)), V(waveSlope));
+	}
+
+	template <typename V = T>
+	V shapedSqr(V phaseOffset = V(0.f)) const {
+		return lerp(sqr(phaseOffset), sin(phaseOffset - V(0.25f)), V(waveSlope));
+	}
+
+	template <typename V>
+	static V lerp(V v0, V v1, V t) {
+		return (V(1.f) - t) * v0 + t * v1;
+	}
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "rack.hpp"
+
+// Four sine oscillators in float_4 lanes that run without calling sin or cos every sample. Each lane keeps the sine
+// and cosine of its phase and is turned a step further on every sample, which is a complex multiply. sin and cos are
+// only worked out when a step size or phase offset changes. Every so often the pairs are pulled back onto the unit
+// circle so rounding can't make them grow or shrink. A lane offset by a quarter cycle gives the cosine, so pairs of
+// lanes can hold both coordinates of a point going round an ellipse.
+struct QuadratureOscillator {
+	simd::float_4 sine = 0.f;
+	simd::float_4 cosine = 1.f;
+	// Rotation made by one step
+	simd::float_4 stepSine = 0.f;
+	simd::float_4 stepCosine = 1.f;
+	// In cycles, as last set
+	simd::float_4 delta = 0.f;
+	simd::float_4 phaseOffset = 0.f;
+	int renormalizeCounter = 0;
+
+	static const int RENORMALIZE_INTERVAL = 256;
+
+	// Cycles per step
+	void setDelta(simd::float_4 cycles) {
+		if (simd::movemask(cycles != delta) == 0)
+			return;
+		delta = cycles;
+		simd::float_4 theta = delta * float(2.0 * M_PI);
+		stepSine = simd::sin(theta);
+		stepCosine = simd::cos(theta);
+	}
+
+	// Moves where the lanes are read from without disturbing how far they've run
+	void setPhaseOffset(simd::float_4 offset) {
+		if (simd::movemask(offset != phaseOffset) == 0)
+			return;
+		simd::float_4 theta = (offset - phaseOffset) * float(2.0 * M_PI);
+		phaseOffset = offset;
+		rotate(simd::sin(theta), simd::cos(theta));
+	}
+
+	void step() {
+		rotate(stepSine, stepCosine);
+		if (++renormalizeCounter >= RENORMALIZE_INTERVAL) {
+			renormalizeCounter = 0;
+			// One Newton step towards 1/sqrt(sin^2 + cos^2) is plenty this close to 1
+			simd::float_4 scale = 1.5f - 0.5f * (sine * sine + cosine * cosine);
+			sine *= scale;
+			cosine *= scale;
+		}
+	}
+
+	void rotate(simd::float_4 s, simd::float_4 c) {
+		simd::float_4 newSine = sine * c + cosine * s;
+		cosine = cosine * c - sine * s;
+		sine = newSine;
+	}
+};
@@ -32,6 +32,8 @@ Biquad::Biquad() {
 }
 
 Biquad::Biquad(int type, double Fc, double Q, double peakGainDB) {
+    a0 = 1.0;
+    a1 = a2 = b1 = b2 = 0.0;
     setBiquad(type, Fc, Q, peakGainDB);
     z1 = z2 = 0.0;
 }
@@ -67,10 +69,22 @@ void Biquad::setBiquad(int type, double Fc, double Q, double peakGainDB) {
 }
 
 void Biquad::calcBiquad(void) {
+    double coefficients[5] = {a0, a1, a2, b1, b2};
+    calcCoefficients(type, Fc, Q, peakGain, coefficients);
+    a0 = coefficients[0];
+    a1 = coefficients[1];
+    a2 = coefficients[2];
+    b1 = coefficients[3];
+    b2 = coefficients[4];
+}
+
+// coefficients is {a0, a1, a2, b1, b2}, left as it was for an unknown type
+void Biquad::calcCoefficients(int type, double Fc, double Q, double peakGain, double *coefficients) {
     double norm;
+    double a0 = coefficients[0], a1 = coefficients[1], a2 = coefficients[2], b1 = coefficients[3], b2 = coefficients[4];
     double V = pow(10, fabs(peakGain) / 20.0);
     double K = tan(M_PI * Fc);
-    switch (this->type) {
+    switch (type) {
         case bq_type_lowpass:
             norm = 1 / (1 + K / Q + K * K);
             a0 = K * K * norm;
@@ -201,7 +215,11 @@ void Biquad::calcBiquad(void) {
             break;
     }
 
-    return;
+    coefficients[0] = a0;
+    coefficients[1] = a1;
+    coefficients[2] = a2;
+    coefficients[3] = b1;
+    coefficients[4] = b2;
 }
 
 
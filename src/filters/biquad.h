@@ -42,6 +42,7 @@ public:
     void setBiquad(int type, double Fc, double Q, double peakGain);
     float process(float in);
     double frequencyResponse(double in);
+    static void calcCoefficients(int type, double Fc, double Q, double peakGain, double *coefficients);
 
 protected:
     void calcBiquad(void);
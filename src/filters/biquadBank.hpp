@@ -0,0 +1,241 @@
+#pragma once
+
+#include "rack.hpp"
+#include "biquad.h"
+
+// N Biquads side by side, coefficients and state stored as float_4 lanes so four sections run per instruction.
+// The sections of a group are independent, so for a serial cascade (phaser stages, the two halves of an LR crossover)
+// lay what runs in parallel - channels, bands - across the lanes and put each stage of the cascade in its own group.
+// Single precision, where Biquad is double. The feedback coefficients are kept as offsets from the -2 and 1 they sit
+// next to at low cutoffs, which holds onto most of the precision float loses there, but cutoffs under about 8Hz
+// still drift from what Biquad gives
+template <int N>
+struct BiquadBank {
+	static const int GROUPS = (N + 3) / 4;
+
+	simd::float_4 a0[GROUPS];
+	simd::float_4 a1[GROUPS];
+	simd::float_4 a2[GROUPS];
+	simd::float_4 b1Offset[GROUPS]; // b1 + 2
+	simd::float_4 b2Offset[GROUPS]; // b2 - 1
+	simd::float_4 z1[GROUPS];
+	simd::float_4 z2[GROUPS];
+
+	int type[N];
+	double Fc[N];
+	double Q[N];
+	double peakGain[N];
+
+	BiquadBank() {
+		for (int i = 0; i < N; i++) {
+			type[i] = bq_type_lowpass;
+			Fc[i] = 0.50;
+			Q[i] = 0.707;
+			peakGain[i] = 0.0;
+		}
+		for (int g = 0; g < GROUPS; g++) {
+			a0[g] = 1.f;
+			a1[g] = 0.f;
+			a2[g] = 0.f;
+			b1Offset[g] = 2.f;
+			b2Offset[g] = -1.f;
+		}
+		reset();
+	}
+
+	void reset() {
+		for (int g = 0; g < GROUPS; g++) {
+			z1[g] = 0.f;
+			z2[g] = 0.f;
+		}
+	}
+
+	void setType(int section, int type) {
+		this->type[section] = type;
+		calcBiquad(section);
+	}
+
+	void setQ(int section, double Q) {
+		this->Q[section] = Q;
+		calcBiquad(section);
+	}
+
+	void setFc(int section, double Fc) {
+		this->Fc[section] = Fc;
+		calcBiquad(section);
+	}
+
+	void setPeakGain(int section, double peakGainDB) {
+		this->peakGain[section] = peakGainDB;
+		calcBiquad(section);
+	}
+
+	void setBiquad(int section, int type, double Fc, double Q, double peakGainDB) {
+		this->type[section] = type;
+		this->Q[section] = Q;
+		this->Fc[section] = Fc;
+		setPeakGain(section, peakGainDB);
+	}
+
+	// Passes straight through - for the open end of a crossover, where a filter pinned at 0 or Nyquist would be
+	// at the mercy of single precision
+	void setBypass(int section) {
+		int g = section / 4;
+		int l = section % 4;
+		a0[g][l] = 1.f;
+		a1[g][l] = 0.f;
+		a2[g][l] = 0.f;
+		b1Offset[g][l] = 2.f;
+		b2Offset[g][l] = -1.f;
+	}
+
+	// Takes another bank's coefficients but keeps its own state, so several signals can share one filter design
+	void copyCoefficients(const BiquadBank &other) {
+		for (int g = 0; g < GROUPS; g++) {
+			a0[g] = other.a0[g];
+			a1[g] = other.a1[g];
+			a2[g] = other.a2[g];
+			b1Offset[g] = other.b1Offset[g];
+			b2Offset[g] = other.b2Offset[g];
+		}
+	}
+
+	// Runs the four sections of one group on one input each
+	simd::float_4 process(int group, simd::float_4 in) {
+		simd::float_4 out = in * a0[group] + z1[group];
+		z1[group] = in * a1[group] + z2[group] + 2.f * out - b1Offset[group] * out;
+		z2[group] = in * a2[group] - out - b2Offset[group] * out;
+		return out;
+	}
+
+	// Feeds each group's output into the next, through the first groups groups
+	simd::float_4 processCascade(simd::float_4 in, int groups) {
+		for (int g = 0; g < groups; g++) {
+			in = process(g, in);
+		}
+		return in;
+	}
+
+	double frequencyResponse(int section, double frequency) {
+		int g = section / 4;
+		int l = section % 4;
+		double sa0 = a0[g][l], sa1 = a1[g][l], sa2 = a2[g][l];
+		double sb1 = (double)b1Offset[g][l] - 2.0, sb2 = (double)b2Offset[g][l] + 1.0;
+		double w = 2.0*M_PI*frequency;
+		double numerator = sa0*sa0 + sa1*sa1 + sa2*sa2 + 2.0*(sa0*sa1 + sa1*sa2)*cos(w) + 2.0*sa0*sa2*cos(2.0*w);
+		double denominator = 1.0 + sb1*sb1 + sb2*sb2 + 2.0*(sb1 + sb1*sb2)*cos(w) + 2.0*sb2*cos(2.0*w);
+		return sqrt(numerator / denominator);
+	}
+
+protected:
+	void calcBiquad(int section) {
+		int g = section / 4;
+		int l = section % 4;
+		double coefficients[5] = {a0[g][l], a1[g][l], a2[g][l], b1Offset[g][l] - 2.0, b2Offset[g][l] + 1.0};
+		Biquad::calcCoefficients(type[section], Fc[section], Q[section], peakGain[section], coefficients);
+		a0[g][l] = coefficients[0];
+		a1[g][l] = coefficients[1];
+		a2[g][l] = coefficients[2];
+		b1Offset[g][l] = coefficients[3] + 2.0;
+		b2Offset[g][l] = coefficients[4] - 1.0;
+	}
+};
+
+
+// Allpass and notch coefficients for sections swept at audio rate, as in a phaser. Targets are worked out a float_4
+// group at a time with polynomial tan/sin/cos instead of Biquad's double precision calls, at most every updateInterval
+// samples, and step() ramps the bank's coefficients to them in between. Same responses as bq_type_allpass and
+// bq_type_notch - Fc is the frequency over the sample rate in both
+template <int N>
+struct BiquadSweep {
+	static const int GROUPS = BiquadBank<N>::GROUPS;
+
+	simd::float_4 a0Step[GROUPS];
+	simd::float_4 a1Step[GROUPS];
+	simd::float_4 a2Step[GROUPS];
+	simd::float_4 b1OffsetStep[GROUPS];
+	simd::float_4 b2OffsetStep[GROUPS];
+
+	int updateInterval = 1;
+	int stepsLeft = 0;
+	// Groups step() moved last time
+	int steppedGroups = 0;
+
+	BiquadSweep() {
+		for (int g = 0; g < GROUPS; g++) {
+			a0Step[g] = 0.f;
+			a1Step[g] = 0.f;
+			a2Step[g] = 0.f;
+			b1OffsetStep[g] = 0.f;
+			b2OffsetStep[g] = 0.f;
+		}
+	}
+
+	// True on the samples new targets should be set for every group being swept, including straight away when more
+	// groups are swept than last time so the new ones don't run on whatever ramp they were left with
+	bool needsTargets(int groups) {
+		return stepsLeft <= 0 || groups > steppedGroups;
+	}
+
+	void setAllpassTarget(BiquadBank<N> &bank, int group, simd::float_4 Fc, simd::float_4 Q) {
+		// bq_type_allpass takes Fc as the angle itself. Fc stays well under 1 radian, so short Taylor series do
+		simd::float_4 w = simd::fmin(Fc, 1.f);
+		simd::float_4 w2 = w * w;
+		simd::float_4 sinW = w * (1.f - w2 * (1.f / 6.f) * (1.f - w2 * (1.f / 20.f) * (1.f - w2 * (1.f / 42.f))));
+		simd::float_4 oneMinusCosW = w2 * 0.5f * (1.f - w2 * (1.f / 12.f) * (1.f - w2 * (1.f / 30.f) * (1.f - w2 * (1.f / 56.f))));
+
+		simd::float_4 alpha = sinW / 2.f * Q;
+		simd::float_4 norm = 1.f / (1.f + alpha);
+		setTarget(bank, group, (1.f - alpha) * norm, (oneMinusCosW * 2.f - 2.f) * norm, 1.f,
+			(alpha + oneMinusCosW) * 2.f * norm, -2.f * alpha * norm);
+	}
+
+	void setNotchTarget(BiquadBank<N> &bank, int group, simd::float_4 Fc, simd::float_4 Q) {
+		simd::float_4 K = fastTan(simd::fmin(Fc, 0.477f) * float(M_PI));
+		simd::float_4 KK = K * K;
+		simd::float_4 KOverQ = K / Q;
+		simd::float_4 norm = 1.f / (1.f + KOverQ + KK);
+		simd::float_4 a0 = (1.f + KK) * norm;
+		setTarget(bank, group, a0, (KK - 1.f) * 2.f * norm, a0, (KK * 2.f + KOverQ) * 2.f * norm, -2.f * KOverQ * norm);
+	}
+
+	// Moves the first groups groups of the bank one sample along their ramps
+	void step(BiquadBank<N> &bank, int groups) {
+		// Groups dropping out hold their coefficients rather than keep a ramp that was meant to end at a stale target
+		for (int g = groups; g < steppedGroups; g++) {
+			a0Step[g] = 0.f;
+			a1Step[g] = 0.f;
+			a2Step[g] = 0.f;
+			b1OffsetStep[g] = 0.f;
+			b2OffsetStep[g] = 0.f;
+		}
+		for (int g = 0; g < groups; g++) {
+			bank.a0[g] += a0Step[g];
+			bank.a1[g] += a1Step[g];
+			bank.a2[g] += a2Step[g];
+			bank.b1Offset[g] += b1OffsetStep[g];
+			bank.b2Offset[g] += b2OffsetStep[g];
+		}
+		if (stepsLeft <= 0 || groups > steppedGroups) {
+			stepsLeft = updateInterval;
+		}
+		stepsLeft--;
+		steppedGroups = groups;
+	}
+
+protected:
+	// [5/4] Pade approximant, good to 1e-6 up to 1.2 radians and 1e-4 by 1.5
+	simd::float_4 fastTan(simd::float_4 x) {
+		simd::float_4 x2 = x * x;
+		return x * (945.f - x2 * (105.f - x2)) / (945.f - x2 * (420.f - x2 * 15.f));
+	}
+
+	void setTarget(BiquadBank<N> &bank, int group, simd::float_4 a0, simd::float_4 a1, simd::float_4 a2, simd::float_4 b1Offset, simd::float_4 b2Offset) {
+		float scale = 1.f / updateInterval;
+		a0Step[group] = (a0 - bank.a0[group]) * scale;
+		a1Step[group] = (a1 - bank.a1[group]) * scale;
+		a2Step[group] = (a2 - bank.a2[group]) * scale;
+		b1OffsetStep[group] = (b1Offset - bank.b1Offset[group]) * scale;
+		b2OffsetStep[group] = (b2Offset - bank.b2Offset[group]) * scale;
+	}
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "menu.hpp"
+#include "../dsp-lfo/controlRate.hpp"
+
+// The Control Rate submenu for any module that runs on a ControlRateRamp
+template <typename T>
+OptionsMenuItem* createControlRateMenuItem(ControlRateRamp<T> *controlRate) {
+	static const int intervals[] = {1, 32, 64, 128, 256};
+	static const char* labels[] = {"Every Sample", "32 Samples", "64 Samples", "128 Samples", "256 Samples"};
+
+	OptionsMenuItem* mi = new OptionsMenuItem("Control Rate");
+	for (int i = 0; i < 5; i++) {
+		int interval = intervals[i];
+		mi->addItem(OptionMenuItem(labels[i], [=]() { return controlRate->interval == interval; }, [=]() { controlRate->interval = interval; }));
+	}
+	return mi;
+}
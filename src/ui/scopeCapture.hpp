@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include "rack.hpp"
+
+// Carries a scope trace from the audio thread to the UI without locks. The audio thread keeps one point in every
+// `decimation` samples in a ring, and every few points copies the ring out, oldest first, into the spare frame of a
+// triple buffer and swaps it in. The UI picks up the newest frame when it draws and has it to itself until the next
+// draw, so a trace is never half written. Points are float_4 so up to four traces, e.g. X and Y of two curves, share
+// one capture. SIZE must be a power of 2.
+template <int SIZE>
+struct ScopeCapture {
+	// Points between frames handed to the UI
+	static const int PUBLISH_INTERVAL = 4;
+	// Set on the middle frame's index when the audio thread has put a new trace there
+	static const int FRESH_FRAME = 4;
+
+	int decimation = 1;
+	int sampleCounter = 0;
+	int ringIndex = 0;
+	int unpublished = 0;
+	simd::float_4 ring[SIZE] = {};
+
+	// The audio thread owns frames[backFrame], the UI frames[frontFrame], and the third is passed between them
+	simd::float_4 frames[3][SIZE] = {};
+	int backFrame = 0;
+	int frontFrame = 1;
+	std::atomic<int> middleFrame {2};
+
+	void setDecimation(int samples) {
+		decimation = std::max(samples, 1);
+	}
+
+	// Audio thread, every sample
+	void process(simd::float_4 point) {
+		if (++sampleCounter < decimation)
+			return;
+		sampleCounter = 0;
+		ring[ringIndex] = point;
+		ringIndex = (ringIndex + 1) & (SIZE - 1);
+		if (++unpublished >= PUBLISH_INTERVAL) {
+			unpublished = 0;
+			publish();
+		}
+	}
+
+	void publish() {
+		simd::float_4 *frame = frames[backFrame];
+		std::copy(ring + ringIndex, ring + SIZE, frame);
+		std::copy(ring, ring + ringIndex, frame + (SIZE - ringIndex));
+		backFrame = middleFrame.exchange(backFrame | FRESH_FRAME, std::memory_order_acq_rel) & ~FRESH_FRAME;
+	}
+
+	// UI thread. The trace returned stays as it is until the next call
+	const simd::float_4 *snapshot() {
+		if (middleFrame.load(std::memory_order_relaxed) & FRESH_FRAME)
+			frontFrame = middleFrame.exchange(frontFrame, std::memory_order_acq_rel) & ~FRESH_FRAME;
+		return frames[frontFrame];
+	}
+};